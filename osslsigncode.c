@@ -80,6 +80,8 @@
 #include <stdlib.h>
 #ifndef _WIN32
 #include <unistd.h>
+#else
+#include <io.h>
 #endif /* _WIN32 */
 #include <string.h>
 #include <time.h>
@@ -96,6 +98,12 @@
 #ifdef HAVE_TERMIOS_H
 #include <termios.h>
 #endif /* HAVE_TERMIOS_H */
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <errno.h>
+#include <dirent.h>
 #endif /* _WIN32 */
 
 #include <openssl/err.h>
@@ -113,6 +121,11 @@
 #ifndef OPENSSL_NO_ENGINE
 #include <openssl/engine.h>
 #endif /* OPENSSL_NO_ENGINE */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/provider.h>
+#include <openssl/store.h>
+#include <openssl/ui.h>
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
 
 #include "msi.h"
 
@@ -139,6 +152,24 @@
 #define PROVIDE_ASKPASS 1
 #endif
 
+#ifndef _WIN32
+#define PROVIDE_SIGNER_CMD 1
+#endif
+
+/*
+ * SystemTap/DTrace compatible static probes ("--enable-sdt" configure option)
+ * Each probe is a single nop instruction until a tracer is attached.
+ * The first argument is the file type, the second one is the number of bytes.
+ * The add_timestamp probes pass the RFC 3161 flag, the server index
+ * and the result instead.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define USDT_PROBE2(name, type, bytes) DTRACE_PROBE2(osslsigncode, name, type, bytes)
+#else
+#define USDT_PROBE2(name, type, bytes)
+#endif /* HAVE_SYS_SDT_H */
+
 #ifdef _WIN32
 #define FILE_CREATE_MODE "w+b"
 #else
@@ -227,6 +258,12 @@ typedef struct {
 	char *p11module;
 	char *p11cert;
 #endif /* OPENSSL_NO_ENGINE */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	char *provider;
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+#ifdef PROVIDE_SIGNER_CMD
+	char *signer_cmd;
+#endif /* PROVIDE_SIGNER_CMD */
 	int askpass;
 	char *readpass;
 	char *pass;
@@ -234,6 +271,7 @@ typedef struct {
 	int pagehash;
 	char *desc;
 	const EVP_MD *md;
+	const EVP_MD *md2; /* second message digest for dual signing */
 	char *url;
 	time_t signing_time;
 #ifdef ENABLE_CURL
@@ -247,6 +285,8 @@ typedef struct {
 	int addBlob;
 	int nest;
 	int timestamp_expiration;
+	int chain_first;
+	int digest_only;
 	int verbose;
 	int add_msi_dse;
 	char *catalog;
@@ -255,7 +295,22 @@ typedef struct {
 	char *tsa_cafile;
 	char *tsa_crlfile;
 	char *leafhash;
+	uint32_t range_first;
+	uint32_t range_last;
+	char *digest;
+	char *pagehashfile;
+	char *indexfile;
+	char *query;
+	char **infiles;
+	int ninfiles;
+	char *thumbprint;
 	int jp;
+	char *sigcache;
+	char *sigcache_file;
+	int sigcache_hit;
+	char *skip_signed_by;
+	int require_digest_match;
+	char *tracefile;
 } GLOBAL_OPTIONS;
 
 typedef struct {
@@ -276,6 +331,17 @@ typedef struct {
 	STACK_OF(X509) *certs;
 	STACK_OF(X509) *xcerts;
 	STACK_OF(X509_CRL) *crls;
+#ifndef OPENSSL_NO_ENGINE
+	ENGINE *engine;
+#endif /* OPENSSL_NO_ENGINE */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PROVIDER *provider;
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+#ifdef PROVIDE_SIGNER_CMD
+	pid_t signer_pid;
+	FILE *signer_in; /* requests to the external signer */
+	FILE *signer_out; /* responses from the external signer */
+#endif /* PROVIDE_SIGNER_CMD */
 } CRYPTO_PARAMS;
 
 typedef struct {
@@ -285,6 +351,362 @@ typedef struct {
 	int len_msiex;
 } MSI_PARAMS;
 
+/*
+ * Per-phase instrumentation ("-timings", "-trace" and "-memstats" options)
+ * A phase is measured between phase_begin() and phase_end(),
+ * the number of calls, the elapsed time and the processed bytes
+ * are accumulated for each phase type and printed on exit.
+ * With "-trace" every phase is also appended to a Chrome trace-event file.
+ * With "-memstats" the OpenSSL allocations are charged to the current phase.
+ * Both functions return immediately when the instrumentation is disabled.
+ */
+typedef enum {
+	PHASE_OPTIONS,
+	PHASE_CRYPTO_PARAMS,
+	PHASE_MAP_FILE,
+	PHASE_VALIDATION,
+	PHASE_DIGEST,
+	PHASE_PAGE_HASH,
+	PHASE_SIGNING,
+	PHASE_TIMESTAMP,
+	PHASE_APPEND,
+	PHASE_CHECKSUM,
+	PHASE_VERIFY,
+	PHASE_COUNT
+} phase_type_t;
+
+typedef struct {
+	phase_type_t type;
+	phase_type_t parent;
+	uint64_t start;
+} PHASE;
+
+typedef struct {
+	uint64_t calls;
+	uint64_t nsec;
+	uint64_t bytes;
+} PHASE_STATS;
+
+static const char *phase_names[PHASE_COUNT] = {
+	"options", "crypto params", "map file", "validation", "digest", "page hash",
+	"signing", "timestamp", "append signature", "checksum", "verification"
+};
+
+typedef struct {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t bytes;
+	uint64_t peak;
+} MEM_STATS;
+
+/* the size prefix of every allocated block, keeps the malloc() alignment */
+#define MEM_HEADER 16
+
+static int phase_timings = 0;
+static PHASE_STATS phase_stats[PHASE_COUNT];
+static int phase_memstats = 0;
+/* PHASE_COUNT outside of any phase */
+static phase_type_t phase_current = PHASE_COUNT;
+static MEM_STATS mem_stats[PHASE_COUNT+1];
+static uint64_t mem_live, mem_peak;
+static FILE *phase_trace = NULL;
+static uint64_t phase_trace_start;
+static int phase_trace_pid;
+
+/* Monotonic clock in nanoseconds */
+static uint64_t phase_clock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000
+		+ (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 / (uint64_t)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif /* _WIN32 */
+}
+
+/*
+ * The trace file is opened for appending, so that several processes
+ * signing or verifying a batch of files can share it.
+ * Only the process creating the file writes the opening bracket,
+ * the exclusive create decides which one it is.
+ * Each process is shown as a separate track identified by its PID.
+ * Events are written one line at a time with a trailing comma
+ * and the closing bracket omitted, both allowed by the trace-event format.
+ */
+static int phase_trace_open(const char *tracefile)
+{
+#ifdef _WIN32
+	int fd = _open(tracefile, _O_WRONLY | _O_CREAT | _O_EXCL | _O_APPEND | _O_BINARY,
+		_S_IREAD | _S_IWRITE);
+
+	if (fd >= 0) {
+		if (_write(fd, "[\n", 2) != 2) {
+			_close(fd);
+			return 0; /* FAILED */
+		}
+		phase_trace = _fdopen(fd, "a");
+	} else {
+		phase_trace = fopen(tracefile, "a");
+	}
+#else
+	int fd = open(tracefile, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0666);
+
+	if (fd >= 0) {
+		if (write(fd, "[\n", 2) != 2) {
+			close(fd);
+			return 0; /* FAILED */
+		}
+		phase_trace = fdopen(fd, "a");
+	} else {
+		phase_trace = fopen(tracefile, "a");
+	}
+#endif /* _WIN32 */
+	if (!phase_trace)
+		return 0; /* FAILED */
+	setvbuf(phase_trace, NULL, _IOLBF, 0);
+#ifdef _WIN32
+	phase_trace_pid = (int)GetCurrentProcessId();
+#else
+	phase_trace_pid = (int)getpid();
+#endif /* _WIN32 */
+	return 1; /* OK */
+}
+
+static void phase_trace_string(const char *str)
+{
+	fputc('"', phase_trace);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(phase_trace, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(phase_trace, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, phase_trace);
+	}
+	fputc('"', phase_trace);
+}
+
+static void phase_trace_event(const char *name, uint64_t start, uint64_t end, uint64_t bytes)
+{
+	fprintf(phase_trace, "{\"name\":\"%s\",\"cat\":\"osslsigncode\",\"ph\":\"X\","
+		"\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"bytes\":%llu}},\n",
+		name, (double)start / 1e3, (double)(end - start) / 1e3,
+		phase_trace_pid, phase_trace_pid, (unsigned long long)bytes);
+}
+
+/*
+ * OpenSSL memory functions for "-memstats"
+ * Every block is prefixed with its size, so that the live bytes
+ * can be updated on free and realloc.
+ */
+static void mem_charge(size_t num)
+{
+	MEM_STATS *stats = &mem_stats[phase_current];
+
+	stats->allocs++;
+	stats->bytes += num;
+	mem_live += num;
+	if (mem_live > mem_peak)
+		mem_peak = mem_live;
+	if (mem_live > stats->peak)
+		stats->peak = mem_live;
+}
+
+static void *mem_malloc(size_t num, const char *file, int line)
+{
+	u_char *ptr;
+
+	/* suppress compiler warnings */
+	(void)file;
+	(void)line;
+
+	if (num > SIZE_MAX - MEM_HEADER)
+		return NULL;
+	ptr = malloc(num + MEM_HEADER);
+	if (!ptr)
+		return NULL;
+	memcpy(ptr, &num, sizeof num);
+	mem_charge(num);
+	return ptr + MEM_HEADER;
+}
+
+static void *mem_realloc(void *addr, size_t num, const char *file, int line)
+{
+	u_char *ptr;
+	size_t old;
+
+	if (!addr)
+		return mem_malloc(num, file, line);
+	if (num > SIZE_MAX - MEM_HEADER)
+		return NULL;
+	ptr = (u_char *)addr - MEM_HEADER;
+	memcpy(&old, ptr, sizeof old);
+	ptr = realloc(ptr, num + MEM_HEADER);
+	if (!ptr)
+		return NULL;
+	memcpy(ptr, &num, sizeof num);
+	/* a reallocation is counted as a free and an allocation */
+	mem_live -= old;
+	mem_stats[phase_current].frees++;
+	mem_charge(num);
+	return ptr + MEM_HEADER;
+}
+
+static void mem_free(void *addr, const char *file, int line)
+{
+	u_char *ptr;
+	size_t old;
+
+	/* suppress compiler warnings */
+	(void)file;
+	(void)line;
+
+	if (!addr)
+		return;
+	ptr = (u_char *)addr - MEM_HEADER;
+	memcpy(&old, ptr, sizeof old);
+	mem_live -= old;
+	mem_stats[phase_current].frees++;
+	free(ptr);
+}
+
+static bool on_list(const char *txt, const char *list[]);
+
+/*
+ * The instrumentation has to be enabled before the options are parsed,
+ * the memory functions before the first OpenSSL allocation.
+ * The trace file is only opened after the options have been validated.
+ */
+static void phase_configure(int argc, char **argv)
+{
+	/* the options parsed by main_configure() with a value */
+	const char *opts_value[] = {"-in", "-out", "-sigin", "-spc", "-certs", "-ac", "-key",
+		"-pkcs12", "-pkcs11cert", "-pkcs11engine", "-pkcs11module", "-signer-cmd", "-provider",
+		"-pass", "-readpass", "-n", "-h", "-i", "-sigcache", "-skip-if-signed-by", "-st", "-t",
+		"-ts", "-p", "-trace", "-chaincache", "-c", "-catalog", "-CAfile", "-CRLfile",
+		"-untrusted", "-TSA-CAfile", "-CRLuntrusted", "-TSA-CRLfile", "-require-leaf-hash",
+		"-digest", "-pagehash", "-index", "-thumbprint", "-query", "-range", "-jp", NULL};
+	int i;
+
+	/* the span of the whole process starts here */
+	phase_trace_start = phase_clock();
+	for (i=1; i<argc; i++) {
+		if (on_list(argv[i], opts_value))
+			i++; /* e.g. "-n -timings" is a description */
+		else if (!strcmp(argv[i], "-timings"))
+			phase_timings = 1;
+		else if (!strcmp(argv[i], "-memstats") && !phase_memstats)
+			phase_memstats = CRYPTO_set_mem_functions(mem_malloc, mem_realloc, mem_free);
+	}
+}
+
+static void phase_begin(PHASE *phase, phase_type_t type)
+{
+	if (!phase_timings && !phase_trace && !phase_memstats)
+		return;
+	phase->type = type;
+	phase->parent = phase_current;
+	phase_current = type;
+	phase->start = phase_clock();
+}
+
+static void phase_end(PHASE *phase, uint64_t bytes)
+{
+	PHASE_STATS *stats;
+	uint64_t end;
+
+	if (!phase_timings && !phase_trace && !phase_memstats)
+		return;
+	end = phase_clock();
+	phase_current = phase->parent;
+	stats = &phase_stats[phase->type];
+	stats->calls++;
+	stats->nsec += end - phase->start;
+	stats->bytes += bytes;
+	if (phase_trace)
+		phase_trace_event(phase_names[phase->type], phase->start, end, bytes);
+}
+
+/* Close the trace with a span covering the whole run of the process */
+static void phase_trace_close(const char *cmd, const char *infile, int ret)
+{
+	if (!phase_trace)
+		return;
+	fprintf(phase_trace, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":",
+		phase_trace_pid);
+	phase_trace_string(infile ? infile : "osslsigncode");
+	fprintf(phase_trace, "}},\n");
+	fprintf(phase_trace, "{\"name\":");
+	phase_trace_string(cmd);
+	fprintf(phase_trace, ",\"cat\":\"osslsigncode\",\"ph\":\"X\","
+		"\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"result\":\"%s\"}},\n",
+		(double)phase_trace_start / 1e3, (double)(phase_clock() - phase_trace_start) / 1e3,
+		phase_trace_pid, phase_trace_pid, ret ? "Failed" : "Succeeded");
+	fclose(phase_trace);
+	phase_trace = NULL;
+}
+
+static void phase_print(void)
+{
+	int i;
+
+	if (!phase_timings)
+		return;
+	printf("\n%-18s %8s %12s %14s %10s\n", "Phase", "Calls", "Time [ms]", "Bytes", "MB/s");
+	for (i=0; i<PHASE_COUNT; i++) {
+		PHASE_STATS *stats = &phase_stats[i];
+		if (!stats->calls)
+			continue;
+		printf("%-18s %8llu %12.3f %14llu", phase_names[i], (unsigned long long)stats->calls,
+			(double)stats->nsec / 1e6, (unsigned long long)stats->bytes);
+		if (stats->bytes && stats->nsec)
+			printf(" %10.1f\n", (double)stats->bytes * 1e3 / (double)stats->nsec);
+		else
+			printf(" %10s\n", "-");
+	}
+	printf("\n");
+}
+
+/* Phases sorted by the allocated bytes, the peak is the highest live total seen in a phase */
+static void phase_print_memstats(void)
+{
+	int i, j, order[PHASE_COUNT+1];
+	MEM_STATS total;
+
+	if (!phase_memstats)
+		return;
+	memset(&total, 0, sizeof(MEM_STATS));
+	for (i=0; i<=PHASE_COUNT; i++) {
+		for (j=i; j>0 && mem_stats[order[j-1]].bytes < mem_stats[i].bytes; j--)
+			order[j] = order[j-1];
+		order[j] = i;
+		total.allocs += mem_stats[i].allocs;
+		total.frees += mem_stats[i].frees;
+		total.bytes += mem_stats[i].bytes;
+	}
+	printf("\n%-18s %10s %10s %14s %14s\n", "Phase", "Allocs", "Frees", "Bytes", "Peak live");
+	for (i=0; i<=PHASE_COUNT; i++) {
+		MEM_STATS *stats = &mem_stats[order[i]];
+		if (!stats->allocs && !stats->frees)
+			continue;
+		printf("%-18s %10llu %10llu %14llu %14llu\n",
+			order[i] < PHASE_COUNT ? phase_names[order[i]] : "other",
+			(unsigned long long)stats->allocs, (unsigned long long)stats->frees,
+			(unsigned long long)stats->bytes, (unsigned long long)stats->peak);
+	}
+	printf("%-18s %10llu %10llu %14llu %14llu\n", "total",
+		(unsigned long long)total.allocs, (unsigned long long)total.frees,
+		(unsigned long long)total.bytes, (unsigned long long)mem_peak);
+	printf("Still allocated before the OpenSSL cleanup: %llu bytes\n\n", (unsigned long long)mem_live);
+}
+
 /*
  * ASN.1 definitions (more or less from official MS Authenticode docs)
 */
@@ -750,6 +1172,61 @@ static void tohex(const unsigned char *v, char *b, int len)
 		sprintf(b+i*2, "%02X", v[i]);
 }
 
+/*
+ * Message digest algorithms fetched once per process
+ * With OpenSSL 3 every EVP_DigestInit() with an implicitly fetched algorithm
+ * (EVP_sha256(), EVP_get_digestbynid()) repeats the provider lookup,
+ * an explicitly fetched EVP_MD skips it.  The table is freed on exit.
+ */
+#define DIGEST_TABLE_SIZE 16
+
+static struct {
+	int nid;
+	EVP_MD *md;
+} digest_table[DIGEST_TABLE_SIZE];
+static int digest_table_count = 0;
+
+static const EVP_MD *digest_by_nid(int nid)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MD *md;
+	int i;
+
+	for (i=0; i<digest_table_count; i++)
+		if (digest_table[i].nid == nid)
+			return digest_table[i].md;
+	if (nid == NID_undef || digest_table_count == DIGEST_TABLE_SIZE)
+		return EVP_get_digestbynid(nid);
+	md = EVP_MD_fetch(NULL, OBJ_nid2sn(nid), NULL);
+	if (!md) /* e.g. provided by an engine */
+		return EVP_get_digestbynid(nid);
+	digest_table[digest_table_count].nid = nid;
+	digest_table[digest_table_count].md = md;
+	digest_table_count++;
+	return md;
+#else
+	return EVP_get_digestbynid(nid);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+}
+
+static const EVP_MD *digest_by_name(const char *name)
+{
+	const EVP_MD *md = EVP_get_digestbyname(name);
+
+	return md ? digest_by_nid(EVP_MD_type(md)) : NULL;
+}
+
+static void digest_table_free(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	int i;
+
+	for (i=0; i<digest_table_count; i++)
+		EVP_MD_free(digest_table[i].md);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+	digest_table_count = 0;
+}
+
 static int is_content_type(PKCS7 *p7, const char *objid)
 {
 	ASN1_OBJECT *indir_objid;
@@ -1080,20 +1557,32 @@ static int add_timestamp_authenticode(PKCS7 *sig, GLOBAL_OPTIONS *options)
 {
 	int i;
 	for (i=0; i<options->nturl; i++) {
-		int res = add_timestamp(sig, options->turl[i], options->proxy, 0, NULL,
+		PHASE phase;
+		int res;
+		phase_begin(&phase, PHASE_TIMESTAMP);
+		USDT_PROBE2(add_timestamp_entry, 0, i);
+		res = add_timestamp(sig, options->turl[i], options->proxy, 0, NULL,
 				options->verbose || options->nturl == 1, options->noverifypeer);
+		USDT_PROBE2(add_timestamp_return, 0, res);
+		phase_end(&phase, 0);
 		if (!res)
 			return 0; /* OK */
 	}
 	return 1; /* FAILED */
 }
 
-static int add_timestamp_rfc3161(PKCS7 *sig, GLOBAL_OPTIONS *options)
+static int add_timestamp_rfc3161(PKCS7 *sig, const EVP_MD *md, GLOBAL_OPTIONS *options)
 {
 	int i;
 	for (i=0; i<options->ntsurl; i++) {
-		int res = add_timestamp(sig, options->tsurl[i], options->proxy, 1, options->md,
+		PHASE phase;
+		int res;
+		phase_begin(&phase, PHASE_TIMESTAMP);
+		USDT_PROBE2(add_timestamp_entry, 1, i);
+		res = add_timestamp(sig, options->tsurl[i], options->proxy, 1, md,
 				options->verbose || options->ntsurl == 1, options->noverifypeer);
+		USDT_PROBE2(add_timestamp_return, 1, res);
+		phase_end(&phase, 0);
 		if (!res)
 			return 0; /* OK */
 	}
@@ -1119,6 +1608,10 @@ static void usage(const char *argv0, const char *cmd)
 	const char *cmds_extract[] = {"all", "extract-signature", NULL};
 	const char *cmds_remove[] = {"all", "remove-signature", NULL};
 	const char *cmds_verify[] = {"all", "verify", NULL};
+	const char *cmds_verify_pages[] = {"all", "verify-pages", NULL};
+	const char *cmds_verify_digest[] = {"all", "verify-digest", NULL};
+	const char *cmds_inventory[] = {"all", "inventory", NULL};
+	const char *cmds_status[] = {"all", "status", NULL};
 
 	printf("\nUsage: %s", argv0);
 	if (on_list(cmd, cmds_all)) {
@@ -1127,16 +1620,25 @@ static void usage(const char *argv0, const char *cmd)
 	}
 	if (on_list(cmd, cmds_sign)) {
 		printf("%1s[ sign ] ( -certs | -spc <certfile> -key <keyfile> | -pkcs12 <pkcs12file> |\n", "");
-		printf("%12s  [ -pkcs11engine <engine> ] -pkcs11module <module> -certs <certfile> -key <pkcs11 key id>)\n", "");
+		printf("%12s  [ -pkcs11engine <engine> ] -pkcs11module <module> -certs <certfile> -key <pkcs11 key id>\n", "");
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		printf("%12s| [ -provider <provider> ] [ -certs <certfile> ] -key <store URI>\n", "");
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+#ifdef PROVIDE_SIGNER_CMD
+		printf("%12s| -certs <certfile> -signer-cmd <command>\n", "");
+#endif /* PROVIDE_SIGNER_CMD */
+		printf("%12s)\n", "");
 		printf("%12s[ -pass <password>", "");
 #ifdef PROVIDE_ASKPASS
 		printf("%1s [ -askpass ]", "");
 #endif /* PROVIDE_ASKPASS */
 		printf("%1s[ -readpass <file> ]\n", "");
 		printf("%12s[ -ac <crosscertfile> ]\n", "");
-		printf("%12s[ -h {md5,sha1,sha2(56),sha384,sha512} ]\n", "");
+		printf("%12s[ -h {md5,sha1,sha2(56),sha384,sha512} [ -h ... ] ]\n", "");
 		printf("%12s[ -n <desc> ] [ -i <url> ] [ -jp <level> ] [ -comm ]\n", "");
 		printf("%12s[ -ph ]\n", "");
+		printf("%12s[ -sigcache <directory> ]\n", "");
+		printf("%12s[ -skip-if-signed-by XXXXXXXXXXXX... [ -require-digest-match ] ]\n", "");
 #ifdef ENABLE_CURL
 		printf("%12s[ -t <timestampurl> [ -t ... ] [ -p <proxy> ] [ -noverifypeer  ]\n", "");
 		printf("%12s[ -ts <timestampurl> [ -ts ... ] [ -p <proxy> ] [ -noverifypeer ] ]\n", "");
@@ -1144,7 +1646,7 @@ static void usage(const char *argv0, const char *cmd)
 		printf("%12s[ -st <unix-time> ]\n", "");
 		printf("%12s[ -addUnauthenticatedBlob ]\n", "");
 		printf("%12s[ -nest ]\n", "");
-		printf("%12s[ -verbose ]\n", "");
+		printf("%12s[ -verbose ] [ -timings ] [ -trace <file> ] [ -memstats ]\n", "");
 		printf("%12s[ -add-msi-dse ]\n", "");
 		printf("%12s[ -in ] <infile> [-out ] <outfile>\n\n", "");
 	}
@@ -1164,6 +1666,7 @@ static void usage(const char *argv0, const char *cmd)
 		printf("%12s[ -CRLfile <infile> ]\n", "");
 		printf("%12s[ -TSA-CAfile <infile> ]\n", "");
 		printf("%12s[ -TSA-CRLfile <infile> ]\n", "");
+		printf("%12s[ -chaincache <directory> ]\n", "");
 		printf("%12s[ -nest ]\n", "");
 		printf("%12s[ -add-msi-dse ]\n", "");
 		printf("%12s[ -in ] <infile> [ -out ] <outfile>\n\n", "");
@@ -1183,7 +1686,45 @@ static void usage(const char *argv0, const char *cmd)
 		printf("%12s[ -TSA-CRLfile <infile> ]\n", "");
 		printf("%12s[ -require-leaf-hash {md5,sha1,sha2(56),sha384,sha512}:XXXXXXXXXXXX... ]\n", "");
 		printf("%12s[ -timestamp-expiration ]\n", "");
-		printf("%12s[ -verbose ]\n\n", "");
+		printf("%12s[ -chaincache <directory> ]\n", "");
+		printf("%12s[ -chain-first | -digest-only ]\n", "");
+		printf("%12s[ -verbose ] [ -timings ] [ -trace <file> ] [ -memstats ]\n\n", "");
+	}
+	if (on_list(cmd, cmds_verify_pages)) {
+		printf("%1sverify-pages [ -in ] <infile>\n", "");
+		printf("%12s[ -range <first>-[<last>] ]\n", "");
+		printf("%12s[ -CAfile <infile> ]\n", "");
+		printf("%12s[ -CRLfile <infile> ]\n", "");
+		printf("%12s[ -TSA-CAfile <infile> ]\n", "");
+		printf("%12s[ -TSA-CRLfile <infile> ]\n", "");
+		printf("%12s[ -require-leaf-hash {md5,sha1,sha2(56),sha384,sha512}:XXXXXXXXXXXX... ]\n", "");
+		printf("%12s[ -timestamp-expiration ]\n", "");
+		printf("%12s[ -chaincache <directory> ]\n", "");
+		printf("%12s[ -verbose ] [ -timings ] [ -trace <file> ] [ -memstats ]\n\n", "");
+	}
+	if (on_list(cmd, cmds_verify_digest)) {
+		printf("%1sverify-digest [ -sigin ] <sigfile>\n", "");
+		printf("%12s-digest {md5,sha1,sha2(56),sha384,sha512}:XXXXXXXXXXXX...\n", "");
+		printf("%12s[ -pagehash <infile> ]\n", "");
+		printf("%12s[ -CAfile <infile> ]\n", "");
+		printf("%12s[ -CRLfile <infile> ]\n", "");
+		printf("%12s[ -TSA-CAfile <infile> ]\n", "");
+		printf("%12s[ -TSA-CRLfile <infile> ]\n", "");
+		printf("%12s[ -require-leaf-hash {md5,sha1,sha2(56),sha384,sha512}:XXXXXXXXXXXX... ]\n", "");
+		printf("%12s[ -timestamp-expiration ]\n", "");
+		printf("%12s[ -chaincache <directory> ]\n", "");
+		printf("%12s[ -verbose ] [ -timings ] [ -trace <file> ] [ -memstats ]\n\n", "");
+	}
+	if (on_list(cmd, cmds_inventory)) {
+		printf("%1sinventory -index <indexfile>\n", "");
+		printf("%12s[ -query [serial:]XXXXXXXXXXXX... ]\n", "");
+		printf("%12s[ -verbose ]\n", "");
+		printf("%12s[ [ -in ] <file or directory> ]\n\n", "");
+	}
+	if (on_list(cmd, cmds_status)) {
+		printf("%1sstatus [ -thumbprint XXXXXXXXXXXX... ]\n", "");
+		printf("%12s[ -verbose ]\n", "");
+		printf("%12s[ -in ] <infile> [ <infile> ... ]\n\n", "");
 	}
 }
 
@@ -1196,21 +1737,30 @@ static void help_for(const char *argv0, const char *cmd)
 	const char *cmds_remove[] = {"remove-signature", NULL};
 	const char *cmds_sign[] = {"sign", NULL};
 	const char *cmds_verify[] = {"verify", NULL};
+	const char *cmds_verify_pages[] = {"verify-pages", NULL};
+	const char *cmds_verify_digest[] = {"verify-digest", NULL};
+	const char *cmds_inventory[] = {"inventory", NULL};
+	const char *cmds_status[] = {"status", NULL};
 	const char *cmds_ac[] = {"sign", NULL};
 	const char *cmds_add_msi_dse[] = {"sign", NULL};
 	const char *cmds_addUnauthenticatedBlob[] = {"sign", "add", NULL};
 #ifdef PROVIDE_ASKPASS
 	const char *cmds_askpass[] = {"sign", NULL};
 #endif /* PROVIDE_ASKPASS */
-	const char *cmds_CAfile[] = {"attach-signature", "verify", NULL};
+	const char *cmds_CAfile[] = {"attach-signature", "verify", "verify-digest", "verify-pages", NULL};
 	const char *cmds_catalog[] = {"verify", NULL};
 	const char *cmds_certs[] = {"sign", NULL};
+	const char *cmds_chain_first[] = {"verify", NULL};
+	const char *cmds_chaincache[] = {"attach-signature", "verify", "verify-digest", "verify-pages", NULL};
+	const char *cmds_digest[] = {"verify-digest", NULL};
+	const char *cmds_digest_only[] = {"verify", NULL};
 	const char *cmds_comm[] = {"sign", NULL};
-	const char *cmds_CRLfile[] = {"attach-signature", "verify", NULL};
-	const char *cmds_CRLfileTSA[] = {"attach-signature", "verify", NULL};
+	const char *cmds_CRLfile[] = {"attach-signature", "verify", "verify-digest", "verify-pages", NULL};
+	const char *cmds_CRLfileTSA[] = {"attach-signature", "verify", "verify-digest", "verify-pages", NULL};
 	const char *cmds_h[] = {"sign", NULL};
 	const char *cmds_i[] = {"sign", NULL};
-	const char *cmds_in[] = {"add", "attach-signature", "extract-signature", "remove-signature", "sign", "verify", NULL};
+	const char *cmds_in[] = {"add", "attach-signature", "extract-signature", "remove-signature", "sign", "verify", "verify-pages", NULL};
+	const char *cmds_index[] = {"inventory", NULL};
 	const char *cmds_jp[] = {"sign", NULL};
 	const char *cmds_key[] = {"sign", NULL};
 	const char *cmds_n[] = {"sign", NULL};
@@ -1223,23 +1773,42 @@ static void help_for(const char *argv0, const char *cmd)
 	const char *cmds_p[] = {"add", "sign", NULL};
 #endif /* ENABLE_CURL */
 	const char *cmds_pass[] = {"sign", NULL};
+	const char *cmds_pagehash[] = {"verify-digest", NULL};
 	const char *cmds_pem[] = {"extract-signature", NULL};
 	const char *cmds_ph[] = {"sign", NULL};
 	const char *cmds_pkcs11cert[] = {"sign", NULL};
 	const char *cmds_pkcs11engine[] = {"sign", NULL};
 	const char *cmds_pkcs11module[] = {"sign", NULL};
 	const char *cmds_pkcs12[] = {"sign", NULL};
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	const char *cmds_provider[] = {"sign", NULL};
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+	const char *cmds_query[] = {"inventory", NULL};
+	const char *cmds_range[] = {"verify-pages", NULL};
 	const char *cmds_readpass[] = {"sign", NULL};
-	const char *cmds_require_leaf_hash[] = {"verify", NULL};
-	const char *cmds_sigin[] = {"attach-signature", NULL};
+	const char *cmds_require_digest_match[] = {"sign", NULL};
+	const char *cmds_require_leaf_hash[] = {"verify", "verify-digest", "verify-pages", NULL};
+	const char *cmds_sigcache[] = {"sign", NULL};
+	const char *cmds_sigin[] = {"attach-signature", "verify-digest", NULL};
+#ifdef PROVIDE_SIGNER_CMD
+	const char *cmds_signer_cmd[] = {"sign", NULL};
+#endif /* PROVIDE_SIGNER_CMD */
+	const char *cmds_skip_if_signed_by[] = {"sign", NULL};
 	const char *cmds_st[] = {"sign", NULL};
-	const char *cmds_timestamp_expiration[] = {"verify", NULL};
+	const char *cmds_thumbprint[] = {"status", NULL};
+	const char *cmds_timestamp_expiration[] = {"verify", "verify-digest", "verify-pages", NULL};
+	const char *cmds_timings[] = {"add", "attach-signature", "extract-signature", "remove-signature", "sign", "verify",
+		"verify-digest", "verify-pages", NULL};
+	const char *cmds_memstats[] = {"add", "attach-signature", "extract-signature", "remove-signature", "sign", "verify",
+		"verify-digest", "verify-pages", NULL};
+	const char *cmds_trace[] = {"add", "attach-signature", "extract-signature", "remove-signature", "sign", "verify",
+		"verify-digest", "verify-pages", NULL};
 #ifdef ENABLE_CURL
 	const char *cmds_t[] = {"add", "sign", NULL};
 	const char *cmds_ts[] = {"add", "sign", NULL};
 #endif /* ENABLE_CURL */
-	const char *cmds_CAfileTSA[] = {"attach-signature", "verify", NULL};
-	const char *cmds_verbose[] = {"add", "sign", "verify", NULL};
+	const char *cmds_CAfileTSA[] = {"attach-signature", "verify", "verify-digest", "verify-pages", NULL};
+	const char *cmds_verbose[] = {"add", "inventory", "sign", "status", "verify", "verify-digest", "verify-pages", NULL};
 
 	if (on_list(cmd, cmds_all)) {
 		printf("osslsigncode is a small tool that implements part of the functionality of the Microsoft\n");
@@ -1254,8 +1823,12 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("%-22s = sign file using a given signature\n", "attach-signature");
 		printf("%-22s = extract signature from a previously-signed file\n", "extract-signature");
 		printf("%-22s = remove sections of the embedded signature on a file\n", "remove-signature");
+		printf("%-22s = indexes the signing certificates of files for later lookups\n", "inventory");
 		printf("%-22s = digitally sign a file\n", "sign");
-		printf("%-22s = verifies the digital signature of a file\n\n", "verify");
+		printf("%-22s = reports whether files are signed without hashing them\n", "status");
+		printf("%-22s = verifies the digital signature of a file\n", "verify");
+		printf("%-22s = verifies a detached signature against a precomputed file digest\n", "verify-digest");
+		printf("%-22s = verifies the page hashes of a byte range of a signed PE file\n\n", "verify-pages");
 		printf("For help on a specific command, enter %s <command> --help\n", argv0);
 	}
 	if (on_list(cmd, cmds_add)) {
@@ -1292,6 +1865,33 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("and to specify how to find needed CA or TSA certificates, if appropriate.\n\n");
 		printf("Options:\n");
 	}
+	if (on_list(cmd, cmds_verify_digest)) {
+		printf("\nUse the \"verify-digest\" command to verify a detached signature without the signed file.\n");
+		printf("The message digest stored in the signature is compared with the provided one,\n");
+		printf("then the signer, timestamp and CRLs are verified as with the \"verify\" command.\n\n");
+		printf("Options:\n");
+	}
+	if (on_list(cmd, cmds_inventory)) {
+		printf("\nUse the \"inventory\" command to find the files signed with a certificate, e.g. a revoked one.\n");
+		printf("The signer, intermediate and TSA certificates of the files in a directory tree are\n");
+		printf("written to a sorted index file, a rescan only reads the files changed since the last one.\n");
+		printf("The index is queried by the SHA-1 certificate thumbprint or the serial number.\n\n");
+		printf("Options:\n");
+	}
+	if (on_list(cmd, cmds_status)) {
+		printf("\nUse the \"status\" command to classify files as unsigned or signed without hashing them.\n");
+		printf("Only the file headers and the signature are read, the digest algorithms, the number\n");
+		printf("of nested signatures, the timestamp presence and the signer thumbprint are reported.\n");
+		printf("The signature is not verified.\n\n");
+		printf("Options:\n");
+	}
+	if (on_list(cmd, cmds_verify_pages)) {
+		printf("\nUse the \"verify-pages\" command to verify a part of a PE file signed with page hashes,\n");
+		printf("e.g. a partially downloaded file with its headers and signature already in place.\n");
+		printf("The signature is verified once, then the pages within the range are checked\n");
+		printf("against the page hashes, the file digest is not verified.\n\n");
+		printf("Options:\n");
+	}
 	if (on_list(cmd, cmds_ac))
 	printf("%-24s= additional certificates to be added to the signature block\n", "-ac");
 	if (on_list(cmd, cmds_add_msi_dse))
@@ -1308,18 +1908,42 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("%-24s= the file containing one or more trusted certificates in PEM format\n", "-CAfile");
 	if (on_list(cmd, cmds_certs))
 		printf("%-24s= the signing certificate to use\n", "-certs, -spc");
+	if (on_list(cmd, cmds_chain_first)) {
+		printf("%-24s= verify the signer, timestamp and CRLs before the file digest\n", "-chain-first");
+		printf("%26sso a file with an untrusted or revoked signer is not hashed\n", "");
+	}
+	if (on_list(cmd, cmds_chaincache)) {
+		printf("%-24s= the directory keeping the verified certificate chains between runs\n", "-chaincache");
+		printf("%26sowned by the user and not writable by the group or others\n", "");
+	}
 	if (on_list(cmd, cmds_comm))
 		printf("%-24s= set commercial purpose (default: individual purpose)\n", "-comm");
 	if (on_list(cmd, cmds_CRLfile))
 		printf("%-24s= the file containing one or more CRLs in PEM format\n", "-CRLfile");
+	if (on_list(cmd, cmds_digest)) {
+		printf("%-24s= {md5|sha1|sha2(56)|sha384|sha512}:XXXXXXXXXXXX...\n", "-digest");
+		printf("%26sthe Authenticode digest of the signed file, e.g. recorded at build time\n", "");
+	}
+	if (on_list(cmd, cmds_digest_only)) {
+		printf("%-24s= only compare the file with the digests and page hashes stored\n", "-digest-only");
+		printf("%26sin the signature, the signer is not verified\n", "");
+	}
 	if (on_list(cmd, cmds_h)) {
 		printf("%-24s= {md5|sha1|sha2(56)|sha384|sha512}\n", "-h");
 		printf("%26sset of cryptographic hash functions\n", "");
+		printf("%26sa second -h option adds a nested signature with another hash\n", "");
+		printf("%26s(dual signing in a single pass over the file)\n", "");
 	}
 	if (on_list(cmd, cmds_i))
 		printf("%-24s= specifies a URL for expanded description of the signed content\n", "-i");
 	if (on_list(cmd, cmds_in))
 		printf("%-24s= input file\n", "-in");
+	if (on_list(cmd, cmds_inventory))
+		printf("%-24s= input file or directory scanned recursively\n", "-in");
+	if (on_list(cmd, cmds_status))
+		printf("%-24s= input file, followed by any other input files\n", "-in");
+	if (on_list(cmd, cmds_index))
+		printf("%-24s= the index file created or updated by the scan\n", "-index");
 	if (on_list(cmd, cmds_jp)) {
 		printf("%-24s= low | medium | high\n", "-jp");
 		printf("%26slevels of permissions in Microsoft Internet Explorer 4.x for CAB files\n", "");
@@ -1343,6 +1967,10 @@ static void help_for(const char *argv0, const char *cmd)
 #endif /* ENABLE_CURL */
 	if (on_list(cmd, cmds_pass))
 		printf("%-24s= the private key password\n", "-pass");
+	if (on_list(cmd, cmds_pagehash)) {
+		printf("%-24s= the page hash table of the signed PE file (4-byte offsets and digests)\n", "-pagehash");
+		printf("%26scompared with the page hashes stored in the signature\n", "");
+	}
 	if (on_list(cmd, cmds_pem))
 		printf("%-24s= output data format PEM to use (default: DER)\n", "-pem");
 	if (on_list(cmd, cmds_ph))
@@ -1355,20 +1983,66 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("%-24s= PKCS11 module\n", "-pkcs11module");
 	if (on_list(cmd, cmds_pkcs12))
 		printf("%-24s= PKCS#12 container with the certificate and the private key\n", "-pkcs12");
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (on_list(cmd, cmds_provider)) {
+		printf("%-24s= OpenSSL 3 provider used to load the private key\n", "-provider");
+		printf("%26sfrom the OSSL_STORE URI given with the -key option\n", "");
+	}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+	if (on_list(cmd, cmds_query)) {
+		printf("%-24s= XXXXXXXXXXXX... | serial:XXXXXXXXXXXX...\n", "-query");
+		printf("%26slist the files signed with the certificate of the SHA-1 thumbprint\n", "");
+		printf("%26sor the serial number\n", "");
+	}
+	if (on_list(cmd, cmds_range)) {
+		printf("%-24s= <first>-[<last>]\n", "-range");
+		printf("%26sthe inclusive byte range of the pages to verify (default: the whole file)\n", "");
+		printf("%26sonly the pages entirely within the range are verified\n", "");
+	}
 	if (on_list(cmd, cmds_readpass))
 		printf("%-24s= the private key password source\n", "-readpass");
+	if (on_list(cmd, cmds_require_digest_match)) {
+		printf("%-24s= skip the file only if the file digests of its signatures\n", "-require-digest-match");
+		printf("%26smatch the file as well\n", "");
+	}
 	if (on_list(cmd, cmds_require_leaf_hash)) {
 		printf("%-24s= {md5|sha1|sha2(56)|sha384|sha512}:XXXXXXXXXXXX...\n", "-require-leaf-hash");
 		printf("%26sspecifies an optional hash algorithm to use when computing\n", "");
 		printf("%26sthe leaf certificate (in DER form) hash and compares\n", "");
 		printf("%26sthe provided hash against the computed hash\n", "");
 	}
+	if (on_list(cmd, cmds_sigcache)) {
+		printf("%-24s= directory of finished signatures reused when the same content\n", "-sigcache");
+		printf("%26sis signed again with the same signer and options\n", "");
+	}
 	if (on_list(cmd, cmds_sigin))
 		printf("%-24s= a file containing the signature to be attached\n", "-sigin");
+#ifdef PROVIDE_SIGNER_CMD
+	if (on_list(cmd, cmds_signer_cmd)) {
+		printf("%-24s= external command computing the signature instead of a private key\n", "-signer-cmd");
+		printf("%26sreads \"<digest name> <hex digest>\" lines and writes \"<hex signature>\" lines\n", "");
+	}
+#endif /* PROVIDE_SIGNER_CMD */
+	if (on_list(cmd, cmds_skip_if_signed_by)) {
+		printf("%-24s= XXXXXXXXXXXX...\n", "-skip-if-signed-by");
+		printf("%26sthe SHA-1 thumbprint of our signing certificate, the file with\n", "");
+		printf("%26sa primary signature of this signer is copied without signing\n", "");
+	}
 	if (on_list(cmd, cmds_st))
 		printf("%-24s= the unix-time to set the signing time\n", "-st");
+	if (on_list(cmd, cmds_thumbprint)) {
+		printf("%-24s= XXXXXXXXXXXX...\n", "-thumbprint");
+		printf("%26sthe SHA-1 thumbprint of our signing certificate, the files with\n", "");
+		printf("%26sa primary or nested signature of this signer are reported as \"matched\"\n", "");
+	}
 	if (on_list(cmd, cmds_timestamp_expiration))
 		printf("%-24s= verify a finite lifetime of the TSA private key\n", "-timestamp-expiration");
+	if (on_list(cmd, cmds_timings))
+		printf("%-24s= print the time and throughput of each processing phase\n", "-timings");
+	if (on_list(cmd, cmds_memstats))
+		printf("%-24s= print the OpenSSL allocations of each processing phase\n", "-memstats");
+	if (on_list(cmd, cmds_trace))
+		printf("%-24s= append the processing phases to a Chrome trace-event JSON file\n", "-trace");
 #ifdef ENABLE_CURL
 	if (on_list(cmd, cmds_t)) {
 		printf("%-24s= specifies that the digital signature will be timestamped\n", "-t");
@@ -1409,123 +2083,399 @@ typedef enum {
 	CMD_VERIFY,
 	CMD_ADD,
 	CMD_ATTACH,
+	CMD_VERIFY_PAGES,
+	CMD_VERIFY_DIGEST,
+	CMD_INVENTORY,
+	CMD_STATUS,
 	CMD_HELP
 } cmd_type_t;
 
 
-static SpcLink *get_obsolete_link(void)
-{
-	static const unsigned char obsolete[] = {
-		0x00, 0x3c, 0x00, 0x3c, 0x00, 0x3c, 0x00, 0x4f, 0x00, 0x62,
-		0x00, 0x73, 0x00, 0x6f, 0x00, 0x6c, 0x00, 0x65, 0x00, 0x74,
-		0x00, 0x65, 0x00, 0x3e, 0x00, 0x3e, 0x00, 0x3e
-	};
-	SpcLink *link = SpcLink_new();
-	link->type = 2;
-	link->value.file = SpcString_new();
-	link->value.file->type = 0;
-	link->value.file->value.unicode = ASN1_BMPSTRING_new();
-	ASN1_STRING_set(link->value.file->value.unicode, obsolete, sizeof obsolete);
-	return link;
-}
+/*
+ * The constant SpcIndirectDataContent data values are stored pre-encoded,
+ * so no ASN.1 structures need to be built and serialized for them.
+ */
+
+/*
+ * SpcLink with the "<<<Obsolete>>>" BMPString (CAB files)
+ * $ echo -n a21e801c003c003c003c004f00620073006f006c006500740065003e003e003e | xxd -r -p | openssl asn1parse -i -inform der
+ * 0:d=0  hl=2 l=  30 cons: cont [ 2 ]
+ * 2:d=1  hl=2 l=  28 prim:  cont [ 0 ]
+*/
+static const u_char obsolete_link[] = {
+	0xa2, 0x1e, 0x80, 0x1c, 0x00, 0x3c, 0x00, 0x3c, 0x00, 0x3c,
+	0x00, 0x4f, 0x00, 0x62, 0x00, 0x73, 0x00, 0x6f, 0x00, 0x6c,
+	0x00, 0x65, 0x00, 0x74, 0x00, 0x65, 0x00, 0x3e, 0x00, 0x3e,
+	0x00, 0x3e
+};
+
+/*
+ * SpcPeImageData with the obsolete SpcLink (PE files without page hashes)
+ * $ echo -n 3025030100a020a21e801c003c003c003c004f00620073006f006c006500740065003e003e003e | xxd -r -p | openssl asn1parse -i -inform der
+ * 0:d=0  hl=2 l=  37 cons: SEQUENCE
+ * 2:d=1  hl=2 l=   1 prim:  BIT STRING
+ * 5:d=1  hl=2 l=  32 cons:  cont [ 0 ]
+ * 7:d=2  hl=2 l=  30 cons:   cont [ 2 ]
+ * 9:d=3  hl=2 l=  28 prim:    cont [ 0 ]
+*/
+static const u_char pe_image_data[] = {
+	0x30, 0x25, 0x03, 0x01, 0x00, 0xa0, 0x20, 0xa2, 0x1e, 0x80,
+	0x1c, 0x00, 0x3c, 0x00, 0x3c, 0x00, 0x3c, 0x00, 0x4f, 0x00,
+	0x62, 0x00, 0x73, 0x00, 0x6f, 0x00, 0x6c, 0x00, 0x65, 0x00,
+	0x74, 0x00, 0x65, 0x00, 0x3e, 0x00, 0x3e, 0x00, 0x3e
+};
+
+/*
+ * SpcSipInfo (MSI files)
+ * $ echo -n 30240201010410f1100c0000000000c000000000000046020100020100020100020100020100 | xxd -r -p | openssl asn1parse -i -inform der
+ *  0:d=0  hl=2 l=  36 cons: SEQUENCE
+ *  2:d=1  hl=2 l=   1 prim:  INTEGER           :01
+ *  5:d=1  hl=2 l=  16 prim:  OCTET STRING      [HEX DUMP]:F1100C0000000000C000000000000046
+ * 23:d=1  hl=2 l=   1 prim:  INTEGER           :00
+ * 26:d=1  hl=2 l=   1 prim:  INTEGER           :00
+ * 29:d=1  hl=2 l=   1 prim:  INTEGER           :00
+ * 32:d=1  hl=2 l=   1 prim:  INTEGER           :00
+ * 35:d=1  hl=2 l=   1 prim:  INTEGER           :00
+*/
+static const u_char msi_sip_info[] = {
+	0x30, 0x24, 0x02, 0x01, 0x01, 0x04, 0x10, 0xf1, 0x10, 0x0c,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x46, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x02,
+	0x01, 0x00, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00
+};
 
 static const unsigned char classid_page_hash[] = {
 	0xA6, 0xB5, 0x86, 0xD5, 0xB4, 0xA1, 0x24, 0x66,
 	0xAE, 0x05, 0xA2, 0x17, 0xDA, 0x8E, 0x60, 0xD6
 };
 
-static unsigned char *pe_calc_page_hash(char *indata, uint32_t header_size,
-	int pe32plus, uint32_t sigpos, int phtype, size_t *rphlen)
+/*
+ * Every page hash table entry holds the file offset of a page (4 bytes,
+ * little-endian) followed by the digest of the page padded with zeroes
+ * to the page size.  The first entry covers the headers without the
+ * checksum and the Certificate Table directory entry, the last one
+ * holds the end of the last section and a zero digest.
+ * pe_walk_page_hash() computes the entries one by one and passes them
+ * to the callback, which stops the walk by returning 0.
+ * The section index is -1 for the headers and nsections for the last entry.
+ * Only the pages entirely within the bytes first-last are hashed,
+ * the callback gets a NULL digest for the other ones.
+ */
+typedef int (*page_hash_cb)(void *arg, int section, const char *name,
+	uint32_t offset, const unsigned char *digest, int mdlen);
+
+static int pe_walk_page_hash(char *indata, uint32_t header_size, int pe32plus,
+	uint32_t fileend, uint32_t first, uint32_t last, int phtype, page_hash_cb cb, void *arg)
 {
 	uint16_t nsections, opthdr_size;
-	uint32_t pagesize, hdrsize;
+	uint32_t pagesize, hdrsize, hdrskip;
 	uint32_t rs, ro, l, lastpos = 0;
-	int pphlen, phlen, i, pi = 1;
-	unsigned char *res, *zeroes;
+	int mdlen, i, ok;
+	unsigned char mdbuf[EVP_MAX_MD_SIZE];
+	unsigned char *zeroes;
 	char *sections;
 	const EVP_MD *md;
-	EVP_MD_CTX *mdctx;
+	EVP_MD_CTX *mdctx, *tmpl;
+	PHASE phase;
 
 	nsections = GET_UINT16_LE(indata + header_size + 6);
 	pagesize = GET_UINT32_LE(indata + header_size + 56);
 	hdrsize = GET_UINT32_LE(indata + header_size + 84);
-	md = EVP_get_digestbynid(phtype);
-	pphlen = 4 + EVP_MD_size(md);
-	phlen = pphlen * (3 + nsections + sigpos / pagesize);
+	opthdr_size = GET_UINT16_LE(indata + header_size + 20);
+	hdrskip = header_size + 160 + pe32plus*16;
+	if (pagesize == 0 || hdrsize < hdrskip || hdrsize > pagesize || hdrsize > fileend
+			|| (uint64_t)header_size + 24 + opthdr_size + 40 * (uint64_t)nsections > fileend) {
+		printf("Unsupported PE headers for page hashing\n");
+		return 0; /* FAILED */
+	}
+	md = digest_by_nid(phtype);
+	mdlen = EVP_MD_size(md);
 
-	res = OPENSSL_malloc(phlen);
+	phase_begin(&phase, PHASE_PAGE_HASH);
+	USDT_PROBE2(pe_calc_page_hash_entry, FILE_TYPE_PE, fileend);
 	zeroes = OPENSSL_zalloc(pagesize);
-
 	mdctx = EVP_MD_CTX_new();
-	EVP_DigestInit(mdctx, md);
-	EVP_DigestUpdate(mdctx, indata, header_size + 88);
-	EVP_DigestUpdate(mdctx, indata + header_size + 92, 60 + pe32plus*16);
-	EVP_DigestUpdate(mdctx, indata + header_size + 160 + pe32plus*16,
-			hdrsize - (header_size + 160 + pe32plus*16));
-	EVP_DigestUpdate(mdctx, zeroes, pagesize - hdrsize);
-	memset(res, 0, 4);
-	EVP_DigestFinal(mdctx, res + 4, NULL);
+	if (first == 0 && hdrsize - 1 <= last) {
+		EVP_DigestInit(mdctx, md);
+		EVP_DigestUpdate(mdctx, indata, header_size + 88);
+		EVP_DigestUpdate(mdctx, indata + header_size + 92, 60 + pe32plus*16);
+		EVP_DigestUpdate(mdctx, indata + hdrskip, hdrsize - hdrskip);
+		EVP_DigestUpdate(mdctx, zeroes, pagesize - hdrsize);
+		EVP_DigestFinal(mdctx, mdbuf, NULL);
+		ok = cb(arg, -1, NULL, 0, mdbuf, mdlen);
+	} else {
+		ok = cb(arg, -1, NULL, 0, NULL, mdlen);
+	}
 
-	opthdr_size = GET_UINT16_LE(indata + header_size + 20);
+	/* every page starts from a copy of an initialized context */
+	tmpl = EVP_MD_CTX_new();
+	EVP_DigestInit(tmpl, md);
 	sections = indata + header_size + 24 + opthdr_size;
-	for (i=0; i<nsections; i++) {
+	for (i=0; ok && i<nsections; i++) {
 		rs = GET_UINT32_LE(sections + 16);
 		ro = GET_UINT32_LE(sections + 20);
-		for (l=0; l < rs; l+=pagesize, pi++) {
-			PUT_UINT32_LE(ro + l, res + pi*pphlen);
-			EVP_DigestInit(mdctx, md);
+		if ((uint64_t)ro + rs > fileend) {
+			printf("Section %d exceeds the file size\n", i + 1);
+			ok = 0;
+			break;
+		}
+		for (l=0; ok && l < rs; l+=pagesize) {
+			uint32_t len = rs - l < pagesize ? rs - l : pagesize;
+			if (ro + l < first || (uint64_t)ro + l + len - 1 > last) {
+				ok = cb(arg, i, sections, ro + l, NULL, mdlen);
+				continue;
+			}
+			EVP_MD_CTX_copy_ex(mdctx, tmpl);
 			if (rs - l < pagesize) {
 				EVP_DigestUpdate(mdctx, indata + ro + l, rs - l);
 				EVP_DigestUpdate(mdctx, zeroes, pagesize - (rs - l));
 			} else {
 				EVP_DigestUpdate(mdctx, indata + ro + l, pagesize);
 			}
-			EVP_DigestFinal(mdctx, res + pi*pphlen + 4, NULL);
+			EVP_DigestFinal(mdctx, mdbuf, NULL);
+			ok = cb(arg, i, sections, ro + l, mdbuf, mdlen);
 		}
 		lastpos = ro + rs;
 		sections += 40;
 	}
+	if (ok) {
+		memset(mdbuf, 0, (size_t)mdlen);
+		ok = cb(arg, nsections, NULL, lastpos, mdbuf, mdlen);
+	}
+	EVP_MD_CTX_free(tmpl);
 	EVP_MD_CTX_free(mdctx);
-	PUT_UINT32_LE(lastpos, res + pi*pphlen);
-	memset(res + pi*pphlen + 4, 0, EVP_MD_size(md));
-	pi++;
 	OPENSSL_free(zeroes);
-	*rphlen = pi*pphlen;
-	return res;
+	USDT_PROBE2(pe_calc_page_hash_return, FILE_TYPE_PE, fileend);
+	phase_end(&phase, fileend);
+	return ok;
 }
 
-static SpcLink *get_page_hash_link(int phtype, char *indata, FILE_HEADER *header)
+typedef struct {
+	unsigned char *res;
+	size_t len;
+	size_t size;
+} PAGE_HASH_TABLE;
+
+static int pe_page_hash_append(void *arg, int section, const char *name,
+	uint32_t offset, const unsigned char *digest, int mdlen)
 {
-	unsigned char *ph, *p, *tmp;
-	size_t l, phlen;
-	char hexbuf[EVP_MAX_MD_SIZE*2+1];
-	ASN1_TYPE *tostr;
-	SpcAttributeTypeAndOptionalValue *aval;
-	ASN1_TYPE *taval;
-	SpcSerializedObject *so;
-	SpcLink *link;
-	STACK_OF(ASN1_TYPE) *oset, *aset;
+	PAGE_HASH_TABLE *table = (PAGE_HASH_TABLE *)arg;
 
-	ph = pe_calc_page_hash(indata, header->header_size, header->pe32plus,
-			header->fileend, phtype, &phlen);
-	if (!ph) {
-		printf("Failed to calculate page hash\n");
-		return NULL; /* FAILED */
+	/* suppress compiler warnings */
+	(void)section;
+	(void)name;
+
+	if (table->len + 4 + (size_t)mdlen > table->size) {
+		size_t size = table->size ? 2 * table->size : 64 * (4 + (size_t)mdlen);
+		unsigned char *res = OPENSSL_realloc(table->res, size);
+		if (!res)
+			return 0; /* FAILED */
+		table->res = res;
+		table->size = size;
 	}
-	tohex(ph, hexbuf, (phlen < 32) ? phlen : 32);
-	printf("Calculated page hash            : %s ...\n", hexbuf);
+	PUT_UINT32_LE(offset, table->res + table->len);
+	memcpy(table->res + table->len + 4, digest, (size_t)mdlen);
+	table->len += 4 + (size_t)mdlen;
+	return 1; /* OK */
+}
 
-	tostr = ASN1_TYPE_new();
-	tostr->type = V_ASN1_OCTET_STRING;
-	tostr->value.octet_string = ASN1_OCTET_STRING_new();
-	ASN1_OCTET_STRING_set(tostr->value.octet_string, ph, phlen);
-	OPENSSL_free(ph);
+static unsigned char *pe_calc_page_hash(char *indata, uint32_t header_size,
+	int pe32plus, uint32_t fileend, int phtype, size_t *rphlen)
+{
+	PAGE_HASH_TABLE table;
 
-	oset = sk_ASN1_TYPE_new_null();
-	sk_ASN1_TYPE_push(oset, tostr);
-	l = i2d_ASN1_SET_ANY(oset, NULL);
-	tmp = p = OPENSSL_malloc(l);
-	i2d_ASN1_SET_ANY(oset, &tmp);
+	memset(&table, 0, sizeof(PAGE_HASH_TABLE));
+	if (!pe_walk_page_hash(indata, header_size, pe32plus, fileend, 0, UINT32_MAX, phtype,
+			pe_page_hash_append, &table)) {
+		OPENSSL_free(table.res);
+		return NULL; /* FAILED */
+	}
+	*rphlen = table.len;
+	return table.res;
+}
+
+/*
+ * Page hash verification against the stored table, parsed once into an array
+ * The walk stops at the first mismatching page, unless all mismatches
+ * are reported with "-verbose".  Consecutive mismatching pages
+ * of a section are reported as one range.
+ */
+typedef struct {
+	uint32_t offset;
+	const unsigned char *digest;
+} PAGE_HASH_ENTRY;
+
+typedef struct {
+	PAGE_HASH_ENTRY *entries;
+	int nentries;
+	int index;
+	int all;
+	int quiet;
+	int checked;
+	int mismatches;
+	/* the beginning of the calculated table */
+	unsigned char head[32];
+	size_t headlen;
+	/* the current range of mismatching pages */
+	int run_section;
+	const char *run_name;
+	int run_first;
+	int run_last;
+	uint32_t run_start;
+	uint32_t run_end;
+} PAGE_HASH_VERIFY;
+
+static void pe_page_hash_report(PAGE_HASH_VERIFY *verify)
+{
+	if (verify->run_first < 0)
+		return;
+	if (!verify->quiet) {
+		printf("Page hash mismatch   : ");
+		if (verify->run_section < 0)
+			printf("headers");
+		else if (verify->run_name)
+			printf("section %d (%.8s)", verify->run_section + 1, verify->run_name);
+		else
+			printf("end of the last section");
+		printf(", entries %d-%d, offsets 0x%08X-0x%08X\n", verify->run_first, verify->run_last,
+			verify->run_start, verify->run_end);
+	}
+	verify->run_first = -1;
+}
+
+static int pe_page_hash_compare(void *arg, int section, const char *name,
+	uint32_t offset, const unsigned char *digest, int mdlen)
+{
+	PAGE_HASH_VERIFY *verify = (PAGE_HASH_VERIFY *)arg;
+	PAGE_HASH_ENTRY *entry = NULL;
+	int match;
+
+	if (!digest) {
+		/* a page outside of the verified range */
+		pe_page_hash_report(verify);
+		verify->index++;
+		return 1;
+	}
+	if (section < 0 || name)
+		verify->checked++;
+	if (verify->headlen < sizeof verify->head) {
+		unsigned char buf[4 + EVP_MAX_MD_SIZE];
+		size_t len = sizeof verify->head - verify->headlen;
+
+		PUT_UINT32_LE(offset, buf);
+		memcpy(buf + 4, digest, (size_t)mdlen);
+		if (len > 4 + (size_t)mdlen)
+			len = 4 + (size_t)mdlen;
+		memcpy(verify->head + verify->headlen, buf, len);
+		verify->headlen += len;
+	}
+	if (verify->index < verify->nentries)
+		entry = &verify->entries[verify->index];
+	match = entry && entry->offset == offset && !memcmp(entry->digest, digest, (size_t)mdlen);
+	if (match) {
+		pe_page_hash_report(verify);
+	} else {
+		verify->mismatches++;
+		if (verify->run_first >= 0 && (verify->run_section != section
+				|| verify->run_last + 1 != verify->index))
+			pe_page_hash_report(verify);
+		if (verify->run_first < 0) {
+			verify->run_section = section;
+			verify->run_name = name;
+			verify->run_first = verify->index;
+			verify->run_start = offset;
+		}
+		verify->run_last = verify->index;
+		verify->run_end = offset;
+	}
+	verify->index++;
+	return match || verify->all;
+}
+
+/*
+ * Verify the pages within the bytes first-last against the stored page hash table ph,
+ * print the calculated table (or the number of verified pages of a range)
+ * and the mismatching pages unless quiet.
+ * Return 1 if all pages match.
+ */
+static int pe_verify_page_hash(char *indata, FILE_HEADER *header, const unsigned char *ph,
+	size_t phlen, int phtype, uint32_t first, uint32_t last, int all, int quiet)
+{
+	PAGE_HASH_VERIFY verify;
+	char hexbuf[EVP_MAX_MD_SIZE*2+1];
+	size_t pphlen = 4 + (size_t)EVP_MD_size(digest_by_nid(phtype));
+	int i, ok, complete;
+
+	memset(&verify, 0, sizeof(PAGE_HASH_VERIFY));
+	verify.nentries = (int)(phlen / pphlen);
+	verify.entries = OPENSSL_malloc((size_t)verify.nentries * sizeof(PAGE_HASH_ENTRY) + 1);
+	if (!verify.entries)
+		return 0; /* FAILED */
+	for (i=0; i<verify.nentries; i++) {
+		verify.entries[i].offset = GET_UINT32_LE(ph + i*pphlen);
+		verify.entries[i].digest = ph + i*pphlen + 4;
+	}
+	verify.all = all;
+	verify.quiet = quiet;
+	verify.run_first = -1;
+
+	/* the walk is complete unless stopped at the first mismatch */
+	complete = pe_walk_page_hash(indata, header->header_size, header->pe32plus, header->fileend,
+		first, last, phtype, pe_page_hash_compare, &verify);
+	pe_page_hash_report(&verify);
+	ok = complete && !verify.mismatches && verify.index == verify.nentries && phlen % pphlen == 0;
+	if (!quiet && (first > 0 || last < UINT32_MAX)) {
+		printf("Checked pages        : %d%s\n", verify.checked,
+			verify.mismatches ? "    MISMATCH!!!" : "");
+		if (complete && !verify.checked) {
+			printf("No page entirely within the range\n");
+			ok = 0;
+		}
+	} else if (!quiet) {
+		tohex(verify.head, hexbuf, (int)verify.headlen);
+		printf("Calculated page hash : %s ...%s\n", hexbuf, ok ? "" : "    MISMATCH!!!");
+	}
+	if (!quiet) {
+		if (complete && (verify.index != verify.nentries || phlen % pphlen))
+			printf("Page hash entries    : %d stored, %d calculated\n",
+				verify.nentries, verify.index);
+	}
+	OPENSSL_free(verify.entries);
+	return ok;
+}
+
+static SpcLink *get_page_hash_link(int phtype, char *indata, FILE_HEADER *header)
+{
+	unsigned char *ph, *p, *tmp;
+	size_t l, phlen;
+	char hexbuf[EVP_MAX_MD_SIZE*2+1];
+	ASN1_TYPE *tostr;
+	SpcAttributeTypeAndOptionalValue *aval;
+	ASN1_TYPE *taval;
+	SpcSerializedObject *so;
+	SpcLink *link;
+	STACK_OF(ASN1_TYPE) *oset, *aset;
+
+	ph = pe_calc_page_hash(indata, header->header_size, header->pe32plus,
+			header->fileend, phtype, &phlen);
+	if (!ph) {
+		printf("Failed to calculate page hash\n");
+		return NULL; /* FAILED */
+	}
+	tohex(ph, hexbuf, (phlen < 32) ? phlen : 32);
+	printf("Calculated page hash            : %s ...\n", hexbuf);
+
+	tostr = ASN1_TYPE_new();
+	tostr->type = V_ASN1_OCTET_STRING;
+	tostr->value.octet_string = ASN1_OCTET_STRING_new();
+	ASN1_OCTET_STRING_set(tostr->value.octet_string, ph, phlen);
+	OPENSSL_free(ph);
+
+	oset = sk_ASN1_TYPE_new_null();
+	sk_ASN1_TYPE_push(oset, tostr);
+	l = i2d_ASN1_SET_ANY(oset, NULL);
+	tmp = p = OPENSSL_malloc(l);
+	i2d_ASN1_SET_ANY(oset, &tmp);
 	ASN1_TYPE_free(tostr);
 	sk_ASN1_TYPE_free(oset);
 
@@ -1567,67 +2517,52 @@ static SpcLink *get_page_hash_link(int phtype, char *indata, FILE_HEADER *header
 	return link;
 }
 
-static int get_indirect_data_blob(u_char **blob, int *len, GLOBAL_OPTIONS *options,
-			FILE_HEADER *header, file_type_t type, char *indata)
+static int get_indirect_data_blob(u_char **blob, int *len, const EVP_MD *md,
+			GLOBAL_OPTIONS *options, FILE_HEADER *header, file_type_t type, char *indata)
 {
 	u_char *p;
 	int hashlen, l, phtype;
 	void *hash;
 	ASN1_OBJECT *dtype;
 	SpcIndirectDataContent *idc;
-	static const unsigned char msistr[] = {
-		0xf1, 0x10, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46
-	};
 
 	idc = SpcIndirectDataContent_new();
 	idc->data->value = ASN1_TYPE_new();
 	idc->data->value->type = V_ASN1_SEQUENCE;
 	idc->data->value->value.sequence = ASN1_STRING_new();
 	if (type == FILE_TYPE_CAB) {
-		SpcLink *link = get_obsolete_link();
-		l = i2d_SpcLink(link, NULL);
-		p = OPENSSL_malloc(l);
-		i2d_SpcLink(link, &p);
-		p -= l;
+		l = sizeof obsolete_link;
+		p = OPENSSL_memdup(obsolete_link, l);
 		dtype = OBJ_txt2obj(SPC_CAB_DATA_OBJID, 1);
-		SpcLink_free(link);
 	} else if (type == FILE_TYPE_PE) {
-		SpcPeImageData *pid = SpcPeImageData_new();
-		ASN1_BIT_STRING_set(pid->flags, (unsigned char*)"0", 0);
 		if (options->pagehash) {
+			SpcPeImageData *pid = SpcPeImageData_new();
 			SpcLink *link;
+			ASN1_BIT_STRING_set(pid->flags, (unsigned char*)"0", 0);
 			phtype = NID_sha1;
-			if (EVP_MD_size(options->md) > EVP_MD_size(EVP_sha1()))
+			if (EVP_MD_size(md) > EVP_MD_size(EVP_sha1()))
 				phtype = NID_sha256;
 			link = get_page_hash_link(phtype, indata, header);
-			if (!link)
+			if (!link) {
+				SpcPeImageData_free(pid);
+				SpcIndirectDataContent_free(idc);
 				return 0; /* FAILED */
+			}
 			pid->file = link;
+			l = i2d_SpcPeImageData(pid, NULL);
+			p = OPENSSL_malloc(l);
+			i2d_SpcPeImageData(pid, &p);
+			p -= l;
+			SpcPeImageData_free(pid);
 		} else {
-			pid->file = get_obsolete_link();
+			l = sizeof pe_image_data;
+			p = OPENSSL_memdup(pe_image_data, l);
 		}
-		l = i2d_SpcPeImageData(pid, NULL);
-		p = OPENSSL_malloc(l);
-		i2d_SpcPeImageData(pid, &p);
-		p -= l;
 		dtype = OBJ_txt2obj(SPC_PE_IMAGE_DATA_OBJID, 1);
-		SpcPeImageData_free(pid);
 	} else if (type == FILE_TYPE_MSI) {
-		SpcSipInfo *si = SpcSipInfo_new();
-		ASN1_INTEGER_set(si->a, 1);
-		ASN1_INTEGER_set(si->b, 0);
-		ASN1_INTEGER_set(si->c, 0);
-		ASN1_INTEGER_set(si->d, 0);
-		ASN1_INTEGER_set(si->e, 0);
-		ASN1_INTEGER_set(si->f, 0);
-		ASN1_OCTET_STRING_set(si->string, msistr, sizeof msistr);
-		l = i2d_SpcSipInfo(si, NULL);
-		p = OPENSSL_malloc(l);
-		i2d_SpcSipInfo(si, &p);
-		p -= l;
+		l = sizeof msi_sip_info;
+		p = OPENSSL_memdup(msi_sip_info, l);
 		dtype = OBJ_txt2obj(SPC_SIPINFO_OBJID, 1);
-		SpcSipInfo_free(si);
 	} else {
 		printf("Unexpected file type: %d\n", type);
 		return 0; /* FAILED */
@@ -1636,11 +2571,11 @@ static int get_indirect_data_blob(u_char **blob, int *len, GLOBAL_OPTIONS *optio
 	idc->data->type = dtype;
 	idc->data->value->value.sequence->data = p;
 	idc->data->value->value.sequence->length = l;
-	idc->messageDigest->digestAlgorithm->algorithm = OBJ_nid2obj(EVP_MD_nid(options->md));
+	idc->messageDigest->digestAlgorithm->algorithm = OBJ_nid2obj(EVP_MD_nid(md));
 	idc->messageDigest->digestAlgorithm->parameters = ASN1_TYPE_new();
 	idc->messageDigest->digestAlgorithm->parameters->type = V_ASN1_NULL;
 
-	hashlen = EVP_MD_size(options->md);
+	hashlen = EVP_MD_size(md);
 	hash = OPENSSL_malloc(hashlen);
 	memset(hash, 0, hashlen);
 	ASN1_OCTET_STRING_set(idc->messageDigest->digest, hash, hashlen);
@@ -1651,27 +2586,23 @@ static int get_indirect_data_blob(u_char **blob, int *len, GLOBAL_OPTIONS *optio
 	p = *blob;
 	i2d_SpcIndirectDataContent(idc, &p);
 	SpcIndirectDataContent_free(idc);
-	*len -= EVP_MD_size(options->md);
+	*len -= EVP_MD_size(md);
 	return 1; /* OK */
 }
 
-static int set_signing_blob(PKCS7 *sig, BIO *hash, unsigned char *buf, int len)
+static int set_signing_blob(PKCS7 *sig, unsigned char *buf, int len)
 {
-	unsigned char mdbuf[EVP_MAX_MD_SIZE];
-	int mdlen;
 	size_t seqhdrlen;
 	BIO *sigbio;
 	PKCS7 *td7;
 
-	mdlen = BIO_gets(hash, (char*)mdbuf, EVP_MAX_MD_SIZE);
-	memcpy(buf+len, mdbuf, mdlen);
 	seqhdrlen = asn1_simple_hdr_len(buf, len);
 
 	if ((sigbio = PKCS7_dataInit(sig, NULL)) == NULL) {
 		printf("PKCS7_dataInit failed\n");
 		return 0; /* FAILED */
 	}
-	BIO_write(sigbio, buf+seqhdrlen, len-seqhdrlen+mdlen);
+	BIO_write(sigbio, buf+seqhdrlen, len-seqhdrlen);
 	(void)BIO_flush(sigbio);
 
 	if (!PKCS7_dataFinal(sig, sigbio)) {
@@ -1688,7 +2619,7 @@ static int set_signing_blob(PKCS7 *sig, BIO *hash, unsigned char *buf, int len)
 	td7->d.other = ASN1_TYPE_new();
 	td7->d.other->type = V_ASN1_SEQUENCE;
 	td7->d.other->value.sequence = ASN1_STRING_new();
-	ASN1_STRING_set(td7->d.other->value.sequence, buf, len+mdlen);
+	ASN1_STRING_set(td7->d.other->value.sequence, buf, len);
 	if (!PKCS7_set_content(sig, td7)) {
 		PKCS7_free(td7);
 		printf("PKCS7_set_content failed\n");
@@ -1729,19 +2660,29 @@ int set_content_blob(PKCS7 *sig, PKCS7 *cursig)
 	return 1; /* OK */
 }
 
-static int set_indirect_data_blob(PKCS7 *sig, BIO *hash, file_type_t type,
-				char *indata, GLOBAL_OPTIONS *options, FILE_HEADER *header)
+/*
+ * Build the SpcIndirectDataContent blob with the calculated file digest.
+ * On success *blob points to *len bytes to be freed with OPENSSL_free().
+ * The page hashes of a large PE file do not fit into any fixed size buffer.
+ */
+static int get_indirect_data_content(u_char **blob, int *len, BIO *hash, const EVP_MD *md,
+				file_type_t type, char *indata, GLOBAL_OPTIONS *options, FILE_HEADER *header)
 {
-	static unsigned char buf[64*1024];
-	u_char *p = NULL;
-	int len = 0;
+	unsigned char mdbuf[EVP_MAX_MD_SIZE];
+	u_char *p = NULL, *buf;
+	int l = 0, mdlen;
 
-	if (!get_indirect_data_blob(&p, &len, options, header, type, indata))
+	if (!get_indirect_data_blob(&p, &l, md, options, header, type, indata))
 		return 0; /* FAILED */
-	memcpy(buf, p, len);
-	OPENSSL_free(p);
-	if (!set_signing_blob(sig, hash, buf, len))
+	mdlen = BIO_gets(hash, (char*)mdbuf, EVP_MAX_MD_SIZE);
+	buf = OPENSSL_realloc(p, (size_t)l + (size_t)mdlen);
+	if (!buf) {
+		OPENSSL_free(p);
 		return 0; /* FAILED */
+	}
+	memcpy(buf+l, mdbuf, mdlen);
+	*blob = buf;
+	*len = l + mdlen;
 	return 1; /* OK */
 }
 
@@ -1752,7 +2693,9 @@ static unsigned int pe_calc_checksum(BIO *bio, FILE_HEADER *header)
 	size_t size = 0;
 	unsigned short *buf;
 	int nread;
+	PHASE phase;
 
+	phase_begin(&phase, PHASE_CHECKSUM);
 	/* recalculate the checksum */
 	buf = OPENSSL_malloc(sizeof(unsigned short)*32768);
 	(void)BIO_seek(bio, 0);
@@ -1770,6 +2713,7 @@ static unsigned int pe_calc_checksum(BIO *bio, FILE_HEADER *header)
 	OPENSSL_free(buf);
 	checkSum = 0xffff & (checkSum + (checkSum >> 0x10));
 	checkSum += size;
+	phase_end(&phase, size);
 	return checkSum;
 }
 
@@ -1803,7 +2747,7 @@ static int verify_leaf_hash(X509 *leaf, const char *leafhash)
 		goto out;
 	}
 	*hash++ = '\0';
-	md = EVP_get_digestbyname(mdid);
+	md = digest_by_name(mdid);
 	if (md == NULL) {
 		printf("\nUnable to lookup digest by name '%s'\n", mdid);
 		goto out;
@@ -2468,7 +3412,7 @@ static int TST_verify(CMS_ContentInfo *timestamp, PKCS7_SIGNER_INFO *si)
 		if (token) {
 			/* compute a hash from the encrypted message digest value of the file */
 			md_nid = OBJ_obj2nid(token->messageImprint->digestAlgorithm->algorithm);
-			md = EVP_get_digestbynid(md_nid);
+			md = digest_by_nid(md_nid);
 			mdctx = EVP_MD_CTX_new();
 			EVP_DigestInit(mdctx, md);
 			EVP_DigestUpdate(mdctx, si->enc_digest->data, si->enc_digest->length);
@@ -2590,50 +3534,415 @@ out:
 	return url;
 }
 
-static int verify_crl(char *ca_file, char *crl_file, STACK_OF(X509_CRL) *crls,
-		X509 *signer, STACK_OF(X509) *chain)
+/*
+ * Verified-chain cache
+ * A successful X509_verify_cert() result is kept under a SHA-256 key over
+ * the kind of the check, the leaf certificate, the untrusted certificates,
+ * the contents of the trusted certificates and CRL files and the additional CRLs.
+ * The entry holds the time window in which all certificates and CRLs
+ * of the verified chain are valid, so a later verification of the same chain
+ * at a time within the window skips X509_verify_cert().
+ * The entries live for the process, with "-chaincache" also in a directory
+ * shared by subsequent runs.  An entry file stands in for X509_verify_cert(),
+ * so the directory and its entries have to be owned by the user
+ * and not writable by the group or others.
+ */
+#define CHAIN_CACHE_SIZE 32
+
+typedef enum {
+	CHAIN_AUTHENTICODE,
+	CHAIN_TIMESTAMP,
+	CHAIN_CRL
+} chain_kind_t;
+
+typedef struct {
+	unsigned char key[SHA256_DIGEST_LENGTH];
+	time_t not_before;
+	time_t not_after;
+} CHAIN_CACHE_ENTRY;
+
+static CHAIN_CACHE_ENTRY chain_cache[CHAIN_CACHE_SIZE];
+static int chain_cache_count = 0;
+static int chain_cache_hits = 0;
+static int chain_cache_misses = 0;
+static char *chain_cache_dir = NULL;
+
+/* The POSIX time of an ASN1_TIME, independent of the local time zone */
+static int asn1_time_to_posix(const ASN1_TIME *s, time_t *t)
 {
-	X509_STORE *store = NULL;
-	X509_STORE_CTX *ctx = NULL;
-	int verok = 0;
+	int days, secs, ok;
+	ASN1_TIME *epoch = ASN1_TIME_set(NULL, 0);
+
+	ok = epoch && ASN1_TIME_diff(&days, &secs, epoch, s);
+	ASN1_TIME_free(epoch);
+	if (ok)
+		*t = (time_t)days * 86400 + secs;
+	return ok;
+}
+
+static void chain_cache_file(EVP_MD_CTX *mdctx, const char *file)
+{
+	char buf[4096];
+	int len;
+	BIO *bio = file ? BIO_new_file(file, "rb") : NULL;
+
+	if (bio) {
+		while ((len = BIO_read(bio, buf, sizeof buf)) > 0)
+			EVP_DigestUpdate(mdctx, buf, (size_t)len);
+		BIO_free(bio);
+	}
+	ERR_clear_error();
+	EVP_DigestUpdate(mdctx, "|", 1);
+}
+
+static void chain_cache_key(unsigned char *key, chain_kind_t kind, X509 *leaf,
+	STACK_OF(X509) *certs, STACK_OF(X509_CRL) *crls, const char *cafile, const char *crlfile)
+{
+	static const char prefix[] = "osslsigncode chain cache v1";
+	unsigned char mdbuf[EVP_MAX_MD_SIZE], k = (unsigned char)kind;
+	unsigned int mdlen;
+	const EVP_MD *md = digest_by_nid(NID_sha256);
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+	int i;
+
+	EVP_DigestInit_ex(mdctx, md, NULL);
+	EVP_DigestUpdate(mdctx, prefix, sizeof prefix);
+	EVP_DigestUpdate(mdctx, &k, 1);
+	if (X509_digest(leaf, md, mdbuf, &mdlen))
+		EVP_DigestUpdate(mdctx, mdbuf, mdlen);
+	for (i = 0; i < sk_X509_num(certs); i++)
+		if (X509_digest(sk_X509_value(certs, i), md, mdbuf, &mdlen))
+			EVP_DigestUpdate(mdctx, mdbuf, mdlen);
+	EVP_DigestUpdate(mdctx, "|", 1);
+	for (i = 0; i < sk_X509_CRL_num(crls); i++)
+		if (X509_CRL_digest(sk_X509_CRL_value(crls, i), md, mdbuf, &mdlen))
+			EVP_DigestUpdate(mdctx, mdbuf, mdlen);
+	EVP_DigestUpdate(mdctx, "|", 1);
+	chain_cache_file(mdctx, cafile);
+	chain_cache_file(mdctx, crlfile);
+	EVP_DigestFinal_ex(mdctx, key, NULL);
+	EVP_MD_CTX_free(mdctx);
+}
+
+/*
+ * Return 1 if the file or directory is owned by the user and not writable
+ * by the group or others.  On Windows the access is left to the ACL.
+ */
+static int chain_cache_private(const struct stat *st)
+{
+#ifdef WIN32
+	/* suppress compiler warnings */
+	(void)st;
+	return 1; /* OK */
+#else
+	return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH));
+#endif /* WIN32 */
+}
+
+/* Check the "-chaincache" directory before it is used */
+static int chain_cache_check_dir(const char *dir)
+{
+	struct stat st;
+
+	if (stat(dir, &st) != 0 || (st.st_mode & S_IFMT) != S_IFDIR) {
+		printf("Chain cache directory not found: %s\n", dir);
+		return 0; /* FAILED */
+	}
+	if (!chain_cache_private(&st)) {
+		printf("Chain cache directory must be owned by the user and not writable by others: %s\n", dir);
+		return 0; /* FAILED */
+	}
+	return 1; /* OK */
+}
+
+static char *chain_cache_path(const unsigned char *key)
+{
+	char hexbuf[SHA256_DIGEST_LENGTH*2+1];
+	size_t len;
+	char *path;
+
+	tohex(key, hexbuf, SHA256_DIGEST_LENGTH);
+	len = strlen(chain_cache_dir) + 1 + strlen(hexbuf) + 7;
+	path = OPENSSL_malloc(len);
+	snprintf(path, len, "%s/%s.chain", chain_cache_dir, hexbuf);
+	return path;
+}
+
+static void chain_cache_add(const unsigned char *key, time_t not_before, time_t not_after)
+{
+	/* the oldest entry is replaced when the cache is full */
+	CHAIN_CACHE_ENTRY *entry = &chain_cache[chain_cache_count++ % CHAIN_CACHE_SIZE];
+
+	memcpy(entry->key, key, SHA256_DIGEST_LENGTH);
+	entry->not_before = not_before;
+	entry->not_after = not_after;
+}
+
+/*
+ * Return 1 if the chain with the key was verified at a time within
+ * the validity window of all its certificates and CRLs.
+ */
+static int chain_cache_lookup(const unsigned char *key, time_t time)
+{
+	int i, n = chain_cache_count < CHAIN_CACHE_SIZE ? chain_cache_count : CHAIN_CACHE_SIZE;
+
+	for (i = 0; i < n; i++) {
+		if (!memcmp(chain_cache[i].key, key, SHA256_DIGEST_LENGTH)) {
+			if (time < chain_cache[i].not_before || time > chain_cache[i].not_after)
+				break;
+			chain_cache_hits++;
+			return 1; /* OK */
+		}
+	}
+	if (i == n && chain_cache_dir) {
+		char *path = chain_cache_path(key);
+		long long not_before, not_after;
+		struct stat st;
+		FILE *f = fopen(path, "r");
+
+		OPENSSL_free(path);
+		if (f) {
+			/* an entry written by someone else is ignored */
+			int ok = !fstat(fileno(f), &st) && chain_cache_private(&st)
+				&& fscanf(f, "%lld %lld", &not_before, &not_after) == 2;
+			fclose(f);
+			if (ok && time >= (time_t)not_before && time <= (time_t)not_after) {
+				chain_cache_add(key, (time_t)not_before, (time_t)not_after);
+				chain_cache_hits++;
+				return 1; /* OK */
+			}
+		}
+	}
+	chain_cache_misses++;
+	return 0; /* not cached */
+}
+
+/*
+ * Keep a verified chain, a failure to write the "-chaincache" directory
+ * only disables the cache for subsequent runs.
+ */
+static void chain_cache_store(const unsigned char *key, time_t not_before, time_t not_after)
+{
+	char *path, *tmpfile;
+	size_t len;
+	FILE *f;
+	int ok;
+
+	if (not_after == INVALID_TIME || not_before > not_after)
+		return;
+	chain_cache_add(key, not_before, not_after);
+	if (!chain_cache_dir)
+		return;
+	path = chain_cache_path(key);
+	len = strlen(path) + 32;
+	tmpfile = OPENSSL_malloc(len);
+	snprintf(tmpfile, len, "%s.%ld.tmp", path, (long)getpid());
+#ifdef WIN32
+	f = fopen(tmpfile, "w");
+#else
+	{
+		/* only the user may change the entry */
+		int fd = open(tmpfile, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		f = fd >= 0 ? fdopen(fd, "w") : NULL;
+		if (fd >= 0 && !f)
+			close(fd);
+	}
+#endif /* WIN32 */
+	ok = f && fprintf(f, "%lld %lld\n", (long long)not_before, (long long)not_after) > 0;
+	if (f)
+		ok &= !fclose(f);
+	/* the temporary file makes the new cache entry visible atomically */
+	if (!ok || rename(tmpfile, path)) {
+		printf("Warning: Failed to store the verified chain in the cache: %s\n", path);
+		unlink(tmpfile);
+	}
+	OPENSSL_free(tmpfile);
+	OPENSSL_free(path);
+}
+
+static void chain_cache_print(void)
+{
+	int total = chain_cache_hits + chain_cache_misses;
+
+	if (total > 0)
+		printf("Verified-chain cache: %d hit(s), %d miss(es), hit rate %.1f%%\n",
+			chain_cache_hits, chain_cache_misses, 100.0 * chain_cache_hits / total);
+}
+
+/*
+ * Narrow the window [not_before, not_after] to the validity of the certificate or CRL,
+ * not_after is INVALID_TIME until the first bound
+ */
+static void chain_window(const ASN1_TIME *start, const ASN1_TIME *end,
+	time_t *not_before, time_t *not_after)
+{
+	time_t t;
+
+	if (start && asn1_time_to_posix(start, &t) && t > *not_before)
+		*not_before = t;
+	if (end && asn1_time_to_posix(end, &t) && (*not_after == INVALID_TIME || t < *not_after))
+		*not_after = t;
+}
+
+/*
+ * X509_verify_cert() of the leaf certificate with the untrusted certificates
+ * and CRLs, as done by PKCS7_verify() and CMS_verify() for the "smime_sign" purpose.
+ * The validity window of the verified chain and the CRLs is returned
+ * in not_before and not_after.
+ */
+static int verify_chain(X509_STORE *store, X509 *leaf, STACK_OF(X509) *certs,
+	STACK_OF(X509_CRL) *crls, const char *purpose, time_t *not_before, time_t *not_after)
+{
+	X509_STORE_CTX *ctx;
+	STACK_OF(X509) *chain;
+	STACK_OF(X509_OBJECT) *objs;
+	int i, verok = 0;
 
 	ctx = X509_STORE_CTX_new();
-	if (!ctx)
-		goto out;
-	store = X509_STORE_new();
-	if (!store)
-		goto out;
-	if (!load_crlfile_lookup(store, ca_file, crl_file))
+	if (!ctx || !X509_STORE_CTX_init(ctx, store, leaf, certs))
 		goto out;
-
-	/* initialise an X509_STORE_CTX structure for subsequent use by X509_verify_cert()*/
-	if (!X509_STORE_CTX_init(ctx, store, signer, chain))
+	if (purpose && !X509_STORE_CTX_set_default(ctx, purpose))
 		goto out;
-
-	/* set an additional CRLs */
 	if (crls)
 		X509_STORE_CTX_set0_crls(ctx, crls);
-
 	if (X509_verify_cert(ctx) <= 0) {
 		int error = X509_STORE_CTX_get_error(ctx);
 		printf("\nX509_verify_cert: certificate verify error: %s\n",
 				X509_verify_cert_error_string(error));
 		goto out;
 	}
+	*not_before = 0;
+	*not_after = INVALID_TIME; /* not bounded yet */
+	chain = X509_STORE_CTX_get0_chain(ctx);
+	for (i = 0; i < sk_X509_num(chain); i++) {
+		X509 *cert = sk_X509_value(chain, i);
+		chain_window(X509_get0_notBefore(cert), X509_get0_notAfter(cert), not_before, not_after);
+	}
+	if (X509_VERIFY_PARAM_get_flags(X509_STORE_get0_param(store)) & X509_V_FLAG_CRL_CHECK) {
+		for (i = 0; i < sk_X509_CRL_num(crls); i++) {
+			X509_CRL *crl = sk_X509_CRL_value(crls, i);
+			chain_window(X509_CRL_get0_lastUpdate(crl), X509_CRL_get0_nextUpdate(crl),
+				not_before, not_after);
+		}
+		objs = X509_STORE_get0_objects(store);
+		for (i = 0; i < sk_X509_OBJECT_num(objs); i++) {
+			X509_CRL *crl = X509_OBJECT_get0_X509_CRL(sk_X509_OBJECT_value(objs, i));
+			if (crl)
+				chain_window(X509_CRL_get0_lastUpdate(crl), X509_CRL_get0_nextUpdate(crl),
+					not_before, not_after);
+		}
+	}
+	verok = 1; /* OK */
+out:
+	X509_STORE_CTX_free(ctx);
+	return verok;
+}
+
+static int verify_crl(char *ca_file, char *crl_file, STACK_OF(X509_CRL) *crls,
+		X509 *signer, STACK_OF(X509) *chain)
+{
+	X509_STORE *store = NULL;
+	unsigned char key[SHA256_DIGEST_LENGTH];
+	time_t not_before, not_after;
+	int verok = 0;
+
+	/* the CRLs are checked at the current time */
+	chain_cache_key(key, CHAIN_CRL, signer, chain, crls, ca_file, crl_file);
+	if (chain_cache_lookup(key, time(NULL)))
+		return 1; /* OK */
+
+	store = X509_STORE_new();
+	if (!store)
+		goto out;
+	if (!load_crlfile_lookup(store, ca_file, crl_file))
+		goto out;
+
+	/* the additional CRLs are set for X509_verify_cert() */
+	if (!verify_chain(store, signer, chain, crls, NULL, &not_before, &not_after))
+		goto out;
+	chain_cache_store(key, not_before, not_after);
 	verok = 1; /* OK */
 
 out:
 	if (!verok)
 		ERR_print_errors_fp(stdout);
-	/* NULL is a valid parameter value for X509_STORE_free() and X509_STORE_CTX_free() */
+	/* NULL is a valid parameter value for X509_STORE_free() */
 	X509_STORE_free(store);
-	X509_STORE_CTX_free(ctx);
+	return verok;
+}
+
+/*
+ * Verify the chains of the timestamp signers as CMS_verify() does,
+ * the TSA store is only loaded for the chains missing in the verified-chain cache
+ */
+static int verify_timestamp_chain(SIGNATURE *signature, GLOBAL_OPTIONS *options)
+{
+	X509_STORE *store = NULL;
+	STACK_OF(CMS_SignerInfo) *sinfos;
+	STACK_OF(X509) *certs;
+	STACK_OF(X509_CRL) *crls;
+	unsigned char key[SHA256_DIGEST_LENGTH];
+	time_t vtime, not_before, not_after;
+	int i, verok = 0;
+
+	/* the signer certificates are also set by CMS_verify() */
+	if (CMS_set1_signers_certs(signature->timestamp, NULL, 0) < 0) {
+		printf("\nCMS_verify error\n");
+		return 0; /* FAILED */
+	}
+	certs = CMS_get1_certs(signature->timestamp);
+	crls = CMS_get1_crls(signature->timestamp);
+	vtime = options->timestamp_expiration ? INVALID_TIME : signature->time;
+	sinfos = CMS_get0_SignerInfos(signature->timestamp);
+	for (i = 0; i < sk_CMS_SignerInfo_num(sinfos); i++) {
+		X509 *signer;
+		CMS_SignerInfo_get0_algs(sk_CMS_SignerInfo_value(sinfos, i), NULL, &signer, NULL, NULL);
+		if (!signer) {
+			printf("\nCMS_verify error\n");
+			goto out;
+		}
+		chain_cache_key(key, CHAIN_TIMESTAMP, signer, certs, crls, options->tsa_cafile, NULL);
+		if (chain_cache_lookup(key, vtime != INVALID_TIME ? vtime : time(NULL)))
+			continue;
+		if (!store) {
+			store = X509_STORE_new();
+			if (!store)
+				goto out;
+			if (!load_file_lookup(store, options->tsa_cafile)) {
+				printf("Use the \"-TSA-CAfile\" option to add the Time-Stamp Authority certificates bundle to verify timestamp server.\n");
+				goto out;
+			}
+			/*
+			 * The TSA signing key MUST be of a sufficient length to allow for a sufficiently
+			 * long lifetime.  Even if this is done, the key will  have a finite lifetime.
+			 * Thus, any token signed by the TSA SHOULD  be time-stamped again or notarized
+			 * at a later date to renew the trust that exists in the TSA's signature.
+			 * https://tools.ietf.org/html/rfc3161
+			*/
+			if (vtime != INVALID_TIME)
+				/* verify timestamp against the time of its creation */
+				if (!set_store_time(store, vtime)) {
+					printf("Failed to set store time\n");
+					goto out;
+				}
+		}
+		if (!verify_chain(store, signer, certs, crls, "smime_sign", &not_before, &not_after)) {
+			printf("\nCMS_verify error\n");
+			goto out;
+		}
+		chain_cache_store(key, not_before, not_after);
+	}
+	verok = 1; /* OK */
+out:
+	/* NULL is a valid parameter value for X509_STORE_free() */
+	X509_STORE_free(store);
+	sk_X509_pop_free(certs, X509_free);
+	sk_X509_CRL_pop_free(crls, X509_CRL_free);
 	return verok;
 }
 
 static int verify_timestamp(SIGNATURE *signature, GLOBAL_OPTIONS *options)
 {
-	X509_STORE *store;
 	STACK_OF(CMS_SignerInfo) *sinfos;
 	CMS_SignerInfo *cmssi;
 	X509 *signer;
@@ -2642,37 +3951,13 @@ static int verify_timestamp(SIGNATURE *signature, GLOBAL_OPTIONS *options)
 	PKCS7_SIGNER_INFO *si;
 	int verok = 0;
 
-	store = X509_STORE_new();
-	if (!store)
-		goto out;
-	if (load_file_lookup(store, options->tsa_cafile)) {
-		/*
-		 * The TSA signing key MUST be of a sufficient length to allow for a sufficiently
-		 * long lifetime.  Even if this is done, the key will  have a finite lifetime.
-		 * Thus, any token signed by the TSA SHOULD  be time-stamped again or notarized
-		 * at a later date to renew the trust that exists in the TSA's signature.
-		 * https://tools.ietf.org/html/rfc3161
-		*/
-		if (!options->timestamp_expiration)
-			/* verify timestamp against the time of its creation */
-			if (!set_store_time(store, signature->time)) {
-				printf("Failed to set store time\n");
-				X509_STORE_free(store);
-				goto out;
-			}
-	} else {
-		printf("Use the \"-TSA-CAfile\" option to add the Time-Stamp Authority certificates bundle to verify timestamp server.\n");
-		X509_STORE_free(store);
+	if (!verify_timestamp_chain(signature, options))
 		goto out;
-	}
-
-	/* verify a CMS SignedData structure */
-	if (!CMS_verify(signature->timestamp, NULL, store, 0, NULL, 0)) {
+	/* verify a CMS SignedData structure, the signer's chain has been verified */
+	if (!CMS_verify(signature->timestamp, NULL, NULL, 0, NULL, CMS_NO_SIGNER_CERT_VERIFY)) {
 		printf("\nCMS_verify error\n");
-		X509_STORE_free(store);
 		goto out;
 	}
-	X509_STORE_free(store);
 
 	sinfos = CMS_get0_SignerInfos(signature->timestamp);
 	cmssi = sk_CMS_SignerInfo_value(sinfos, 0);
@@ -2715,47 +4000,132 @@ out:
 	return verok;
 }
 
-static int verify_authenticode(SIGNATURE *signature, GLOBAL_OPTIONS *options, X509 *signer)
+/*
+ * Return the signed part of the PKCS#7 content
+ */
+static const u_char *pkcs7_signed_content(PKCS7 *p7, size_t *len)
 {
-	X509_STORE *store;
-	STACK_OF(X509_CRL) *crls;
-	BIO *bio = NULL;
-	int verok = 0;
+	ASN1_STRING *value = p7->d.sign->contents->d.other->value.sequence;
 
-	store = X509_STORE_new();
-	if (!store)
-		goto out;
-	if (!load_file_lookup(store, options->cafile)) {
-		printf("Failed to add store lookup file\n");
-		X509_STORE_free(store);
-		goto out;
-	}
-	if (signature->time != INVALID_TIME && !set_store_time(store, signature->time)) {
-		printf("Failed to set store time\n");
-		X509_STORE_free(store);
-		goto out;
+	if (p7->d.sign->contents->d.other->type == V_ASN1_SEQUENCE) {
+		/* only the contents of the sequence */
+		size_t seqhdrlen = asn1_simple_hdr_len(value->data, value->length);
+		*len = value->length - seqhdrlen;
+		return value->data + seqhdrlen;
 	}
+	/* the entire value */
+	*len = value->length;
+	return value->data;
+}
 
-	/* verify a PKCS#7 signedData structure */
-	if (signature->p7->d.sign->contents->d.other->type == V_ASN1_SEQUENCE) {
-		/* only verify the contents of the sequence */
-		size_t seqhdrlen;
-		seqhdrlen = asn1_simple_hdr_len(signature->p7->d.sign->contents->d.other->value.sequence->data,
-			signature->p7->d.sign->contents->d.other->value.sequence->length);
-		bio = BIO_new_mem_buf(signature->p7->d.sign->contents->d.other->value.sequence->data + seqhdrlen,
-			signature->p7->d.sign->contents->d.other->value.sequence->length - seqhdrlen);
-	} else {
-		/* verify the entire value */
-		bio = BIO_new_mem_buf(signature->p7->d.sign->contents->d.other->value.sequence->data,
-			signature->p7->d.sign->contents->d.other->value.sequence->length);
-	}
-	if (!PKCS7_verify(signature->p7, NULL, store, bio, NULL, 0)) {
-		printf("\nPKCS7_verify error\n");
-		X509_STORE_free(store);
+/*
+ * Compare the digest of the signed content with the message digest
+ * authenticated attribute, as PKCS7_verify() does, without verifying the signer.
+ * Return 1 if they match.
+ */
+static int verify_content_digest(PKCS7 *p7)
+{
+	PKCS7_SIGNER_INFO *si;
+	ASN1_OCTET_STRING *digest = NULL;
+	const EVP_MD *md = NULL;
+	const u_char *content;
+	size_t content_len;
+	unsigned char cmdbuf[EVP_MAX_MD_SIZE];
+	char hexbuf[EVP_MAX_MD_SIZE*2+1];
+	int mdok;
+
+	si = sk_PKCS7_SIGNER_INFO_value(PKCS7_get_signer_info(p7), 0);
+	if (si) {
+		digest = PKCS7_digest_from_attributes(si->auth_attr);
+		md = digest_by_nid(OBJ_obj2nid(si->digest_alg->algorithm));
+	}
+	if (!digest || !md || digest->length != EVP_MD_size(md)) {
+		printf("Failed to extract current message digest\n\n");
+		return 0; /* FAILED */
+	}
+	printf("Message digest algorithm  : %s\n", EVP_MD_name(md));
+	tohex(digest->data, hexbuf, digest->length);
+	printf("Current message digest    : %s\n", hexbuf);
+
+	content = pkcs7_signed_content(p7, &content_len);
+	if (!EVP_Digest(content, content_len, cmdbuf, NULL, md, NULL)) {
+		printf("Failed to calculate message digest\n\n");
+		return 0; /* FAILED */
+	}
+	tohex(cmdbuf, hexbuf, EVP_MD_size(md));
+	mdok = !memcmp(digest->data, cmdbuf, EVP_MD_size(md));
+	printf("Calculated message digest : %s%s\n\n", hexbuf, mdok ? "" : "    MISMATCH!!!");
+	return mdok;
+}
+
+/*
+ * Verify the chains of the PKCS#7 signers as PKCS7_verify() does,
+ * the store is only loaded for the chains missing in the verified-chain cache
+ */
+static int verify_authenticode_chain(SIGNATURE *signature, GLOBAL_OPTIONS *options)
+{
+	X509_STORE *store = NULL;
+	STACK_OF(X509) *signers;
+	STACK_OF(X509) *certs = signature->p7->d.sign->cert;
+	unsigned char key[SHA256_DIGEST_LENGTH];
+	time_t not_before, not_after;
+	int i, verok = 0;
+
+	signers = PKCS7_get0_signers(signature->p7, NULL, 0);
+	if (!signers)
+		return 0; /* FAILED */
+	for (i = 0; i < sk_X509_num(signers); i++) {
+		X509 *signer = sk_X509_value(signers, i);
+		chain_cache_key(key, CHAIN_AUTHENTICODE, signer, certs, signature->p7->d.sign->crl,
+			options->cafile, NULL);
+		if (chain_cache_lookup(key, signature->time != INVALID_TIME ? signature->time : time(NULL)))
+			continue;
+		if (!store) {
+			store = X509_STORE_new();
+			if (!store)
+				goto out;
+			if (!load_file_lookup(store, options->cafile)) {
+				printf("Failed to add store lookup file\n");
+				goto out;
+			}
+			if (signature->time != INVALID_TIME && !set_store_time(store, signature->time)) {
+				printf("Failed to set store time\n");
+				goto out;
+			}
+		}
+		if (!verify_chain(store, signer, certs, signature->p7->d.sign->crl, "smime_sign",
+				&not_before, &not_after))
+			goto out;
+		chain_cache_store(key, not_before, not_after);
+	}
+	verok = 1; /* OK */
+out:
+	/* NULL is a valid parameter value for X509_STORE_free() */
+	X509_STORE_free(store);
+	sk_X509_free(signers);
+	return verok;
+}
+
+static int verify_authenticode(SIGNATURE *signature, GLOBAL_OPTIONS *options, X509 *signer)
+{
+	STACK_OF(X509_CRL) *crls;
+	BIO *bio = NULL;
+	const u_char *content;
+	size_t content_len;
+	int verok = 0;
+
+	if (!verify_authenticode_chain(signature, options)) {
+		printf("\nPKCS7_verify error\n");
+		goto out;
+	}
+	/* verify a PKCS#7 signedData structure, the signer's chain has been verified */
+	content = pkcs7_signed_content(signature->p7, &content_len);
+	bio = BIO_new_mem_buf(content, (int)content_len);
+	if (!PKCS7_verify(signature->p7, NULL, NULL, bio, NULL, PKCS7_NOVERIFY)) {
+		printf("\nPKCS7_verify error\n");
 		BIO_free(bio);
 		goto out;
 	}
-	X509_STORE_free(store);
 	BIO_free(bio);
 
 	/* verify a Certificate Revocation List */
@@ -2834,6 +4204,30 @@ static int verify_signature(SIGNATURE *signature, GLOBAL_OPTIONS *options)
 	return 0; /* OK */
 }
 
+/*
+ * verify_signature() timed as the PHASE_VERIFY phase.
+ * With "-chain-first" it is called before the file digest is calculated,
+ * so a file with an untrusted or revoked signer is rejected without hashing it.
+ */
+static int verify_signature_phase(SIGNATURE *signature, GLOBAL_OPTIONS *options,
+	file_type_t type, uint64_t size)
+{
+	int ret;
+	PHASE phase;
+
+#ifndef HAVE_SYS_SDT_H
+	/* suppress compiler warnings */
+	(void)type;
+	(void)size;
+#endif /* HAVE_SYS_SDT_H */
+	phase_begin(&phase, PHASE_VERIFY);
+	USDT_PROBE2(verify_signature_entry, type, size);
+	ret = verify_signature(signature, options);
+	USDT_PROBE2(verify_signature_return, type, size);
+	phase_end(&phase, 0);
+	return ret;
+}
+
 /*
  * MSI file support
  * https://msdn.microsoft.com/en-us/library/dd942138.aspx
@@ -2908,6 +4302,7 @@ static int msi_verify_pkcs7(SIGNATURE *signature, MSI_FILE *msi, MSI_DIRENT *dir
 	char hexbuf[EVP_MAX_MD_SIZE*2+1];
 	const EVP_MD *md;
 	BIO *hash;
+	PHASE phase;
 
 	if (is_content_type(signature->p7, SPC_INDIRECT_DATA_OBJID)) {
 		ASN1_STRING *content_val = signature->p7->d.sign->contents->d.other->value.sequence;
@@ -2925,9 +4320,12 @@ static int msi_verify_pkcs7(SIGNATURE *signature, MSI_FILE *msi, MSI_DIRENT *dir
 		printf("Failed to extract current message digest\n\n");
 		goto out;
 	}
+	if (options->chain_first &&
+			verify_signature_phase(signature, options, FILE_TYPE_MSI, msi->m_bufferLen))
+		goto out;
 	printf("Message digest algorithm         : %s\n", OBJ_nid2sn(mdtype));
 
-	md = EVP_get_digestbynid(mdtype);
+	md = digest_by_nid(mdtype);
 	hash = BIO_new(BIO_f_md());
 	BIO_set_md(hash, md);
 	BIO_push(hash, BIO_new(BIO_s_null()));
@@ -2952,11 +4350,16 @@ static int msi_verify_pkcs7(SIGNATURE *signature, MSI_FILE *msi, MSI_DIRENT *dir
 		printf("Calculated MsiDigitalSignatureEx : %s\n", hexbuf);
 	}
 
+	phase_begin(&phase, PHASE_DIGEST);
+	USDT_PROBE2(msi_hash_dir_entry, FILE_TYPE_MSI, msi->m_bufferLen);
 	if (!msi_hash_dir(msi, dirent, hash, 1)) {
+		phase_end(&phase, 0);
 		printf("Failed to calculate DigitalSignature\n\n");
 		BIO_free_all(hash);
 		goto out;
 	}
+	USDT_PROBE2(msi_hash_dir_return, FILE_TYPE_MSI, msi->m_bufferLen);
+	phase_end(&phase, msi->m_bufferLen);
 	tohex(mdbuf, hexbuf, EVP_MD_size(md));
 	printf("Current DigitalSignature         : %s\n", hexbuf);
 	BIO_gets(hash, (char*)cmdbuf, EVP_MAX_MD_SIZE);
@@ -2969,7 +4372,14 @@ static int msi_verify_pkcs7(SIGNATURE *signature, MSI_FILE *msi, MSI_DIRENT *dir
 		goto out;
 	}
 
-	ret = verify_signature(signature, options);
+	if (options->digest_only) {
+		printf("Digest verification: ok\n\n");
+		ret = 0; /* OK */
+	} else if (options->chain_first) {
+		ret = 0; /* OK */
+	} else {
+		ret = verify_signature_phase(signature, options, FILE_TYPE_MSI, msi->m_bufferLen);
+	}
 out:
 	if (!ret)
 		ERR_print_errors_fp(stdout);
@@ -3090,10 +4500,12 @@ static int msi_remove_file(MSI_PARAMS *msiparams, BIO *outdata)
 	if (!msi_dirent_delete(msiparams->dirent, digital_signature, sizeof digital_signature)) {
 		return 1; /* FAILED */
 	}
+	USDT_PROBE2(msi_file_write_entry, FILE_TYPE_MSI, 0);
 	if (!msi_file_write(msiparams->msi, msiparams->dirent, NULL, 0, NULL, 0, outdata)) {
 		printf("Saving the msi file failed\n");
 		return 1; /* FAILED */
 	}
+	USDT_PROBE2(msi_file_write_return, FILE_TYPE_MSI, BIO_tell(outdata));
 	return 0; /* OK */
 }
 
@@ -3155,6 +4567,31 @@ static int msi_calc_MsiDigitalSignatureEx(MSI_PARAMS *msiparams, const EVP_MD *m
 	return 1; /* OK */
 }
 
+/*
+ * Hash len bytes of the mapped file at *pos in place, without copying them
+ * through a memory BIO, and advance *pos.  The range is clipped to end.
+ * A NULL mdctx skips the bytes.  Returns a pointer to the bytes,
+ * or NULL if they are not all within the hashed range.
+ */
+static const u_char *digest_mapped(EVP_MD_CTX *mdctx, const char *indata,
+	size_t *pos, size_t len, size_t end)
+{
+	const u_char *p = (const u_char *)indata + *pos;
+
+	if (*pos >= end)
+		return NULL;
+	if (len > end - *pos) {
+		if (mdctx)
+			EVP_DigestUpdate(mdctx, p, end - *pos);
+		*pos = end;
+		return NULL;
+	}
+	if (mdctx)
+		EVP_DigestUpdate(mdctx, p, len);
+	*pos += len;
+	return p;
+}
+
 /*
  * PE file support
  */
@@ -3162,55 +4599,43 @@ static int msi_calc_MsiDigitalSignatureEx(MSI_PARAMS *msiparams, const EVP_MD *m
 /* Compute a message digest value of the signed or unsigned PE file */
 static void pe_calc_digest(char *indata, const EVP_MD *md, unsigned char *mdbuf, FILE_HEADER *header)
 {
-	BIO *bio = NULL;
-	static unsigned char bfb[16*1024*1024];
+	static const u_char zeroes[8] = {0};
 	EVP_MD_CTX *mdctx;
-	size_t n;
+	size_t pos = 0;
 	size_t offset;
+	PHASE phase;
 
+	phase_begin(&phase, PHASE_DIGEST);
+	USDT_PROBE2(pe_calc_digest_entry, FILE_TYPE_PE, header->fileend);
 	if (header->sigpos)
 		offset = header->sigpos;
 	else
 		offset = header->fileend;
 
-	bio = BIO_new_mem_buf(indata, offset);
 	mdctx = EVP_MD_CTX_new();
 	EVP_DigestInit(mdctx, md);
 	memset(mdbuf, 0, EVP_MAX_MD_SIZE);
-	(void)BIO_seek(bio, 0);
 
-	BIO_read(bio, bfb, header->header_size + 88);
-	EVP_DigestUpdate(mdctx, bfb, header->header_size + 88);
-	BIO_read(bio, bfb, 4);
-	BIO_read(bio, bfb, 60 + header->pe32plus * 16);
-	EVP_DigestUpdate(mdctx, bfb, 60 + header->pe32plus * 16);
-	BIO_read(bio, bfb, 8);
-
-	n = header->header_size + 88 + 4 + 60 + header->pe32plus * 16 + 8;
-	while (n < offset) {
-		int l;
-		size_t want = offset - n;
-		if (want > sizeof bfb)
-			want = sizeof bfb;
-		l = BIO_read(bio, bfb, want);
-		if (l <= 0)
-			break;
-		EVP_DigestUpdate(mdctx, bfb, l);
-		n += l;
-	}
+	digest_mapped(mdctx, indata, &pos, header->header_size + 88, offset);
+	/* skip the CheckSum */
+	digest_mapped(NULL, indata, &pos, 4, offset);
+	digest_mapped(mdctx, indata, &pos, 60 + header->pe32plus * 16, offset);
+	/* skip the Certificate Table directory entry */
+	digest_mapped(NULL, indata, &pos, 8, offset);
+	if (pos < offset)
+		digest_mapped(mdctx, indata, &pos, offset - pos, offset);
 
 	if (!header->sigpos) {
 		/* pad (with 0's) unsigned PE file to 8 byte boundary */
 		int len = 8 - header->fileend % 8;
-		if (len > 0 && len != 8) {
-			memset(bfb, 0, len);
-			EVP_DigestUpdate(mdctx, bfb, len);
-		}
+		if (len > 0 && len != 8)
+			EVP_DigestUpdate(mdctx, zeroes, len);
 	}
 
 	EVP_DigestFinal(mdctx, mdbuf, NULL);
 	EVP_MD_CTX_free(mdctx);
-	BIO_free(bio);
+	USDT_PROBE2(pe_calc_digest_return, FILE_TYPE_PE, offset);
+	phase_end(&phase, offset);
 }
 
 static void pe_extract_page_hash(SpcAttributeTypeAndOptionalValue *obj,
@@ -3223,6 +4648,10 @@ static void pe_extract_page_hash(SpcAttributeTypeAndOptionalValue *obj,
 	char buf[128];
 
 	*phlen = 0;
+	/* only a PE file signature has page hashes */
+	OBJ_obj2txt(buf, sizeof buf, obj->type, 1);
+	if (strcmp(buf, SPC_PE_IMAGE_DATA_OBJID))
+		return;
 	blob = obj->value->value.sequence->data;
 	id = d2i_SpcPeImageData(NULL, &blob, obj->value->value.sequence->length);
 	if (id == NULL)
@@ -3295,9 +4724,29 @@ static int pe_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *head
 		printf("Failed to extract current message digest\n\n");
 		goto out;
 	}
+	if (options->chain_first &&
+			verify_signature_phase(signature, options, FILE_TYPE_PE, header->fileend))
+		goto out;
+	/*
+	 * The page hashes are checked first, a modified page
+	 * fails without hashing the rest of the file.
+	 */
+	if (phlen > 0) {
+		printf("Page hash algorithm  : %s\n", OBJ_nid2sn(phtype));
+		tohex(ph, hexbuf, (phlen < 32) ? phlen : 32);
+		printf("Page hash            : %s ...\n", hexbuf);
+		mdok = pe_verify_page_hash(indata, header, ph, phlen, phtype, 0, UINT32_MAX,
+			options->verbose, 0);
+		printf("\n");
+		if (!mdok) {
+			printf("Signature verification: failed\n\n");
+			goto out;
+		}
+	}
+
 	printf("Message digest algorithm  : %s\n", OBJ_nid2sn(mdtype));
 
-	md = EVP_get_digestbynid(mdtype);
+	md = digest_by_nid(mdtype);
 	tohex(mdbuf, hexbuf, EVP_MD_size(md));
 	printf("Current message digest    : %s\n", hexbuf);
 
@@ -3310,25 +4759,14 @@ static int pe_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *head
 		goto out;
 	}
 
-	if (phlen > 0) {
-		size_t cphlen = 0;
-		unsigned char *cph;
-
-		printf("Page hash algorithm  : %s\n", OBJ_nid2sn(phtype));
-		tohex(ph, hexbuf, (phlen < 32) ? phlen : 32);
-		printf("Page hash            : %s ...\n", hexbuf);
-		cph = pe_calc_page_hash(indata, header->header_size, header->pe32plus, header->sigpos, phtype, &cphlen);
-		tohex(cph, hexbuf, (cphlen < 32) ? cphlen : 32);
-		mdok = (phlen = cphlen) && !memcmp(ph, cph, phlen);
-		OPENSSL_free(cph);
-		printf("Calculated page hash : %s ...%s\n\n", hexbuf, mdok ? "" : "    MISMATCH!!!");
-		if (!mdok) {
-			printf("Signature verification: failed\n\n");
-			goto out;
-		}
+	if (options->digest_only) {
+		printf("Digest verification: ok\n\n");
+		ret = 0; /* OK */
+	} else if (options->chain_first) {
+		ret = 0; /* OK */
+	} else {
+		ret = verify_signature_phase(signature, options, FILE_TYPE_PE, header->fileend);
 	}
-
-	ret = verify_signature(signature, options);
 out:
 	if (!ret)
 		ERR_print_errors_fp(stdout);
@@ -3360,18 +4798,12 @@ static PKCS7 *pe_extract_existing_pkcs7(char *indata, FILE_HEADER *header)
 	return p7;
 }
 
-static int pe_verify_file(char *indata, FILE_HEADER *header, GLOBAL_OPTIONS *options)
+static void pe_print_checksum(char *indata, FILE_HEADER *header)
 {
-	int i, peok = 1, ret = 1;
+	int peok = 1;
 	BIO *bio;
 	unsigned int real_pe_checksum;
-	PKCS7 *p7;
-	STACK_OF(SIGNATURE) *signatures = sk_SIGNATURE_new_null();
 
-	if (header->siglen == 0)
-		header->siglen = header->fileend;
-
-	/* check PE checksum */
 	printf("Current PE checksum   : %08X\n", header->pe_checksum);
 	bio = BIO_new_mem_buf(indata, header->sigpos + header->siglen);
 	real_pe_checksum = pe_calc_checksum(bio, header);
@@ -3379,6 +4811,20 @@ static int pe_verify_file(char *indata, FILE_HEADER *header, GLOBAL_OPTIONS *opt
 	if (header->pe_checksum && header->pe_checksum != real_pe_checksum)
 		peok = 0;
 	printf("Calculated PE checksum: %08X%s\n\n", real_pe_checksum, peok ? "" : "    MISMATCH!!!");
+}
+
+static int pe_verify_file(char *indata, FILE_HEADER *header, GLOBAL_OPTIONS *options)
+{
+	int i, ret = 1;
+	PKCS7 *p7;
+	STACK_OF(SIGNATURE) *signatures = sk_SIGNATURE_new_null();
+
+	if (header->siglen == 0)
+		header->siglen = header->fileend;
+
+	/* check PE checksum, with "-chain-first" only after a verified signature */
+	if (!options->chain_first && !options->digest_only)
+		pe_print_checksum(indata, header);
 
 	if (header->sigpos == 0) {
 		printf("No signature found\n\n");
@@ -3400,7 +4846,80 @@ static int pe_verify_file(char *indata, FILE_HEADER *header, GLOBAL_OPTIONS *opt
 		ret &= pe_verify_pkcs7(signature, indata, header, options);
 	}
 	printf("Number of verified signatures: %d\n", i);
+	if (options->chain_first && !ret)
+		pe_print_checksum(indata, header);
+out:
+	sk_SIGNATURE_pop_free(signatures, signature_free);
+	return ret;
+}
+
+/*
+ * Verify the pages within the "-range" bytes of a PE file signed with page hashes,
+ * e.g. of a partially downloaded file with its headers and signature in place.
+ * The primary signature is verified once, the file digest and the PE checksum
+ * are not calculated, as they need the whole file.
+ */
+static int pe_verify_pages(char *indata, FILE_HEADER *header, GLOBAL_OPTIONS *options)
+{
+	int ret = 1, phtype = -1;
+	unsigned char *ph = NULL;
+	size_t phlen = 0;
+	char hexbuf[EVP_MAX_MD_SIZE*2+1];
+	PKCS7 *p7;
+	SIGNATURE *signature;
+	STACK_OF(SIGNATURE) *signatures = sk_SIGNATURE_new_null();
+
+	if (header->sigpos == 0) {
+		printf("No signature found\n\n");
+		goto out;
+	}
+	p7 = pe_extract_existing_pkcs7(indata, header);
+	if (!p7) {
+		printf("Failed to extract PKCS7 data\n\n");
+		goto out;
+	}
+	if (!append_signature_list(&signatures, p7, 0)) {
+		printf("Failed to create signature list\n\n");
+		PKCS7_free(p7);
+		goto out;
+	}
+	signature = sk_SIGNATURE_value(signatures, 0);
+	if (is_content_type(signature->p7, SPC_INDIRECT_DATA_OBJID)) {
+		ASN1_STRING *content_val = signature->p7->d.sign->contents->d.other->value.sequence;
+		const unsigned char *p = content_val->data;
+		SpcIndirectDataContent *idc = d2i_SpcIndirectDataContent(NULL, &p, content_val->length);
+		if (idc) {
+			pe_extract_page_hash(idc->data, &ph, &phlen, &phtype);
+			SpcIndirectDataContent_free(idc);
+		}
+	}
+	if (phlen == 0) {
+		printf("No page hashes found\n\n");
+		goto out;
+	}
+
+	ret = verify_signature_phase(signature, options, FILE_TYPE_PE, header->fileend);
+	if (ret)
+		goto out;
+
+	printf("Page hash algorithm  : %s\n", OBJ_nid2sn(phtype));
+	tohex(ph, hexbuf, (phlen < 32) ? phlen : 32);
+	printf("Page hash            : %s ...\n", hexbuf);
+	if (options->range_last == UINT32_MAX)
+		printf("Byte range           : 0x%08X-\n", options->range_first);
+	else
+		printf("Byte range           : 0x%08X-0x%08X\n", options->range_first, options->range_last);
+	if (!pe_verify_page_hash(indata, header, ph, phlen, phtype,
+			options->range_first, options->range_last, 1, 0)) {
+		printf("\nPage verification: failed\n\n");
+		ret = 1;
+		goto out;
+	}
+	printf("\nPage verification: ok\n\n");
 out:
+	if (ret)
+		ERR_print_errors_fp(stdout);
+	OPENSSL_free(ph);
 	sk_SIGNATURE_pop_free(signatures, signature_free);
 	return ret;
 }
@@ -3572,60 +5091,53 @@ static int cab_verify_header(char *indata, char *infile, size_t filesize, FILE_H
 /* Compute a message digest value of the signed or unsigned CAB file */
 static void cab_calc_digest(char *indata, const EVP_MD *md, unsigned char *mdbuf, FILE_HEADER *header)
 {
-	BIO *bio;
-	static unsigned char bfb[16*1024*1024];
 	EVP_MD_CTX *mdctx;
+	const u_char *p;
+	size_t pos = 0;
 	uint32_t offset, coffFiles;
+	PHASE phase;
 
+	phase_begin(&phase, PHASE_DIGEST);
+	USDT_PROBE2(cab_calc_digest_entry, FILE_TYPE_CAB, header->fileend);
 	if (header->sigpos)
 		offset = header->sigpos;
 	else
 		offset = header->fileend;
 
-	bio = BIO_new_mem_buf(indata, offset);
 	mdctx = EVP_MD_CTX_new();
 	EVP_DigestInit(mdctx, md);
 	memset(mdbuf, 0, EVP_MAX_MD_SIZE);
-	(void)BIO_seek(bio, 0);
 
 	/* u1 signature[4] 4643534D MSCF: 0-3 */
-	BIO_read(bio, bfb, 4);
-	EVP_DigestUpdate(mdctx, bfb, 4);
+	digest_mapped(mdctx, indata, &pos, 4, offset);
 	/* u4 reserved1 00000000: 4-7 */
-	BIO_read(bio, bfb, 4);
+	digest_mapped(NULL, indata, &pos, 4, offset);
 	if (header->sigpos) {
 		uint16_t nfolders, flags;
 		/*
 		 * u4 cbCabinet - size of this cabinet file in bytes: 8-11
 		 * u4 reserved2 00000000: 12-15
 		 */
-		BIO_read(bio, bfb, 8);
-		EVP_DigestUpdate(mdctx, bfb, 8);
+		digest_mapped(mdctx, indata, &pos, 8, offset);
 		 /* u4 coffFiles - offset of the first CFFILE entry: 16-19 */
-		BIO_read(bio, bfb, 4);
-		coffFiles = GET_UINT32_LE(bfb);
-		EVP_DigestUpdate(mdctx, bfb, 4);
+		p = digest_mapped(mdctx, indata, &pos, 4, offset);
+		coffFiles = p ? (uint32_t)GET_UINT32_LE(p) : offset;
 		/*
 		 * u4 reserved3 00000000: 20-23
 		 * u1 versionMinor 03: 24
 		 * u1 versionMajor 01: 25
 		 */
-		BIO_read(bio, bfb, 6);
-		EVP_DigestUpdate(mdctx, bfb, 6);
+		digest_mapped(mdctx, indata, &pos, 6, offset);
 		/* u2 cFolders - number of CFFOLDER entries in this cabinet: 26-27 */
-		BIO_read(bio, bfb, 2);
-		nfolders = GET_UINT16_LE(bfb);
-		EVP_DigestUpdate(mdctx, bfb, 2);
+		p = digest_mapped(mdctx, indata, &pos, 2, offset);
+		nfolders = p ? GET_UINT16_LE(p) : 0;
 		/* u2 cFiles - number of CFFILE entries in this cabinet: 28-29 */
-		BIO_read(bio, bfb, 2);
-		EVP_DigestUpdate(mdctx, bfb, 2);
+		digest_mapped(mdctx, indata, &pos, 2, offset);
 		/* u2 flags: 30-31 */
-		BIO_read(bio, bfb, 2);
-		flags = GET_UINT16_LE(bfb);
-		EVP_DigestUpdate(mdctx, bfb, 2);
+		p = digest_mapped(mdctx, indata, &pos, 2, offset);
+		flags = p ? GET_UINT16_LE(p) : 0;
 		/* u2 setID must be the same for all cabinets in a set: 32-33 */
-		BIO_read(bio, bfb, 2);
-		EVP_DigestUpdate(mdctx, bfb, 2);
+		digest_mapped(mdctx, indata, &pos, 2, offset);
 		/*
 		* u2 iCabinet - number of this cabinet file in a set: 34-35
 		* u2 cbCFHeader: 36-37
@@ -3635,43 +5147,37 @@ static void cab_calc_digest(char *indata, const EVP_MD *md, unsigned char *mdbuf
 		* - Additional data offset: 44-47
 		* - Additional data size: 48-51
 		*/
-		BIO_read(bio, bfb, 22);
+		digest_mapped(NULL, indata, &pos, 22, offset);
 		/* u22 abReserve: 56-59 */
-		BIO_read(bio, bfb, 4);
-		EVP_DigestUpdate(mdctx, bfb, 4);
+		digest_mapped(mdctx, indata, &pos, 4, offset);
 
 		/* TODO */
 		if (flags & FLAG_PREV_CABINET) {
 			/* szCabinetPrev */
 			do {
-				BIO_read(bio, bfb, 1);
-				EVP_DigestUpdate(mdctx, bfb, 1);
-			} while (bfb[0]);
+				p = digest_mapped(mdctx, indata, &pos, 1, offset);
+			} while (p && *p);
 			/* szDiskPrev */
 			do {
-				BIO_read(bio, bfb, 1);
-				EVP_DigestUpdate(mdctx, bfb, 1);
-			} while (bfb[0]);
+				p = digest_mapped(mdctx, indata, &pos, 1, offset);
+			} while (p && *p);
 		}
 		if (flags & FLAG_NEXT_CABINET) {
 			/* szCabinetNext */
 			do {
-				BIO_read(bio, bfb, 1);
-				EVP_DigestUpdate(mdctx, bfb, 1);
-			} while (bfb[0]);
+				p = digest_mapped(mdctx, indata, &pos, 1, offset);
+			} while (p && *p);
 			/* szDiskNext */
 			do {
-				BIO_read(bio, bfb, 1);
-				EVP_DigestUpdate(mdctx, bfb, 1);
-			} while (bfb[0]);
+				p = digest_mapped(mdctx, indata, &pos, 1, offset);
+			} while (p && *p);
 		}
 		/*
 		 * (u8 * cFolders) CFFOLDER - structure contains information about
 		 * one of the folders or partial folders stored in this cabinet file
 		 */
 		while (nfolders) {
-			BIO_read(bio, bfb, 8);
-			EVP_DigestUpdate(mdctx, bfb, 8);
+			digest_mapped(mdctx, indata, &pos, 8, offset);
 			nfolders--;
 		}
 	} else {
@@ -3679,21 +5185,13 @@ static void cab_calc_digest(char *indata, const EVP_MD *md, unsigned char *mdbuf
 		coffFiles = 8;
 	}
 	/* (variable) ab - the compressed data bytes */
-	while (coffFiles < offset) {
-		int l;
-		uint32_t want = offset - coffFiles;
-		if (want > sizeof bfb)
-			want = sizeof bfb;
-		l = BIO_read(bio, bfb, want);
-		if (l <= 0)
-			break;
-		EVP_DigestUpdate(mdctx, bfb, l);
-		coffFiles += l;
-	}
+	if (coffFiles < offset)
+		digest_mapped(mdctx, indata, &pos, offset - coffFiles, offset);
 
 	EVP_DigestFinal(mdctx, mdbuf, NULL);
 	EVP_MD_CTX_free(mdctx);
-	BIO_free(bio);
+	USDT_PROBE2(cab_calc_digest_return, FILE_TYPE_CAB, offset);
+	phase_end(&phase, offset);
 }
 
 static int cab_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *header,
@@ -3721,9 +5219,12 @@ static int cab_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *hea
 		printf("Failed to extract current message digest\n\n");
 		goto out;
 	}
+	if (options->chain_first &&
+			verify_signature_phase(signature, options, FILE_TYPE_CAB, header->fileend))
+		goto out;
 	printf("Message digest algorithm  : %s\n", OBJ_nid2sn(mdtype));
 
-	md = EVP_get_digestbynid(mdtype);
+	md = digest_by_nid(mdtype);
 	tohex(mdbuf, hexbuf, EVP_MD_size(md));
 	printf("Current message digest    : %s\n", hexbuf);
 
@@ -3737,7 +5238,14 @@ static int cab_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *hea
 		goto out;
 	}
 
-	ret = verify_signature(signature, options);
+	if (options->digest_only) {
+		printf("Digest verification: ok\n\n");
+		ret = 0; /* OK */
+	} else if (options->chain_first) {
+		ret = 0; /* OK */
+	} else {
+		ret = verify_signature_phase(signature, options, FILE_TYPE_CAB, header->fileend);
+	}
 out:
 	if (!ret)
 		ERR_print_errors_fp(stdout);
@@ -4087,6 +5595,7 @@ static int cat_verify_member(CatalogAuthAttr *attribute, char *indata, FILE_HEAD
 		size_t phlen = 0;
 		const EVP_MD *md;
 		ASN1_TYPE *content;
+		PHASE phase;
 		SpcIndirectDataContent *idc;
 
 		ASN1_STRING *content_val = attribute->contents->value.sequence;
@@ -4117,7 +5626,7 @@ static int cat_verify_member(CatalogAuthAttr *attribute, char *indata, FILE_HEAD
 			printf("Failed to extract current message digest\n\n");
 			goto out;
 		}
-		md = EVP_get_digestbynid(mdtype);
+		md = digest_by_nid(mdtype);
 		/* compute a message digest of the input file */
 		switch (filetype) {
 			case FILE_TYPE_CAB:
@@ -4127,7 +5636,9 @@ static int cat_verify_member(CatalogAuthAttr *attribute, char *indata, FILE_HEAD
 				pe_calc_digest(indata, md, cmdbuf, header);
 				break;
 			case FILE_TYPE_MSI:
+				phase_begin(&phase, PHASE_DIGEST);
 				msi_calc_digest(indata, md, cmdbuf, header->fileend);
+				phase_end(&phase, header->fileend);
 				break;
 			default:
 				break;
@@ -4144,12 +5655,7 @@ static int cat_verify_member(CatalogAuthAttr *attribute, char *indata, FILE_HEAD
 		}
 
 		if (phlen > 0) {
-			size_t cphlen = 0;
-			unsigned char *cph;
-			cph = pe_calc_page_hash(indata, header->header_size, header->pe32plus, header->sigpos, phtype, &cphlen);
-			tohex(cph, hexbuf, (cphlen < 32) ? cphlen : 32);
-			mdok = (phlen = cphlen) && !memcmp(ph, cph, phlen);
-			OPENSSL_free(cph);
+			mdok = pe_verify_page_hash(indata, header, ph, phlen, phtype, 0, UINT32_MAX, 0, 1);
 			if (mdok) {
 				printf("Page hash algorithm  : %s\n", OBJ_nid2sn(phtype));
 				tohex(ph, hexbuf, (phlen < 32) ? phlen : 32);
@@ -4176,6 +5682,9 @@ static int cat_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *hea
 {
 	int ret = 1, ok = 0;
 
+	if (options->chain_first && options->catalog &&
+			verify_signature_phase(signature, options, filetype, header->fileend))
+		return ret;
 	/* A CTL (MS_CTL_OBJID) is a list of hashes of certificates or a list of hashes files */
 	if (options->catalog && is_content_type(signature->p7, MS_CTL_OBJID)) {
 		ASN1_STRING *content_val = signature->p7->d.sign->contents->d.other->value.sequence;
@@ -4208,9 +5717,19 @@ static int cat_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *hea
 		/* the input file is a catalog file */
 		ok = 1;
 	}
-	if (ok) {
+	if (ok && options->digest_only) {
+		/* the file digest is found in the catalog, or the catalog content is checked */
+		if (options->catalog || verify_content_digest(signature->p7)) {
+			printf("Digest verification: ok\n\n");
+			ret = 0; /* OK */
+		} else {
+			printf("Digest verification: failed\n\n");
+		}
+	} else if (ok && options->chain_first && options->catalog) {
+		ret = 0; /* OK */
+	} else if (ok) {
 		/* a message digest value of the catalog file is checked by PKCS7_verify() */
-		ret = verify_signature(signature, options);
+		ret = verify_signature_phase(signature, options, filetype, header->fileend);
 	} else {
 		printf("File not found in the specified catalog.\n\n");
 	}
@@ -4317,7 +5836,7 @@ static int add_opus_attribute(PKCS7_SIGNER_INFO *si, char *desc, char *url)
 	return 1; /* OK */
 }
 
-static PKCS7 *create_new_signature(file_type_t type,
+static PKCS7 *create_new_signature(file_type_t type, const EVP_MD *md,
 			GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
 {
 	int i, signer = -1;
@@ -4327,13 +5846,27 @@ static PKCS7 *create_new_signature(file_type_t type,
 	sig = PKCS7_new();
 	PKCS7_set_type(sig, NID_pkcs7_signed);
 
+#ifdef PROVIDE_SIGNER_CMD
+	if (options->signer_cmd) {
+		/*
+		 * the public key only selects the signature algorithm,
+		 * the signature itself is computed later by the external signer
+		 */
+		si = PKCS7_add_signature(sig, cparams->cert, X509_get0_pubkey(cparams->cert), md);
+		if (si == NULL)
+			return NULL; /* FAILED */
+		/* PKCS7_dataFinal() skips signer infos without a private key */
+		EVP_PKEY_free(si->pkey);
+		si->pkey = NULL;
+	} else
+#endif /* PROVIDE_SIGNER_CMD */
 	if (cparams->cert != NULL) {
 		/*
 		 * the private key and corresponding certificate are parsed from the PKCS12
 		 * structure or loaded from the security token, so we may omit to check
 		 * the consistency of a private key with the public key in an X509 certificate
 		 */
-		si = PKCS7_add_signature(sig, cparams->cert, cparams->pkey, options->md);
+		si = PKCS7_add_signature(sig, cparams->cert, cparams->pkey, md);
 		if (si == NULL)
 			return NULL; /* FAILED */
 	} else {
@@ -4341,7 +5874,7 @@ static PKCS7 *create_new_signature(file_type_t type,
 		for (i=0; i<sk_X509_num(cparams->certs); i++) {
 			X509 *signcert = sk_X509_value(cparams->certs, i);
 			if (X509_check_private_key(signcert, cparams->pkey)) {
-				si = PKCS7_add_signature(sig, signcert, cparams->pkey, options->md);
+				si = PKCS7_add_signature(sig, signcert, cparams->pkey, md);
 				signer = i;
 				break;
 			}
@@ -4426,7 +5959,7 @@ static int add_unauthenticated_blob(PKCS7 *sig)
 /*
  * Append signature to the outfile
  */
-static int append_signature(PKCS7 *sig, PKCS7 *cursig, file_type_t type,
+static int append_signature(PKCS7 *sig, PKCS7 *sig2, PKCS7 *cursig, file_type_t type,
 			GLOBAL_OPTIONS *options, MSI_PARAMS *msiparams, size_t *padlen, int *len, BIO *outdata)
 {
 	u_char *p = NULL;
@@ -4446,6 +5979,11 @@ static int append_signature(PKCS7 *sig, PKCS7 *cursig, file_type_t type,
 	} else {
 		outsig = sig;
 	}
+	/* the second signature of dual signing is nested as by another "sign -nest" */
+	if (sig2 && pkcs7_set_nested_signature(outsig, sig2, options->signing_time) == 0) {
+		printf("Unable to append the second signature\n");
+		return 1; /* FAILED */
+	}
 	/* Append signature to outfile */
 	if (((*len = i2d_PKCS7(outsig, NULL)) <= 0) || (p = OPENSSL_malloc(*len)) == NULL) {
 		printf("i2d_PKCS memory allocation failed: %d\n", *len);
@@ -4472,11 +6010,13 @@ static int append_signature(PKCS7 *sig, PKCS7 *cursig, file_type_t type,
 		int len_msi = *len;
 		unsigned char *p_msi = OPENSSL_malloc(len_msi);
 		memcpy(p_msi, p, len_msi);
+		USDT_PROBE2(msi_file_write_entry, FILE_TYPE_MSI, len_msi);
 		if (!msi_file_write(msiparams->msi, msiparams->dirent, p_msi, len_msi,
 				msiparams->p_msiex, msiparams->len_msiex, outdata)) {
 			printf("Saving the msi file failed\n");
 			return 1; /* FAILED */
 		}
+		USDT_PROBE2(msi_file_write_return, FILE_TYPE_MSI, BIO_tell(outdata));
 	} else if (type == FILE_TYPE_CAT) {
 		i2d_PKCS7_bio(outdata, outsig);
 	}
@@ -4566,14 +6106,21 @@ static char *map_file(const char *infile, const off_t size)
 	if (fh == INVALID_HANDLE_VALUE)
 		return NULL;
 	fm = CreateFileMapping(fh, NULL, PAGE_READONLY, 0, 0, NULL);
-	if (fm == NULL)
+	if (fm == NULL) {
+		CloseHandle(fh);
 		return NULL;
+	}
 	indata = MapViewOfFile(fm, FILE_MAP_READ, 0, 0, 0);
+	/* the mapped view keeps the file open */
+	CloseHandle(fm);
+	CloseHandle(fh);
 #else
 	int fd = open(infile, O_RDONLY);
 	if (fd < 0)
 		return NULL;
 	indata = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* the mapping keeps the file open */
+	close(fd);
 	if (indata == MAP_FAILED)
 		return NULL;
 #endif
@@ -4715,7 +6262,9 @@ static int get_file_type(char *indata, char *infile, file_type_t *type)
 		/* the maximum size of a supported cat file is (2^24 -1) bytes */
 		*type = FILE_TYPE_CAT;
 	} else {
-		printf("Unrecognized file type: %s\n", infile);
+		/* no message for a NULL infile */
+		if (infile)
+			printf("Unrecognized file type: %s\n", infile);
 		return 0; /* FAILED */
 	}
 	return 1; /* OK */
@@ -4950,6 +6499,14 @@ out:
 	return ret;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/* Check whether the "-key" argument is a "pkcs11:" URI */
+static int is_pkcs11_uri(const char *keyfile)
+{
+	return keyfile && !strncmp(keyfile, "pkcs11:", 7);
+}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
 /*
  * Decode Microsoft Private Key (PVK) file.
  * PVK is a proprietary Microsoft format that stores a cryptographic private key.
@@ -4968,6 +6525,9 @@ static char *find_pvk_key(GLOBAL_OPTIONS *options)
 #ifndef OPENSSL_NO_ENGINE
 			|| options->p11module
 #endif /* OPENSSL_NO_ENGINE */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			|| options->provider || is_pkcs11_uri(options->keyfile)
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
 			)
 		return NULL; /* FAILED */
 	btmp = BIO_new_file(options->keyfile, "rb");
@@ -5005,6 +6565,98 @@ out:
 	return ret;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+/* Supply the "-pass" password to the OSSL_STORE loader */
+static int store_password_cb(char *buf, int size, int rwflag, void *u)
+{
+	const char *pass = (const char *)u;
+	int len;
+
+	(void)rwflag;
+	if (!pass)
+		return -1; /* FAILED */
+	len = (int)strlen(pass);
+	if (len > size)
+		len = size;
+	memcpy(buf, pass, (size_t)len);
+	return len; /* OK */
+}
+
+/*
+ * Load the private key (and the signer certificate if "-certs" was not given)
+ * through an OSSL_STORE URI, e.g. a "pkcs11:" URI served by a provider.
+ * The EVP_PKEY handle is kept in cparams->pkey for the whole run,
+ * so the provider-side key object is opened only once per process.
+ */
+static int read_store_key(GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	OSSL_STORE_CTX *store;
+	UI_METHOD *ui_method;
+	int ret = 0;
+
+	if (options->provider) {
+		/* keep the default provider available for all other algorithms */
+		cparams->provider = OSSL_PROVIDER_try_load(NULL, options->provider, 1);
+		if (!cparams->provider) {
+			printf("Failed to load provider: %s\n", options->provider);
+			return 0; /* FAILED */
+		}
+		printf("Provider \"%s\" set.\n", OSSL_PROVIDER_get0_name(cparams->provider));
+	}
+	ui_method = UI_UTIL_wrap_read_pem_callback(store_password_cb, 0);
+	if (!ui_method)
+		return 0; /* FAILED */
+	store = OSSL_STORE_open_ex(options->keyfile, NULL, NULL, ui_method,
+		options->pass, NULL, NULL, NULL);
+	if (!store) {
+		printf("Failed to open store: %s\n", options->keyfile);
+		UI_destroy_method(ui_method);
+		return 0; /* FAILED */
+	}
+	while (!OSSL_STORE_eof(store) && (!cparams->pkey || !cparams->cert)) {
+		OSSL_STORE_INFO *info = OSSL_STORE_load(store);
+
+		if (!info) {
+			/* a failing loader may never reach the end of the store */
+			if (OSSL_STORE_error(store)) {
+				printf("Failed to load from store: %s\n", options->keyfile);
+				ERR_print_errors_fp(stdout);
+				break;
+			}
+			continue;
+		}
+		switch (OSSL_STORE_INFO_get_type(info)) {
+		case OSSL_STORE_INFO_PKEY:
+			if (!cparams->pkey)
+				cparams->pkey = OSSL_STORE_INFO_get1_PKEY(info);
+			break;
+		case OSSL_STORE_INFO_CERT:
+			if (!cparams->cert && !options->certfile)
+				cparams->cert = OSSL_STORE_INFO_get1_CERT(info);
+			break;
+		default:
+			break;
+		}
+		OSSL_STORE_INFO_free(info);
+	}
+	OSSL_STORE_close(store);
+	UI_destroy_method(ui_method);
+
+	if (!cparams->pkey) {
+		printf("Failed to load private key %s\n", options->keyfile);
+		goto out; /* FAILED */
+	}
+	if (!cparams->cert && !options->certfile) {
+		printf("Failed to load certificate %s\n", options->keyfile);
+		goto out; /* FAILED */
+	}
+	ret = 1; /* OK */
+out:
+	return ret;
+}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
 #ifndef OPENSSL_NO_ENGINE
 
 /* Load an engine in a shareable library */
@@ -5079,22 +6731,235 @@ static int read_token(GLOBAL_OPTIONS *options, ENGINE *engine, CRYPTO_PARAMS *cp
 	}
 
 	cparams->pkey = ENGINE_load_private_key(engine, options->keyfile, NULL, NULL);
-	/* Free the functional reference from ENGINE_init */
-	ENGINE_finish(engine);
 	if (!cparams->pkey) {
 		printf("Failed to load private key %s\n", options->keyfile);
+		/* Free the functional reference from ENGINE_init */
+		ENGINE_finish(engine);
 		return 0; /* FAILED */
 	}
+	/*
+	 * Keep the functional reference (and so the logged-in token session)
+	 * until free_crypto_params(), so that every signature created
+	 * in this process reuses the same session instead of opening a new one.
+	 */
+	cparams->engine = engine;
 	return 1; /* OK */
 }
 #endif /* OPENSSL_NO_ENGINE */
 
-static int read_crypto_params(GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+#ifdef PROVIDE_SIGNER_CMD
+/* Seconds to wait for each response of the external signer */
+#define SIGNER_TIMEOUT 120
+
+/*
+ * Start the external signer ("-signer-cmd" option) with its standard input
+ * and output connected to pipes. The same process serves every signature
+ * created in this run, one request line and one response line each:
+ *   request:  <digest name> <hex digest of the authenticated attributes>
+ *   response: <hex signature>
+ * Each request waits for its response before the next one is sent.
+ */
+static int signer_start(GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
 {
-	int ret = 0;
+	int req[2], resp[2];
+	pid_t pid;
 
-	/* Microsoft Private Key format support */
-	options->pvkfile = find_pvk_key(options);
+	if (pipe(req)) {
+		printf("Failed to create a pipe for the external signer\n");
+		return 0; /* FAILED */
+	}
+	if (pipe(resp)) {
+		printf("Failed to create a pipe for the external signer\n");
+		close(req[0]);
+		close(req[1]);
+		return 0; /* FAILED */
+	}
+	pid = fork();
+	if (pid < 0) {
+		printf("Failed to start the external signer: %s\n", options->signer_cmd);
+		close(req[0]);
+		close(req[1]);
+		close(resp[0]);
+		close(resp[1]);
+		return 0; /* FAILED */
+	}
+	if (pid == 0) {
+		/* child process */
+		dup2(req[0], STDIN_FILENO);
+		dup2(resp[1], STDOUT_FILENO);
+		close(req[0]);
+		close(req[1]);
+		close(resp[0]);
+		close(resp[1]);
+		execl("/bin/sh", "sh", "-c", options->signer_cmd, (char *)NULL);
+		_exit(127);
+	}
+	close(req[0]);
+	close(resp[1]);
+	cparams->signer_pid = pid;
+	cparams->signer_in = fdopen(req[1], "w");
+	cparams->signer_out = fdopen(resp[0], "r");
+	if (!cparams->signer_in || !cparams->signer_out) {
+		printf("Failed to connect to the external signer\n");
+		return 0; /* FAILED */
+	}
+	/* unbuffered, so that poll() sees every byte not read yet */
+	setvbuf(cparams->signer_out, NULL, _IONBF, 0);
+	return 1; /* OK */
+}
+
+static void signer_stop(CRYPTO_PARAMS *cparams)
+{
+	void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+	int i;
+
+	/* closing the request pipe tells the external signer to exit */
+	if (cparams->signer_in)
+		fclose(cparams->signer_in);
+	cparams->signer_in = NULL;
+	signal(SIGPIPE, sigpipe);
+	if (cparams->signer_out)
+		fclose(cparams->signer_out);
+	cparams->signer_out = NULL;
+	if (cparams->signer_pid > 0) {
+		/* a signer still running after SIGNER_TIMEOUT seconds is killed */
+		for (i = 0; i < SIGNER_TIMEOUT * 10 && !waitpid(cparams->signer_pid, NULL, WNOHANG); i++)
+			usleep(100000);
+		if (i == SIGNER_TIMEOUT * 10) {
+			kill(cparams->signer_pid, SIGKILL);
+			waitpid(cparams->signer_pid, NULL, 0);
+		}
+	}
+	cparams->signer_pid = 0;
+}
+
+/* Report how the external signer process has ended */
+static void signer_exited(CRYPTO_PARAMS *cparams)
+{
+	int status;
+
+	if (cparams->signer_pid <= 0 || waitpid(cparams->signer_pid, &status, 0) != cparams->signer_pid)
+		return;
+	cparams->signer_pid = 0;
+	if (WIFEXITED(status))
+		printf("The external signer exited with status %d\n", WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		printf("The external signer was terminated by signal %d\n", WTERMSIG(status));
+}
+
+/*
+ * Read a response line of the external signer without its line end,
+ * a signer not responding within SIGNER_TIMEOUT seconds is killed.
+ */
+static int signer_read_line(CRYPTO_PARAMS *cparams, char *line, size_t len)
+{
+	struct pollfd pfd;
+	size_t n = 0;
+	int c, ret;
+
+	pfd.fd = fileno(cparams->signer_out);
+	pfd.events = POLLIN;
+	while (n + 1 < len) {
+		do {
+			ret = poll(&pfd, 1, SIGNER_TIMEOUT * 1000);
+		} while (ret < 0 && errno == EINTR);
+		if (ret <= 0) {
+			printf("No response from the external signer within %d seconds\n", SIGNER_TIMEOUT);
+			kill(cparams->signer_pid, SIGKILL);
+			signer_exited(cparams);
+			return 0; /* FAILED */
+		}
+		c = fgetc(cparams->signer_out);
+		if (c == EOF) {
+			printf("No response from the external signer: end of its output\n");
+			signer_exited(cparams);
+			return 0; /* FAILED */
+		}
+		if (c == '\n')
+			break;
+		line[n++] = (char)c;
+	}
+	line[n] = '\0';
+	return 1; /* OK */
+}
+
+/*
+ * Complete the signer info with the signature computed by the external signer.
+ * PKCS7_dataFinal() has skipped it, so add the messageDigest and signingTime
+ * authenticated attributes here the same way it would do,
+ * and send the digest of their DER encoding to be signed.
+ */
+static int signer_sign(PKCS7 *sig, CRYPTO_PARAMS *cparams)
+{
+	PKCS7_SIGNER_INFO *si;
+	ASN1_STRING *content;
+	const EVP_MD *md;
+	unsigned char mdbuf[EVP_MAX_MD_SIZE], *abuf = NULL, *sigbuf;
+	char hexbuf[2*EVP_MAX_MD_SIZE+1], line[16384];
+	unsigned int mdlen;
+	size_t seqhdrlen;
+	long siglen;
+	int alen, ok;
+	void (*sigpipe)(int);
+
+	si = sk_PKCS7_SIGNER_INFO_value(PKCS7_get_signer_info(sig), 0);
+	if (!si)
+		return 0; /* FAILED */
+	md = digest_by_nid(OBJ_obj2nid(si->digest_alg->algorithm));
+	if (!md)
+		return 0; /* FAILED */
+
+	/* the message digest of the signed content without its SEQUENCE header */
+	content = sig->d.sign->contents->d.other->value.sequence;
+	seqhdrlen = asn1_simple_hdr_len(content->data, (size_t)content->length);
+	if (!EVP_Digest(content->data + seqhdrlen, (size_t)content->length - seqhdrlen,
+			mdbuf, &mdlen, md, NULL)
+			|| !PKCS7_add1_attrib_digest(si, mdbuf, (int)mdlen))
+		return 0; /* FAILED */
+	if (!PKCS7_get_signed_attribute(si, NID_pkcs9_signingTime)
+			&& !PKCS7_add0_attrib_signing_time(si, NULL))
+		return 0; /* FAILED */
+
+	alen = ASN1_item_i2d((ASN1_VALUE *)si->auth_attr, &abuf, ASN1_ITEM_rptr(PKCS7_ATTR_SIGN));
+	if (alen <= 0)
+		return 0; /* FAILED */
+	if (!EVP_Digest(abuf, (size_t)alen, mdbuf, &mdlen, md, NULL)) {
+		OPENSSL_free(abuf);
+		return 0; /* FAILED */
+	}
+	OPENSSL_free(abuf);
+	tohex(mdbuf, hexbuf, (int)mdlen);
+
+	/* report a failed write instead of being killed by SIGPIPE */
+	sigpipe = signal(SIGPIPE, SIG_IGN);
+	ok = fprintf(cparams->signer_in, "%s %s\n", OBJ_nid2ln(EVP_MD_type(md)), hexbuf) >= 0
+		&& !fflush(cparams->signer_in);
+	signal(SIGPIPE, sigpipe);
+	if (!ok) {
+		printf("Failed to send the digest to the external signer\n");
+		signer_exited(cparams);
+		return 0; /* FAILED */
+	}
+	if (!signer_read_line(cparams, line, sizeof line))
+		return 0; /* FAILED */
+	line[strcspn(line, "\r")] = '\0';
+	sigbuf = OPENSSL_hexstr2buf(line, &siglen);
+	if (!sigbuf || siglen <= 0) {
+		printf("Invalid response from the external signer: %s\n", line);
+		OPENSSL_free(sigbuf);
+		return 0; /* FAILED */
+	}
+	ASN1_STRING_set0(si->enc_digest, sigbuf, (int)siglen);
+	return 1; /* OK */
+}
+#endif /* PROVIDE_SIGNER_CMD */
+
+static int read_crypto_params(GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	int ret = 0;
+
+	/* Microsoft Private Key format support */
+	options->pvkfile = find_pvk_key(options);
 	if (options->pvkfile) {
 		if (!read_certfile(options, cparams) || !read_pvk_key(options, cparams))
 			goto out; /* FAILED */
@@ -5104,6 +6969,33 @@ static int read_crypto_params(GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
 		if (!read_pkcs12file(options, cparams))
 			goto out; /* FAILED */
 
+#ifdef PROVIDE_SIGNER_CMD
+	/* External signer support ("-signer-cmd" option) */
+	} else if (options->signer_cmd) {
+		if (!read_certfile(options, cparams))
+			goto out; /* FAILED */
+		/* the signer's certificate comes first in the certificate file */
+		cparams->cert = sk_X509_shift(cparams->certs);
+		if (!cparams->cert) {
+			printf("No certificate found\n");
+			goto out; /* FAILED */
+		}
+		if (!signer_start(options, cparams))
+			goto out; /* FAILED */
+#endif /* PROVIDE_SIGNER_CMD */
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	/* OSSL_STORE URI support ("-provider" option or "pkcs11:" URI) */
+	} else if (options->provider || is_pkcs11_uri(options->keyfile)) {
+		/* Load the private key and optionally the signer certificate */
+		if (!read_store_key(options, cparams))
+			goto out; /* FAILED */
+
+		/* Load the whole certificate chain from a file */
+		if (options->certfile && !read_certfile(options, cparams))
+			goto out; /* FAILED */
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
 #ifndef OPENSSL_NO_ENGINE
 	/* PKCS11 engine and module support */
 	} else if ((options->p11engine) || (options->p11module)) {
@@ -5123,11 +7015,11 @@ static int read_crypto_params(GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
 		/* Load the signer certificate and the whole certificate chain from a file */
 		if (options->certfile && !read_certfile(options, cparams))
 			goto out; /* FAILED */
+#endif /* OPENSSL_NO_ENGINE */
 
 	/* PEM / DER / SPC file format support */
 	} else if (!read_certfile(options, cparams) || !read_keyfile(options, cparams))
 		goto out; /* FAILED */
-#endif /* OPENSSL_NO_ENGINE */
 
 	/* Load additional (cross) certificates ("-ac" option) */
 	if (options->xcertfile && !read_xcertfile(options, cparams))
@@ -5140,107 +7032,1431 @@ out:
 		memset(options->pass, 0, strlen(options->pass));
 		OPENSSL_free(options->pass);
 	}
-	return ret; /* OK */
-}
-
-static void free_msi_params(MSI_PARAMS *msiparams)
-{
-	msi_file_free(msiparams->msi);
-	msi_dirent_free(msiparams->dirent);
+	return ret; /* OK */
+}
+
+static void free_msi_params(MSI_PARAMS *msiparams)
+{
+	msi_file_free(msiparams->msi);
+	msi_dirent_free(msiparams->dirent);
+}
+
+static void free_crypto_params(CRYPTO_PARAMS *cparams)
+{
+	/* If key is NULL nothing is done */
+	EVP_PKEY_free(cparams->pkey);
+	cparams->pkey = NULL;
+	/* If X509 structure is NULL nothing is done */
+	X509_free(cparams->cert);
+	cparams->cert = NULL;
+	/* Free up all elements of sk structure and sk itself */
+	sk_X509_pop_free(cparams->certs, X509_free);
+	cparams->certs = NULL;
+	sk_X509_pop_free(cparams->xcerts, X509_free);
+	cparams->xcerts = NULL;
+	sk_X509_CRL_pop_free(cparams->crls, X509_CRL_free);
+	cparams->crls = NULL;
+#ifndef OPENSSL_NO_ENGINE
+	/* Free the functional reference from ENGINE_init */
+	if (cparams->engine)
+		ENGINE_finish(cparams->engine);
+	cparams->engine = NULL;
+#endif /* OPENSSL_NO_ENGINE */
+#ifdef PROVIDE_SIGNER_CMD
+	signer_stop(cparams);
+#endif /* PROVIDE_SIGNER_CMD */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	/* Unload the provider after all its objects have been freed */
+	if (cparams->provider)
+		OSSL_PROVIDER_unload(cparams->provider);
+	cparams->provider = NULL;
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+}
+
+static void free_options(GLOBAL_OPTIONS *options)
+{
+	/* If memory has not been allocated nothing is done */
+	OPENSSL_free(options->cafile);
+	OPENSSL_free(options->tsa_cafile);
+	OPENSSL_free(options->crlfile);
+	OPENSSL_free(options->tsa_crlfile);
+	OPENSSL_free(options->sigcache_file);
+}
+
+static char *get_cafile(void)
+{
+	const char *sslpart1, *sslpart2;
+	char *cafile, *openssl_dir, *str_begin, *str_end;
+
+#ifdef CA_BUNDLE_PATH
+	if (strcmp(CA_BUNDLE_PATH, ""))
+		return OPENSSL_strdup(CA_BUNDLE_PATH);
+#endif
+	sslpart1 = OpenSSL_version(OPENSSL_DIR);
+	sslpart2 = "/certs/ca-bundle.crt";
+	str_begin = strchr(sslpart1, '"');
+	str_end = strrchr(sslpart1, '"');
+	if (str_begin && str_end && str_begin < str_end) {
+		openssl_dir = OPENSSL_strndup(str_begin + 1, str_end - str_begin - 1);
+	} else {
+		openssl_dir = OPENSSL_strdup("/etc");
+	}
+	cafile = OPENSSL_malloc(strlen(sslpart1) + strlen(sslpart2) + 1);
+	strcpy(cafile, openssl_dir);
+	strcat(cafile, sslpart2);
+
+	OPENSSL_free(openssl_dir);
+	return cafile;
+}
+
+/*
+ * Parse the inclusive byte range "first-last" of the "-range" option,
+ * a missing last byte means the end of the file.
+ */
+static int parse_range(const char *str, uint32_t *first, uint32_t *last)
+{
+	char *end;
+	unsigned long long val;
+
+	if (!isdigit((int)*str))
+		return 0; /* FAILED */
+	val = strtoull(str, &end, 0);
+	if (*end != '-' || val > UINT32_MAX)
+		return 0; /* FAILED */
+	*first = (uint32_t)val;
+	str = end + 1;
+	if (*str == '\0') {
+		*last = UINT32_MAX;
+		return 1; /* OK */
+	}
+	if (!isdigit((int)*str))
+		return 0; /* FAILED */
+	val = strtoull(str, &end, 0);
+	if (*end != '\0' || val > UINT32_MAX || val < *first)
+		return 0; /* FAILED */
+	*last = (uint32_t)val;
+	return 1; /* OK */
+}
+
+static PKCS7 *get_sigfile(char *sigfile, file_type_t type)
+{
+	PKCS7 *sig = NULL;
+	size_t sigfilesize;
+	char *insigdata;
+	FILE_HEADER header;
+	BIO *sigbio;
+	const char pemhdr[] = "-----BEGIN PKCS7-----";
+
+	sigfilesize = get_file_size(sigfile);
+	if (!sigfilesize) {
+		return NULL; /* FAILED */
+	}
+	insigdata = map_file(sigfile, sigfilesize);
+	if (!insigdata) {
+		printf("Failed to open file: %s\n", sigfile);
+		return NULL; /* FAILED */
+	}
+	if (sigfilesize >= sizeof pemhdr && !memcmp(insigdata, pemhdr, sizeof pemhdr - 1)) {
+		sigbio = BIO_new_mem_buf(insigdata, sigfilesize);
+		sig = PEM_read_bio_PKCS7(sigbio, NULL, NULL, NULL);
+		BIO_free_all(sigbio);
+	} else {
+		/* reset header */
+		memset(&header, 0, sizeof(FILE_HEADER));
+		header.siglen = sigfilesize;
+		header.sigpos = 0;
+		/* a DER signature extracted from a PE file starts with a WIN_CERTIFICATE header */
+		if (type == FILE_TYPE_PE || (sigfilesize > 8 &&
+				GET_UINT16_LE(insigdata + 4) == WIN_CERT_REVISION_2 &&
+				GET_UINT16_LE(insigdata + 6) == WIN_CERT_TYPE_PKCS_SIGNED_DATA))
+			sig = pe_extract_existing_pkcs7(insigdata, &header);
+		else
+			sig = extract_existing_pkcs7(insigdata, &header);
+	}
+	return sig; /* OK */
+}
+
+/*
+ * Read the page hash table given with the "-pagehash" option,
+ * in the format stored in the SpcPeImageData (4-byte page offsets and page digests).
+ */
+static u_char *get_pagehash_file(char *pagehashfile, size_t *phlen)
+{
+	size_t filesize;
+	char *indata;
+	u_char *ph;
+
+	filesize = get_file_size(pagehashfile);
+	if (!filesize)
+		return NULL; /* FAILED */
+	indata = map_file(pagehashfile, filesize);
+	if (!indata) {
+		printf("Failed to open file: %s\n", pagehashfile);
+		return NULL; /* FAILED */
+	}
+	ph = OPENSSL_malloc(filesize);
+	if (ph) {
+		memcpy(ph, indata, filesize);
+		*phlen = filesize;
+	}
+#ifdef WIN32
+	UnmapViewOfFile(indata);
+#else
+	munmap(indata, filesize);
+#endif
+	return ph; /* OK */
+}
+
+/*
+ * Verify a detached signature against a precomputed file digest ("verify-digest" command),
+ * e.g. recorded at build time, so the signed file itself is not needed.
+ * The signatures using the algorithm of the "-digest" option are verified.
+ */
+static int verify_digest_file(GLOBAL_OPTIONS *options)
+{
+	int i, ret = 1, checked = 0, failed = 0;
+	long mdlen = 0;
+	unsigned char *mdbuf = NULL, *ph = NULL;
+	size_t phlen = 0;
+	char hexbuf[EVP_MAX_MD_SIZE*2+1];
+	char *mdid, *hash;
+	const EVP_MD *md;
+	PKCS7 *p7;
+	STACK_OF(SIGNATURE) *signatures = sk_SIGNATURE_new_null();
+
+	/* decode the provided digest */
+	mdid = OPENSSL_strdup(options->digest);
+	hash = strchr(mdid, ':');
+	if (hash == NULL) {
+		printf("Unable to parse -digest parameter: %s\n", options->digest);
+		goto out;
+	}
+	*hash++ = '\0';
+	md = digest_by_name(mdid);
+	if (md == NULL) {
+		printf("Unable to lookup digest by name '%s'\n", mdid);
+		goto out;
+	}
+	mdbuf = OPENSSL_hexstr2buf(hash, &mdlen);
+	if (mdlen != EVP_MD_size(md)) {
+		printf("Hash length mismatch: '%s' digest must be %d bytes long (got %ld bytes)\n",
+			mdid, EVP_MD_size(md), mdlen);
+		goto out;
+	}
+	if (options->pagehashfile) {
+		ph = get_pagehash_file(options->pagehashfile, &phlen);
+		if (!ph)
+			goto out;
+	}
+	/* a PE signature is recognized by its WIN_CERTIFICATE header */
+	p7 = get_sigfile(options->sigfile, FILE_TYPE_CAB);
+	if (!p7) {
+		printf("Unable to extract valid signature\n");
+		goto out;
+	}
+	if (!append_signature_list(&signatures, p7, 1)) {
+		printf("Failed to create signature list\n\n");
+		PKCS7_free(p7);
+		goto out;
+	}
+	for (i = 0; i < sk_SIGNATURE_num(signatures); i++) {
+		SIGNATURE *signature = sk_SIGNATURE_value(signatures, i);
+		int mdtype = -1, phtype = -1, mdok = 0;
+		unsigned char *sph = NULL;
+		size_t sphlen = 0;
+		PHASE phase;
+
+		printf("Signature Index: %d %s\n", i, i==0 ? " (Primary Signature)" : "");
+		if (is_content_type(signature->p7, SPC_INDIRECT_DATA_OBJID)) {
+			ASN1_STRING *content_val = signature->p7->d.sign->contents->d.other->value.sequence;
+			const unsigned char *p = content_val->data;
+			SpcIndirectDataContent *idc = d2i_SpcIndirectDataContent(NULL, &p, content_val->length);
+			if (idc) {
+				pe_extract_page_hash(idc->data, &sph, &sphlen, &phtype);
+				if (idc->messageDigest && idc->messageDigest->digest && idc->messageDigest->digestAlgorithm
+						&& idc->messageDigest->digest->length == mdlen) {
+					mdtype = OBJ_obj2nid(idc->messageDigest->digestAlgorithm->algorithm);
+					tohex(idc->messageDigest->digest->data, hexbuf, (int)mdlen);
+					mdok = !memcmp(idc->messageDigest->digest->data, mdbuf, (size_t)mdlen);
+				}
+				SpcIndirectDataContent_free(idc);
+			}
+		}
+		if (mdtype != EVP_MD_type(md)) {
+			printf("Message digest algorithm  : not %s, skipped\n\n", OBJ_nid2sn(EVP_MD_type(md)));
+			OPENSSL_free(sph);
+			continue;
+		}
+		checked++;
+		printf("Message digest algorithm  : %s\n", OBJ_nid2sn(mdtype));
+		printf("Current message digest    : %s\n", hexbuf);
+		tohex(mdbuf, hexbuf, (int)mdlen);
+		printf("Provided message digest   : %s%s\n", hexbuf, mdok ? "" : "    MISMATCH!!!");
+		if (mdok && ph) {
+			mdok = sphlen == phlen && !memcmp(sph, ph, phlen);
+			tohex(ph, hexbuf, (phlen < 32) ? (int)phlen : 32);
+			printf("Provided page hash        : %s ...%s\n", hexbuf, mdok ? "" : "    MISMATCH!!!");
+		} else if (!ph && sphlen > 0) {
+			printf("Page hashes are not verified without the \"-pagehash\" option\n");
+		}
+		printf("\n");
+		OPENSSL_free(sph);
+		if (!mdok) {
+			printf("Signature verification: failed\n\n");
+			failed++;
+			continue;
+		}
+		phase_begin(&phase, PHASE_VERIFY);
+		if (verify_signature(signature, options))
+			failed++;
+		phase_end(&phase, 0);
+	}
+	printf("Number of verified signatures: %d\n", checked);
+	if (checked == 0)
+		printf("No signature with the %s message digest found\n", OBJ_nid2sn(EVP_MD_type(md)));
+	else if (!failed)
+		ret = 0; /* OK */
+out:
+	OPENSSL_free(mdid);
+	OPENSSL_free(mdbuf);
+	OPENSSL_free(ph);
+	sk_SIGNATURE_pop_free(signatures, signature_free);
+	return ret;
+}
+
+/*
+ * Signer inventory ("inventory" command)
+ * The index file lists the certificates of all signatures of the scanned files
+ * (including nested signatures and timestamps), one line per certificate:
+ *   <SHA-1 thumbprint> <serial> <role> <signing time> <timestamp time> <mtime> <size> <path>
+ * The role is "signer", "intermediate", "tsa", "tsa-intermediate" or "other",
+ * the times are POSIX times or "-".  A file without any signature has a single
+ * line with "-" certificate fields, so it is not scanned again.
+ * The lines are sorted, so a thumbprint query is a binary search over
+ * the mapped index, a serial query reads the whole index.
+ * Only the file headers and the signatures are read, and a rescan only reads
+ * the files with a changed modification time or size, the lines of the other
+ * files are copied from the previous index.  A rescan of a subdirectory keeps
+ * the lines of the files outside it and drops the missing files within it.
+ */
+#define INVENTORY_HEADER "# osslsigncode inventory v1"
+#define INVENTORY_LINE_MAX 8192
+
+typedef struct {
+	char *indexfile;
+	STACK_OF(OPENSSL_STRING) *old; /* the previous index sorted by path */
+	STACK_OF(OPENSSL_STRING) *lines;
+	int verbose;
+	int scanned;
+	int reused;
+	int signedfiles;
+	int failed;
+	int entries;
+} INVENTORY;
+
+/* The uppercase hex digits of a thumbprint or serial, e.g. given as "AB:CD:..." or "ab cd ..." */
+static char *hex_normalize(const char *str)
+{
+	char *hex = OPENSSL_strdup(str);
+	size_t i, len = 0;
+
+	for (i = 0; str[i]; i++)
+		if (isxdigit((unsigned char)str[i]))
+			hex[len++] = (char)toupper((unsigned char)str[i]);
+	hex[len] = '\0';
+	return hex;
+}
+
+/* The certificate of the signer, NULL if not included in the signature */
+static X509 *pkcs7_signer_cert(PKCS7 *p7)
+{
+	PKCS7_SIGNER_INFO *si = sk_PKCS7_SIGNER_INFO_value(p7->d.sign->signer_info, 0);
+
+	if (!si)
+		return NULL;
+	return X509_find_by_issuer_and_serial(p7->d.sign->cert, si->issuer_and_serial->issuer,
+		si->issuer_and_serial->serial);
+}
+
+/* The path field of an index line, NULL for a malformed line */
+static const char *inventory_path(const char *line)
+{
+	int i;
+
+	for (i = 0; i < 7 && line; i++) {
+		line = strchr(line, ' ');
+		if (line)
+			line++;
+	}
+	return line;
+}
+
+static int inventory_path_cmp(const char *const *a, const char *const *b)
+{
+	return strcmp(inventory_path(*a), inventory_path(*b));
+}
+
+static int inventory_line_cmp(const char *const *a, const char *const *b)
+{
+	return strcmp(*a, *b);
+}
+
+static void inventory_line_free(char *line)
+{
+	OPENSSL_free(line);
+}
+
+static void inventory_time(char *buf, size_t len, time_t time)
+{
+	if (time == INVALID_TIME)
+		snprintf(buf, len, "-");
+	else
+		snprintf(buf, len, "%lld", (long long)time);
+}
+
+static void inventory_push(INVENTORY *inv, const char *thumbprint, const char *serial,
+	const char *role, const char *signtime, const char *tstime,
+	long long mtime, long long size, const char *path)
+{
+	size_t len = strlen(thumbprint) + strlen(serial) + strlen(role) + strlen(signtime)
+		+ strlen(tstime) + strlen(path) + 2 * 24 + 8;
+	char *line = OPENSSL_malloc(len);
+
+	snprintf(line, len, "%s %s %s %s %s %lld %lld %s", thumbprint, serial, role,
+		signtime, tstime, mtime, size, path);
+	sk_OPENSSL_STRING_push(inv->lines, line);
+}
+
+/* Return 1 if cert is an issuer in the chain of leaf built from certs */
+static int inventory_in_chain(STACK_OF(X509) *certs, X509 *leaf, X509 *cert)
+{
+	int i, depth;
+
+	for (depth = 0; leaf && depth < sk_X509_num(certs); depth++) {
+		X509 *issuer = NULL;
+
+		if (X509_check_issued(leaf, leaf) == X509_V_OK)
+			return 0; /* self-signed */
+		for (i = 0; i < sk_X509_num(certs); i++) {
+			if (X509_check_issued(sk_X509_value(certs, i), leaf) == X509_V_OK) {
+				issuer = sk_X509_value(certs, i);
+				break;
+			}
+		}
+		if (issuer && !X509_cmp(issuer, cert))
+			return 1;
+		leaf = issuer;
+	}
+	return 0;
+}
+
+/*
+ * Add the certificates of the signature and its timestamp,
+ * the Authenticode timestamp shares the certificates of the signature
+ */
+static int inventory_signature(INVENTORY *inv, SIGNATURE *signature, char *path,
+	long long mtime, long long size)
+{
+	STACK_OF(X509) *certs = signature->p7->d.sign->cert ?
+		sk_X509_dup(signature->p7->d.sign->cert) : sk_X509_new_null();
+	STACK_OF(X509) *tscerts = NULL;
+	X509 *signer = pkcs7_signer_cert(signature->p7), *tsa = NULL;
+	unsigned char mdbuf[SHA_DIGEST_LENGTH];
+	char thumbprint[SHA_DIGEST_LENGTH*2+1], signtime[32], tstime[32];
+	int i, j, n = 0;
+
+	if (!certs)
+		return 0;
+	if (signature->timestamp) {
+		CMS_SignerInfo *cmssi = sk_CMS_SignerInfo_value(CMS_get0_SignerInfos(signature->timestamp), 0);
+		tscerts = CMS_get1_certs(signature->timestamp);
+		for (i = 0; i < sk_X509_num(tscerts); i++) {
+			X509 *cert = sk_X509_value(tscerts, i);
+			for (j = 0; j < sk_X509_num(certs) && X509_cmp(sk_X509_value(certs, j), cert); j++)
+				continue;
+			if (j == sk_X509_num(certs))
+				sk_X509_push(certs, cert);
+			if (cmssi && !CMS_SignerInfo_cert_cmp(cmssi, cert))
+				tsa = cert;
+		}
+	}
+	inventory_time(signtime, sizeof signtime, signature->signtime);
+	inventory_time(tstime, sizeof tstime, signature->timestamp ? signature->time : INVALID_TIME);
+	for (i = 0; i < sk_X509_num(certs); i++) {
+		X509 *cert = sk_X509_value(certs, i);
+		BIGNUM *serialbn = ASN1_INTEGER_to_BN(X509_get0_serialNumber(cert), NULL);
+		char *serial = serialbn ? BN_bn2hex(serialbn) : NULL;
+		const char *role;
+
+		if (signer && !X509_cmp(cert, signer))
+			role = "signer";
+		else if (tsa && !X509_cmp(cert, tsa))
+			role = "tsa";
+		else if (inventory_in_chain(certs, signer, cert))
+			role = "intermediate";
+		else if (inventory_in_chain(certs, tsa, cert))
+			role = "tsa-intermediate";
+		else
+			role = "other";
+		if (serial && X509_digest(cert, digest_by_nid(NID_sha1), mdbuf, NULL)) {
+			tohex(mdbuf, thumbprint, SHA_DIGEST_LENGTH);
+			inventory_push(inv, thumbprint, serial, role, signtime, tstime, mtime, size, path);
+			n++;
+		}
+		OPENSSL_free(serial);
+		BN_free(serialbn);
+	}
+	sk_X509_free(certs);
+	sk_X509_pop_free(tscerts, X509_free);
+	return n;
+}
+
+/*
+ * The existing signature of the input file with its headers already verified,
+ * NULL for a file without any signature
+ */
+static PKCS7 *get_existing_pkcs7(file_type_t type, char *indata, FILE_HEADER *header,
+	MSI_PARAMS *msiparams)
+{
+	PKCS7 *p7 = NULL;
+
+	if (type == FILE_TYPE_PE) {
+		if (header->sigpos != 0)
+			p7 = pe_extract_existing_pkcs7(indata, header);
+	} else if (type == FILE_TYPE_CAB) {
+		if (header->header_size == 20)
+			p7 = extract_existing_pkcs7(indata, header);
+	} else if (type == FILE_TYPE_MSI) {
+		MSI_ENTRY *ds = msi_signatures_get(msiparams->dirent, NULL);
+		if (ds) {
+			uint32_t len = GET_UINT32_LE(ds->size);
+			char *data = OPENSSL_malloc(len);
+			p7 = msi_extract_existing_pkcs7(msiparams, ds, &data, len);
+			OPENSSL_free(data);
+		}
+	} else if (type == FILE_TYPE_CAT) {
+		/* the signature position of an unsigned catalog file is its end */
+		if (header->sigpos != header->fileend)
+			p7 = cat_extract_existing_pkcs7(indata, header);
+	}
+	return p7;
+}
+
+/* Only the headers and the signature of the mapped file are read */
+static PKCS7 *inventory_extract_pkcs7(file_type_t type, char *indata, char *path, size_t size,
+	FILE_HEADER *header, MSI_PARAMS *msiparams)
+{
+	int ok = 0;
+
+	if (type == FILE_TYPE_PE)
+		ok = pe_verify_header(indata, path, size, header);
+	else if (type == FILE_TYPE_CAB)
+		ok = cab_verify_header(indata, path, size, header);
+	else if (type == FILE_TYPE_MSI)
+		ok = msi_verify_header(indata, path, size, msiparams);
+	else if (type == FILE_TYPE_CAT)
+		ok = cat_verify_header(indata, size, header);
+	return ok ? get_existing_pkcs7(type, indata, header, msiparams) : NULL;
+}
+
+static void inventory_scan_file(INVENTORY *inv, char *path, long long mtime, long long size)
+{
+	FILE_HEADER header;
+	MSI_PARAMS msiparams;
+	file_type_t type;
+	PKCS7 *p7 = NULL;
+	char *indata = NULL;
+	int i, n = 0;
+	STACK_OF(SIGNATURE) *signatures = sk_SIGNATURE_new_null();
+
+	memset(&header, 0, sizeof(FILE_HEADER));
+	header.fileend = (size_t)size;
+	memset(&msiparams, 0, sizeof(MSI_PARAMS));
+	if (size >= 4)
+		indata = map_file(path, (off_t)size);
+	/* unrecognized files are recorded without any message */
+	if (indata && get_file_type(indata, NULL, &type))
+		p7 = inventory_extract_pkcs7(type, indata, path, (size_t)size, &header, &msiparams);
+	if (p7 && !append_signature_list(&signatures, p7, 1))
+		PKCS7_free(p7);
+	for (i = 0; i < sk_SIGNATURE_num(signatures); i++)
+		n += inventory_signature(inv, sk_SIGNATURE_value(signatures, i), path, mtime, size);
+	if (n > 0)
+		inv->signedfiles++;
+	else
+		inventory_push(inv, "-", "-", "-", "-", "-", mtime, size, path);
+	if (inv->verbose)
+		printf("Scanned: %s (%d certificate(s))\n", path, n);
+	inv->scanned++;
+	sk_SIGNATURE_pop_free(signatures, signature_free);
+	free_msi_params(&msiparams);
+	if (indata) {
+#ifdef WIN32
+		UnmapViewOfFile(indata);
+#else
+		munmap(indata, (size_t)size);
+#endif
+	}
+	/* corrupt files are recorded as not signed */
+	ERR_clear_error();
+}
+
+/* Copy the lines of an unchanged file from the previous index */
+static int inventory_reuse(INVENTORY *inv, const char *path, long long mtime, long long size)
+{
+	long long oldmtime, oldsize;
+	char *key, *line;
+	size_t len;
+	int i;
+
+	if (!inv->old)
+		return 0; /* not indexed */
+	/* a line without the certificate fields as the search key */
+	len = strlen(path) + 16;
+	key = OPENSSL_malloc(len);
+	snprintf(key, len, "- - - - - 0 0 %s", path);
+	i = sk_OPENSSL_STRING_find(inv->old, key);
+	OPENSSL_free(key);
+	if (i < 0)
+		return 0; /* not indexed */
+	line = sk_OPENSSL_STRING_value(inv->old, i);
+	if (sscanf(line, "%*s %*s %*s %*s %*s %lld %lld", &oldmtime, &oldsize) != 2
+			|| oldmtime != mtime || oldsize != size)
+		return 0; /* changed */
+	/* a file without any signature has a single line with the "-" thumbprint */
+	if (line[0] != '-')
+		inv->signedfiles++;
+	for (; i < sk_OPENSSL_STRING_num(inv->old); i++) {
+		line = sk_OPENSSL_STRING_value(inv->old, i);
+		if (strcmp(inventory_path(line), path))
+			break;
+		sk_OPENSSL_STRING_push(inv->lines, OPENSSL_strdup(line));
+	}
+	inv->reused++;
+	return 1; /* OK */
+}
+
+/* Return 1 if the path is the walked root or a file within it */
+static int inventory_in_root(const char *path, const char *root)
+{
+	size_t len = strlen(root);
+
+	if (len == 0 || strncmp(path, root, len))
+		return 0;
+	return path[len] == '\0' || path[len] == '/' || root[len - 1] == '/';
+}
+
+/* Copy the lines of the files outside the walked root from the previous index */
+static void inventory_keep(INVENTORY *inv, const char *root)
+{
+	int i;
+
+	for (i = 0; inv->old && i < sk_OPENSSL_STRING_num(inv->old); i++) {
+		char *line = sk_OPENSSL_STRING_value(inv->old, i);
+		if (!inventory_in_root(inventory_path(line), root))
+			sk_OPENSSL_STRING_push(inv->lines, OPENSSL_strdup(line));
+	}
+}
+
+static void inventory_walk(INVENTORY *inv, char *path, int follow);
+
+static void inventory_dir(INVENTORY *inv, char *path)
+{
+	char *child;
+	size_t len;
+	const char *sep = path[strlen(path) - 1] == '/' ? "" : "/";
+#ifdef WIN32
+	WIN32_FIND_DATA fd;
+	HANDLE h;
+	char *pattern;
+
+	len = strlen(path) + 3;
+	pattern = OPENSSL_malloc(len);
+	snprintf(pattern, len, "%s%s*", path, sep);
+	h = FindFirstFile(pattern, &fd);
+	OPENSSL_free(pattern);
+	if (h == INVALID_HANDLE_VALUE) {
+		printf("Failed to open directory: %s\n", path);
+		inv->failed++;
+		return;
+	}
+	do {
+		const char *name = fd.cFileName;
+#else /* WIN32 */
+	DIR *dir = opendir(path);
+	struct dirent *de;
+
+	if (!dir) {
+		printf("Failed to open directory: %s\n", path);
+		inv->failed++;
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		const char *name = de->d_name;
+#endif /* WIN32 */
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+		len = strlen(path) + strlen(name) + 2;
+		child = OPENSSL_malloc(len);
+		snprintf(child, len, "%s%s%s", path, sep, name);
+		inventory_walk(inv, child, 0);
+		OPENSSL_free(child);
+#ifdef WIN32
+	} while (FindNextFile(h, &fd));
+	FindClose(h);
+#else /* WIN32 */
+	}
+	closedir(dir);
+#endif /* WIN32 */
+}
+
+/* The symbolic links within the scanned directories are not followed */
+static void inventory_walk(INVENTORY *inv, char *path, int follow)
+{
+	int ret;
+#ifdef _WIN32
+	struct _stat st;
+	ret = _stat(path, &st);
+	(void)follow;
+#else
+	struct stat st;
+	ret = follow ? stat(path, &st) : lstat(path, &st);
+#endif
+	if (ret) {
+		printf("Failed to open file: %s\n", path);
+		inv->failed++;
+		return;
+	}
+	if ((st.st_mode & S_IFMT) == S_IFDIR) {
+		inventory_dir(inv, path);
+	} else if ((st.st_mode & S_IFMT) == S_IFREG) {
+		if (strchr(path, '\n')) {
+			printf("Warning: Skipped a file name with a new line character: %s\n", path);
+		} else if (!strcmp(path, inv->indexfile)) {
+			return; /* the index itself */
+		} else if (!inventory_reuse(inv, path, (long long)st.st_mtime, (long long)st.st_size)) {
+			inventory_scan_file(inv, path, (long long)st.st_mtime, (long long)st.st_size);
+		}
+	}
+}
+
+/* Read the previous index, a missing index is not an error */
+static STACK_OF(OPENSSL_STRING) *inventory_read(const char *indexfile)
+{
+	STACK_OF(OPENSSL_STRING) *lines;
+	char buf[INVENTORY_LINE_MAX];
+	FILE *f = fopen(indexfile, "r");
+
+	if (!f)
+		return NULL;
+	if (!fgets(buf, sizeof buf, f) || strncmp(buf, INVENTORY_HEADER "\n", sizeof INVENTORY_HEADER)) {
+		printf("Warning: Unknown index file format, all files are scanned: %s\n", indexfile);
+		fclose(f);
+		return NULL;
+	}
+	lines = sk_OPENSSL_STRING_new(inventory_path_cmp);
+	while (fgets(buf, sizeof buf, f)) {
+		size_t len = strlen(buf);
+		if (len == 0 || buf[len - 1] != '\n')
+			break; /* truncated */
+		buf[len - 1] = '\0';
+		if (inventory_path(buf))
+			sk_OPENSSL_STRING_push(lines, OPENSSL_strdup(buf));
+	}
+	fclose(f);
+	sk_OPENSSL_STRING_sort(lines);
+	return lines;
+}
+
+static int inventory_write(INVENTORY *inv)
+{
+	char *tmpfile, *prev = NULL;
+	size_t len;
+	FILE *f;
+	int i, ok;
+
+	len = strlen(inv->indexfile) + 32;
+	tmpfile = OPENSSL_malloc(len);
+	snprintf(tmpfile, len, "%s.%ld.tmp", inv->indexfile, (long)getpid());
+	f = fopen(tmpfile, "w");
+	ok = f && fprintf(f, "%s\n", INVENTORY_HEADER) > 0;
+	sk_OPENSSL_STRING_set_cmp_func(inv->lines, inventory_line_cmp);
+	sk_OPENSSL_STRING_sort(inv->lines);
+	for (i = 0; ok && i < sk_OPENSSL_STRING_num(inv->lines); i++) {
+		char *line = sk_OPENSSL_STRING_value(inv->lines, i);
+		/* the same certificate in nested signatures */
+		if (prev && !strcmp(prev, line))
+			continue;
+		ok = fprintf(f, "%s\n", line) > 0;
+		prev = line;
+		inv->entries++;
+	}
+	if (f)
+		ok &= !fclose(f);
+	/* the new index replaces the previous one atomically */
+	if (!ok || rename(tmpfile, inv->indexfile)) {
+		printf("Failed to write the index file: %s\n", inv->indexfile);
+		unlink(tmpfile);
+		ok = 0;
+	}
+	OPENSSL_free(tmpfile);
+	return ok;
+}
+
+/* The first line of the sorted index at or after the offset pos */
+static size_t inventory_line_start(const char *data, size_t size, size_t pos)
+{
+	while (pos > 0 && pos < size && data[pos - 1] != '\n')
+		pos++;
+	return pos;
+}
+
+static size_t inventory_line_next(const char *data, size_t size, size_t pos)
+{
+	const char *end = memchr(data + pos, '\n', size - pos);
+
+	return end ? (size_t)(end - data) + 1 : size;
+}
+
+/* Compare the thumbprint at the start of an index line with the key */
+static int inventory_key_cmp(const char *line, size_t len, const char *key, size_t keylen)
+{
+	int c = memcmp(line, key, len < keylen ? len : keylen);
+
+	return (c == 0 && len < keylen) ? -1 : c;
+}
+
+static int inventory_print(const char *line, size_t len)
+{
+	char buf[INVENTORY_LINE_MAX];
+	char serial[INVENTORY_LINE_MAX], role[32], signtime[32], tstime[32];
+
+	if (len >= sizeof buf)
+		return 0; /* FAILED */
+	memcpy(buf, line, len);
+	buf[len] = '\0';
+	if (!inventory_path(buf) || sscanf(buf, "%*s %8191s %31s %31s %31s", serial, role, signtime, tstime) != 4)
+		return 0; /* FAILED */
+	printf("File: %s\n", inventory_path(buf));
+	printf("\tRole           : %s\n", role);
+	printf("\tSerial         : %s\n", serial);
+	printf("\tSigning time   : ");
+	print_time_t(strcmp(signtime, "-") ? (time_t)strtoll(signtime, NULL, 10) : INVALID_TIME);
+	printf("\tTimestamp time : ");
+	print_time_t(strcmp(tstime, "-") ? (time_t)strtoll(tstime, NULL, 10) : INVALID_TIME);
+	return 1; /* OK */
+}
+
+/*
+ * Look up the files signed with a certificate by its SHA-1 thumbprint,
+ * or by its serial number given as "serial:XXXX..."
+ */
+static int inventory_query(char *indexfile, char *query)
+{
+	char *key, *data, *p;
+	size_t size, pos, lo, hi, keylen;
+	int serial = !strncmp(query, "serial:", 7), found = 0;
+	BIGNUM *bn = NULL;
+
+	size = get_file_size(indexfile);
+	if (size == 0)
+		return 0; /* FAILED */
+	data = map_file(indexfile, size);
+	if (!data) {
+		printf("Failed to open file: %s\n", indexfile);
+		return 0; /* FAILED */
+	}
+	key = hex_normalize(serial ? query + 7 : query);
+	keylen = strlen(key);
+	if (serial) {
+		/* the serial in the canonical form of BN_bn2hex() */
+		if (keylen == 0 || !BN_hex2bn(&bn, key)) {
+			printf("Invalid serial number: %s\n", query + 7);
+			goto out;
+		}
+		OPENSSL_free(key);
+		key = BN_bn2hex(bn);
+		keylen = strlen(key);
+		for (pos = 0; pos < size; pos = inventory_line_next(data, size, pos)) {
+			p = memchr(data + pos, ' ', size - pos);
+			if (p && (size_t)(p - data) + 1 + keylen < size
+					&& !memcmp(p + 1, key, keylen) && p[1 + keylen] == ' ')
+				found += inventory_print(data + pos, inventory_line_next(data, size, pos) - pos - 1);
+		}
+	} else {
+		if (keylen != SHA_DIGEST_LENGTH*2) {
+			printf("Invalid SHA-1 thumbprint: %s\n", query);
+			goto out;
+		}
+		/* binary search for the first line of the thumbprint */
+		lo = 0;
+		hi = size;
+		while (lo < hi) {
+			size_t mid = inventory_line_start(data, size, lo + (hi - lo) / 2);
+			if (mid >= hi)
+				mid = lo;
+			if (inventory_key_cmp(data + mid, size - mid, key, keylen) < 0)
+				lo = inventory_line_next(data, size, mid);
+			else
+				hi = mid;
+		}
+		for (pos = lo; pos + keylen < size && !memcmp(data + pos, key, keylen) && data[pos + keylen] == ' ';
+				pos = inventory_line_next(data, size, pos))
+			found += inventory_print(data + pos, inventory_line_next(data, size, pos) - pos - 1);
+	}
+	printf("Number of matching entries: %d\n", found);
+out:
+	OPENSSL_free(key);
+	BN_free(bn);
+#ifdef WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(data, size);
+#endif
+	return found > 0;
+}
+
+static int inventory(GLOBAL_OPTIONS *options)
+{
+	INVENTORY inv;
+	int ret = 1;
+
+	if (options->infile) {
+		memset(&inv, 0, sizeof(INVENTORY));
+		inv.indexfile = options->indexfile;
+		inv.verbose = options->verbose;
+		inv.old = inventory_read(options->indexfile);
+		inv.lines = sk_OPENSSL_STRING_new_null();
+		inventory_walk(&inv, options->infile, 1);
+		inventory_keep(&inv, options->infile);
+		printf("Scanned files       : %d\n", inv.scanned);
+		printf("Unchanged files     : %d\n", inv.reused);
+		printf("Signed files        : %d\n", inv.signedfiles);
+		if (inv.failed)
+			printf("Unreadable entries  : %d\n", inv.failed);
+		ret = inv.scanned + inv.reused > 0 && inventory_write(&inv) ? 0 : 1;
+		if (ret == 0)
+			printf("Index entries       : %d\n", inv.entries);
+		sk_OPENSSL_STRING_pop_free(inv.old, inventory_line_free);
+		sk_OPENSSL_STRING_pop_free(inv.lines, inventory_line_free);
+		if (ret)
+			return ret;
+	}
+	if (options->query)
+		ret = inventory_query(options->indexfile, options->query) ? 0 : 1;
+	return ret;
+}
+
+/*
+ * Signature status without hashing ("status" command)
+ * Only the headers and the signature of each file are read: the first page
+ * and the certificate table of a PE file and the reserved header of a CAB file
+ * with pread(), the header and the root directory entries of a MSI file
+ * from the mapped file.  The whole CAT file is its signature.
+ */
+#define STATUS_HEADER_SIZE 4096
+
+/* Read len bytes at the offset, without moving the file position where pread() exists */
+static int status_read(int fd, char *buf, size_t len, uint64_t offset)
+{
+	while (len > 0) {
+#ifdef WIN32
+		int n = _lseeki64(fd, (__int64)offset, SEEK_SET) < 0 ? -1 : _read(fd, buf, (unsigned int)len);
+#else
+		ssize_t n = pread(fd, buf, len, (off_t)offset);
+#endif
+		if (n <= 0)
+			return 0; /* FAILED */
+		buf += n;
+		len -= (size_t)n;
+		offset += (uint64_t)n;
+	}
+	return 1; /* OK */
+}
+
+/*
+ * The signature of a PE or CAB file, notsigned is set for a file without any signature.
+ * The header buffer holds the first STATUS_HEADER_SIZE bytes of the file.
+ */
+static PKCS7 *status_pread_pkcs7(file_type_t type, int fd, char *path, size_t filesize,
+	char *head, int *notsigned)
+{
+	FILE_HEADER header;
+	PKCS7 *p7 = NULL;
+	char *pehead = NULL, *sigbuf;
+	int ok;
+
+	memset(&header, 0, sizeof(FILE_HEADER));
+	header.fileend = filesize;
+	if (type == FILE_TYPE_PE) {
+		/* the PE header may start beyond the first page,
+		 * pe_verify_header() reads up to the PE32+ certificate table entry */
+		uint32_t pe_offset = GET_UINT32_LE(head + 60);
+		if (filesize < 64 || (uint64_t)pe_offset + 176 > filesize) {
+			printf("Corrupt DOS file - too short: %s\n", path);
+			return NULL;
+		}
+		if (pe_offset + 176 > STATUS_HEADER_SIZE) {
+			pehead = OPENSSL_malloc(pe_offset + 176);
+			if (!status_read(fd, pehead, pe_offset + 176, 0)) {
+				OPENSSL_free(pehead);
+				return NULL;
+			}
+		}
+		ok = pe_verify_header(pehead ? pehead : head, path, filesize, &header);
+		OPENSSL_free(pehead);
+		if (!ok)
+			return NULL;
+		*notsigned = header.sigpos == 0;
+	} else {
+		if (!cab_verify_header(head, path, filesize, &header))
+			return NULL;
+		*notsigned = header.header_size != 20;
+	}
+	if (*notsigned)
+		return NULL;
+	if (header.siglen == 0 || header.sigpos >= filesize) {
+		printf("Corrupt signature position: %s\n", path);
+		return NULL;
+	}
+	sigbuf = OPENSSL_malloc(header.siglen);
+	if (status_read(fd, sigbuf, header.siglen, header.sigpos)) {
+		/* the signature read at the offset 0 of its buffer */
+		header.sigpos = 0;
+		if (type == FILE_TYPE_PE)
+			p7 = pe_extract_existing_pkcs7(sigbuf, &header);
+		else
+			p7 = extract_existing_pkcs7(sigbuf, &header);
+	}
+	OPENSSL_free(sigbuf);
+	return p7;
+}
+
+/* The signature of a MSI or CAT file read from the mapped file */
+static PKCS7 *status_mapped_pkcs7(file_type_t type, char *path, size_t filesize, int *notsigned)
+{
+	FILE_HEADER header;
+	MSI_PARAMS msiparams;
+	PKCS7 *p7 = NULL;
+	char *indata = map_file(path, (off_t)filesize);
+
+	if (!indata) {
+		printf("Failed to open file: %s\n", path);
+		return NULL;
+	}
+	memset(&header, 0, sizeof(FILE_HEADER));
+	header.fileend = filesize;
+	memset(&msiparams, 0, sizeof(MSI_PARAMS));
+	p7 = inventory_extract_pkcs7(type, indata, path, filesize, &header, &msiparams);
+	/* a valid MSI file without the DigitalSignature stream, or an unsigned catalog file */
+	if (!p7 && type == FILE_TYPE_MSI && msiparams.dirent)
+		*notsigned = msi_signatures_get(msiparams.dirent, NULL) == NULL;
+	else if (!p7 && type == FILE_TYPE_CAT)
+		*notsigned = header.sigpos == header.fileend;
+	free_msi_params(&msiparams);
+#ifdef WIN32
+	UnmapViewOfFile(indata);
+#else
+	munmap(indata, filesize);
+#endif
+	return p7;
+}
+
+typedef struct {
+	int notsigned;
+	int signedfiles;
+	int matched;
+	int unsupported;
+	int failed;
+} STATUS_COUNTS;
+
+/*
+ * Print the status of the file: unsigned, signed, matched (signed with
+ * the certificate of the "-thumbprint" option), unsupported or error
+ */
+static void status_file(char *path, const char *match, int verbose, STATUS_COUNTS *counts)
+{
+	char head[STATUS_HEADER_SIZE], digests[128], thumbprint[SHA_DIGEST_LENGTH*2+1];
+	unsigned char mdbuf[SHA_DIGEST_LENGTH];
+	size_t filesize, headlen;
+	file_type_t type;
+	PKCS7 *p7 = NULL;
+	STACK_OF(SIGNATURE) *signatures;
+	int i, j, ret, timestamp = 0, matched = 0, notsigned = 0;
+#ifdef WIN32
+	struct _stat st;
+	int fd = _open(path, _O_RDONLY | _O_BINARY);
+	ret = fd < 0 ? -1 : _fstat(fd, &st);
+#else
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	ret = fd < 0 ? -1 : fstat(fd, &st);
+#endif
+
+	if (ret) {
+		printf("Failed to open file: %s\n", path);
+		printf("%s: error\n", path);
+		if (fd >= 0)
+			close(fd);
+		counts->failed++;
+		return;
+	}
+	filesize = (size_t)st.st_size;
+	headlen = filesize < STATUS_HEADER_SIZE ? filesize : STATUS_HEADER_SIZE;
+	memset(head, 0, sizeof head);
+	if (headlen < 4 || !status_read(fd, head, headlen, 0) || !get_file_type(head, NULL, &type)) {
+		close(fd);
+		printf("%s: unsupported\n", path);
+		counts->unsupported++;
+		return;
+	}
+	if (type == FILE_TYPE_PE || type == FILE_TYPE_CAB)
+		p7 = status_pread_pkcs7(type, fd, path, filesize, head, &notsigned);
+	close(fd);
+	if (type == FILE_TYPE_MSI || type == FILE_TYPE_CAT)
+		p7 = status_mapped_pkcs7(type, path, filesize, &notsigned);
+	signatures = sk_SIGNATURE_new_null();
+	if (p7 && !append_signature_list(&signatures, p7, 1)) {
+		PKCS7_free(p7);
+		p7 = NULL;
+	}
+	ERR_clear_error();
+	if (!p7) {
+		printf("%s: %s\n", path, notsigned ? "unsigned" : "error");
+		if (notsigned)
+			counts->notsigned++;
+		else
+			counts->failed++;
+		sk_SIGNATURE_free(signatures);
+		return;
+	}
+	digests[0] = '\0';
+	strcpy(thumbprint, "-");
+	for (i = 0; i < sk_SIGNATURE_num(signatures); i++) {
+		SIGNATURE *signature = sk_SIGNATURE_value(signatures, i);
+		X509 *signer = pkcs7_signer_cert(signature->p7);
+		char signerbuf[SHA_DIGEST_LENGTH*2+1];
+		const char *mdname = OBJ_nid2sn(signature->md_nid);
+
+		/* the algorithms of the primary and the nested signatures, each once */
+		for (j = 0; j < i && sk_SIGNATURE_value(signatures, j)->md_nid != signature->md_nid; j++)
+			continue;
+		if (j == i && strlen(digests) + strlen(mdname) + 2 < sizeof digests) {
+			if (digests[0])
+				strcat(digests, ",");
+			strcat(digests, mdname);
+		}
+		timestamp |= signature->timestamp != NULL;
+		strcpy(signerbuf, "-");
+		if (signer && X509_digest(signer, digest_by_nid(NID_sha1), mdbuf, NULL))
+			tohex(mdbuf, signerbuf, SHA_DIGEST_LENGTH);
+		if (i == 0)
+			strcpy(thumbprint, signerbuf);
+		if (match && !strcmp(signerbuf, match))
+			matched = 1;
+		if (verbose)
+			printf("%s: signature %d, digest: %s, timestamp: %s, signer: %s\n", path, i, mdname,
+				signature->timestamp ? "yes" : "no", signerbuf);
+	}
+	printf("%s: %s, digest: %s, nested: %d, timestamp: %s, signer: %s\n", path,
+		matched ? "matched" : "signed", digests, sk_SIGNATURE_num(signatures) - 1,
+		timestamp ? "yes" : "no", thumbprint);
+	if (matched)
+		counts->matched++;
+	else
+		counts->signedfiles++;
+	sk_SIGNATURE_pop_free(signatures, signature_free);
+}
+
+static int status(GLOBAL_OPTIONS *options)
+{
+	STATUS_COUNTS counts;
+	char *match = NULL;
+	int i;
+
+	memset(&counts, 0, sizeof(STATUS_COUNTS));
+	if (options->thumbprint) {
+		/* the SHA-1 thumbprint of our signing certificate */
+		match = hex_normalize(options->thumbprint);
+		if (strlen(match) != SHA_DIGEST_LENGTH*2) {
+			printf("Invalid SHA-1 thumbprint: %s\n", options->thumbprint);
+			OPENSSL_free(match);
+			return 1; /* FAILED */
+		}
+	}
+	if (options->infile)
+		status_file(options->infile, match, options->verbose, &counts);
+	for (i = 0; i < options->ninfiles; i++)
+		status_file(options->infiles[i], match, options->verbose, &counts);
+	printf("\nUnsigned files      : %d\n", counts.notsigned);
+	printf("Signed files        : %d\n", counts.signedfiles);
+	if (match)
+		printf("Matching signer     : %d\n", counts.matched);
+	printf("Unsupported files   : %d\n", counts.unsupported);
+	printf("Failed files        : %d\n", counts.failed);
+	OPENSSL_free(match);
+	return counts.failed > 0;
+}
+
+/*
+ * Check the primary signature of the input file before signing it again
+ * ("-skip-if-signed-by" option), so a rerun of an interrupted signing job
+ * does not repeat the private key operations and the timestamp requests.
+ * The signature of the primary signer has to verify with its certificate,
+ * its chain is not verified.  With "-require-digest-match" the file digest
+ * of the primary signature has to match the file as well, the nested
+ * signatures are not checked.
+ * Return 1 if the file is already signed by the given signer, otherwise 0.
+ */
+static int sign_skip_check(file_type_t type, char *indata, FILE_HEADER *header,
+	MSI_PARAMS *msiparams, GLOBAL_OPTIONS *options)
+{
+	GLOBAL_OPTIONS digestopts;
+	STACK_OF(SIGNATURE) *signatures = NULL;
+	SIGNATURE *signature;
+	MSI_ENTRY *dse = NULL;
+	unsigned char mdbuf[SHA_DIGEST_LENGTH];
+	char signerbuf[SHA_DIGEST_LENGTH*2+1];
+	char *match, *exdata = NULL;
+	const u_char *content;
+	size_t content_len;
+	uint32_t exlen = 0;
+	X509 *signer;
+	PKCS7 *p7;
+	BIO *bio;
+	int ret = 0;
+
+	match = hex_normalize(options->skip_signed_by);
+	p7 = get_existing_pkcs7(type, indata, header, msiparams);
+	signer = p7 ? pkcs7_signer_cert(p7) : NULL;
+	if (signer && X509_digest(signer, digest_by_nid(NID_sha1), mdbuf, NULL)) {
+		tohex(mdbuf, signerbuf, SHA_DIGEST_LENGTH);
+		ret = !strcmp(signerbuf, match);
+	}
+	OPENSSL_free(match);
+	if (!ret) {
+		printf("Input file is not signed by %s\n", options->skip_signed_by);
+		goto out; /* sign the file */
+	}
+	content = pkcs7_signed_content(p7, &content_len);
+	bio = BIO_new_mem_buf(content, (int)content_len);
+	ret = bio && PKCS7_verify(p7, NULL, NULL, bio, NULL, PKCS7_NOVERIFY);
+	BIO_free(bio);
+	if (!ret) {
+		printf("Input file signature verification failed\n");
+		goto out; /* sign the file */
+	}
+	if (!options->require_digest_match)
+		goto out; /* skip the file */
+
+	/* the existing verification of the file digest only */
+	signatures = sk_SIGNATURE_new_null();
+	if (!append_signature_list(&signatures, p7, 0)) {
+		printf("Failed to create signature list\n");
+		ret = 0;
+		goto out;
+	}
+	p7 = NULL; /* freed with the signature list */
+	signature = sk_SIGNATURE_value(signatures, 0);
+	digestopts = *options;
+	digestopts.digest_only = 1;
+	if (type == FILE_TYPE_PE) {
+		ret = !pe_verify_pkcs7(signature, indata, header, &digestopts);
+	} else if (type == FILE_TYPE_CAB) {
+		ret = !cab_verify_pkcs7(signature, indata, header, &digestopts);
+	} else if (type == FILE_TYPE_MSI) {
+		msi_signatures_get(msiparams->dirent, &dse);
+		if (dse) {
+			exlen = GET_UINT32_LE(dse->size);
+			exdata = OPENSSL_malloc(exlen);
+			ret = msi_file_read(msiparams->msi, dse, 0, exdata, exlen);
+		}
+		ret = ret && !msi_verify_pkcs7(signature, msiparams->msi, msiparams->dirent,
+			exdata, exlen, &digestopts);
+	} else if (type == FILE_TYPE_CAT) {
+		ret = !cat_verify_pkcs7(signature, indata, header, FILE_TYPE_CAT, &digestopts);
+	}
+	if (!ret)
+		printf("Input file digest does not match its signature\n");
+out:
+	PKCS7_free(p7);
+	sk_SIGNATURE_pop_free(signatures, signature_free);
+	OPENSSL_free(exdata);
+	ERR_clear_error();
+	return ret;
+}
+
+/* Copy the skipped input file unchanged to the output file */
+static int sign_skip_file(char *indata, size_t filesize, GLOBAL_OPTIONS *options)
+{
+	BIO *outdata;
+	int ok;
+
+	printf("Skipping the input file already signed by %s\n", options->skip_signed_by);
+#ifdef WIN32
+	if (!access(options->outfile, R_OK)) {
+		/* outdata file exists */
+		printf("Failed to create file: %s\n", options->outfile);
+		return 0; /* FAILED */
+	}
+#endif
+	outdata = BIO_new_file(options->outfile, FILE_CREATE_MODE);
+	if (!outdata) {
+		printf("Failed to create file: %s\n", options->outfile);
+		return 0; /* FAILED */
+	}
+	ok = BIO_write(outdata, indata, (int)filesize) == (int)filesize;
+	BIO_free_all(outdata);
+	if (!ok) {
+		printf("Failed to write file: %s\n", options->outfile);
+		unlink(options->outfile);
+		return 0; /* FAILED */
+	}
+	return 1; /* OK */
 }
 
-static void free_crypto_params(CRYPTO_PARAMS *cparams)
+/*
+ * A cache entry is only reused if it signs the same content with our
+ * certificate, and its signature verifies.  This rejects a stale,
+ * corrupted or replaced cache file.
+ * Return 1 if the cached signature is valid.
+ */
+static int sigcache_verify(PKCS7 *cached, PKCS7 *sig, u_char *content, int content_len)
 {
-	/* If key is NULL nothing is done */
-	EVP_PKEY_free(cparams->pkey);
-	cparams->pkey = NULL;
-	/* If X509 structure is NULL nothing is done */
-	X509_free(cparams->cert);
-	cparams->cert = NULL;
-	/* Free up all elements of sk structure and sk itself */
-	sk_X509_pop_free(cparams->certs, X509_free);
-	cparams->certs = NULL;
-	sk_X509_pop_free(cparams->xcerts, X509_free);
-	cparams->xcerts = NULL;
-	sk_X509_CRL_pop_free(cparams->crls, X509_CRL_free);
-	cparams->crls = NULL;
-}
+	ASN1_STRING *value;
+	X509 *signer, *cert;
+	const u_char *signed_content;
+	size_t signed_len;
+	BIO *bio;
+	int ok;
 
-static void free_options(GLOBAL_OPTIONS *options)
-{
-	/* If memory has not been allocated nothing is done */
-	OPENSSL_free(options->cafile);
-	OPENSSL_free(options->tsa_cafile);
-	OPENSSL_free(options->crlfile);
-	OPENSSL_free(options->tsa_crlfile);
+	if (!PKCS7_type_is_signed(cached) || !cached->d.sign->contents
+			|| !cached->d.sign->contents->d.other
+			|| cached->d.sign->contents->d.other->type != V_ASN1_SEQUENCE)
+		return 0; /* FAILED */
+	value = cached->d.sign->contents->d.other->value.sequence;
+	if (!value || value->length != content_len || memcmp(value->data, content, (size_t)content_len))
+		return 0; /* FAILED */
+	signer = pkcs7_signer_cert(cached);
+	cert = pkcs7_signer_cert(sig);
+	if (!signer || !cert || X509_cmp(signer, cert))
+		return 0; /* FAILED */
+	/* the signer's chain is not verified, the certificate is our own */
+	signed_content = pkcs7_signed_content(cached, &signed_len);
+	bio = BIO_new_mem_buf(signed_content, (int)signed_len);
+	ok = bio && PKCS7_verify(cached, NULL, NULL, bio, NULL, PKCS7_NOVERIFY);
+	BIO_free(bio);
+	return ok;
 }
 
-static char *get_cafile(void)
+/*
+ * The signature cache ("-sigcache" option) keeps finished signatures
+ * (including timestamps) in a directory, so signing the same content again
+ * with the same signer and options reuses the signature instead of
+ * repeating the private key operation and the timestamp requests.
+ * The key is a SHA-256 hash over the signed content
+ * (SpcIndirectDataContent with the file digest and page hashes,
+ * or the CTL of a catalog file), the new unsigned PKCS#7 structure
+ * (certificates, CRLs and authenticated attributes) and the options
+ * applied after signing.
+ */
+static PKCS7 *sigcache_lookup(PKCS7 *sig, file_type_t type, u_char *content,
+			int content_len, GLOBAL_OPTIONS *options)
 {
-	const char *sslpart1, *sslpart2;
-	char *cafile, *openssl_dir, *str_begin, *str_end;
+	static const char prefix[] = "osslsigncode signature cache v1";
+	unsigned char mdbuf[EVP_MAX_MD_SIZE], *der = NULL, ftype = (unsigned char)type;
+	char hexbuf[EVP_MAX_MD_SIZE*2+1];
+	unsigned int mdlen;
+	int derlen;
+	size_t pathlen;
+	EVP_MD_CTX *mdctx;
+	PKCS7 *cached;
+	BIO *bio;
 
-#ifdef CA_BUNDLE_PATH
-	if (strcmp(CA_BUNDLE_PATH, ""))
-		return OPENSSL_strdup(CA_BUNDLE_PATH);
-#endif
-	sslpart1 = OpenSSL_version(OPENSSL_DIR);
-	sslpart2 = "/certs/ca-bundle.crt";
-	str_begin = strchr(sslpart1, '"');
-	str_end = strrchr(sslpart1, '"');
-	if (str_begin && str_end && str_begin < str_end) {
-		openssl_dir = OPENSSL_strndup(str_begin + 1, str_end - str_begin - 1);
-	} else {
-		openssl_dir = OPENSSL_strdup("/etc");
+	derlen = i2d_PKCS7(sig, &der);
+	if (derlen <= 0)
+		return NULL; /* FAILED */
+	mdctx = EVP_MD_CTX_new();
+	if (!mdctx || !EVP_DigestInit_ex(mdctx, digest_by_nid(NID_sha256), NULL)) {
+		EVP_MD_CTX_free(mdctx);
+		OPENSSL_free(der);
+		return NULL; /* FAILED */
 	}
-	cafile = OPENSSL_malloc(strlen(sslpart1) + strlen(sslpart2) + 1);
-	strcpy(cafile, openssl_dir);
-	strcat(cafile, sslpart2);
+	EVP_DigestUpdate(mdctx, prefix, sizeof prefix);
+	EVP_DigestUpdate(mdctx, &ftype, 1);
+	EVP_DigestUpdate(mdctx, content, (size_t)content_len);
+	EVP_DigestUpdate(mdctx, der, (size_t)derlen);
+	OPENSSL_free(der);
+#ifdef ENABLE_CURL
+	{
+		int i;
+		for (i=0; i<options->nturl; i++)
+			EVP_DigestUpdate(mdctx, options->turl[i], strlen(options->turl[i]) + 1);
+		EVP_DigestUpdate(mdctx, "|", 1);
+		for (i=0; i<options->ntsurl; i++)
+			EVP_DigestUpdate(mdctx, options->tsurl[i], strlen(options->tsurl[i]) + 1);
+	}
+#endif /* ENABLE_CURL */
+	EVP_DigestUpdate(mdctx, options->addBlob ? "B" : "-", 1);
+	EVP_DigestFinal_ex(mdctx, mdbuf, &mdlen);
+	EVP_MD_CTX_free(mdctx);
+	tohex(mdbuf, hexbuf, (int)mdlen);
 
-	OPENSSL_free(openssl_dir);
-	return cafile;
+	pathlen = strlen(options->sigcache) + 1 + strlen(hexbuf) + 4;
+	options->sigcache_file = OPENSSL_malloc(pathlen);
+	snprintf(options->sigcache_file, pathlen, "%s/%s.p7", options->sigcache, hexbuf);
+
+	bio = BIO_new_file(options->sigcache_file, "rb");
+	if (!bio) {
+		ERR_clear_error();
+		return NULL; /* not cached */
+	}
+	cached = d2i_PKCS7_bio(bio, NULL);
+	BIO_free(bio);
+	if (!cached || !sigcache_verify(cached, sig, content, content_len)) {
+		printf("Warning: Ignoring invalid cached signature: %s\n", options->sigcache_file);
+		PKCS7_free(cached);
+		ERR_clear_error();
+		return NULL; /* not cached */
+	}
+	printf("Reusing the cached signature: %s\n", options->sigcache_file);
+	options->sigcache_hit = 1;
+	return cached; /* OK */
 }
 
-static PKCS7 *get_sigfile(char *sigfile, file_type_t type)
+/*
+ * Store the finished signature under the key computed by sigcache_lookup().
+ * A failure only disables caching, the signed file is still written.
+ */
+static void sigcache_store(PKCS7 *sig, GLOBAL_OPTIONS *options)
 {
-	PKCS7 *sig = NULL;
-	size_t sigfilesize;
-	char *insigdata;
-	FILE_HEADER header;
-	BIO *sigbio;
-	const char pemhdr[] = "-----BEGIN PKCS7-----";
+	char *tmpfile;
+	size_t len;
+	BIO *bio;
+	int ok;
 
-	sigfilesize = get_file_size(sigfile);
-	if (!sigfilesize) {
-		return NULL; /* FAILED */
-	}
-	insigdata = map_file(sigfile, sigfilesize);
-	if (!insigdata) {
-		printf("Failed to open file: %s\n", sigfile);
-		return NULL; /* FAILED */
-	}
-	if (sigfilesize >= sizeof pemhdr && !memcmp(insigdata, pemhdr, sizeof pemhdr - 1)) {
-		sigbio = BIO_new_mem_buf(insigdata, sigfilesize);
-		sig = PEM_read_bio_PKCS7(sigbio, NULL, NULL, NULL);
-		BIO_free_all(sigbio);
-	} else {
-		/* reset header */
-		memset(&header, 0, sizeof(FILE_HEADER));
-		header.siglen = sigfilesize;
-		header.sigpos = 0;
-		if (type == FILE_TYPE_PE)
-			sig = pe_extract_existing_pkcs7(insigdata, &header);
-		else
-			sig = extract_existing_pkcs7(insigdata, &header);
+	len = strlen(options->sigcache_file) + 32;
+	tmpfile = OPENSSL_malloc(len);
+	snprintf(tmpfile, len, "%s.%ld.tmp", options->sigcache_file, (long)getpid());
+	bio = BIO_new_file(tmpfile, "wb");
+	ok = bio && i2d_PKCS7_bio(bio, sig);
+	BIO_free(bio);
+	/* the temporary file makes the new cache entry visible atomically */
+	if (!ok || rename(tmpfile, options->sigcache_file)) {
+		printf("Warning: Failed to store the signature in the cache: %s\n", options->sigcache_file);
+		unlink(tmpfile);
+		ERR_clear_error();
 	}
-	return sig; /* OK */
+	OPENSSL_free(tmpfile);
 }
 
 /*
  * Obtain an existing signature or create a new one
+ * with the message digest calculated by the hash BIO using md
  */
-static PKCS7 *get_pkcs7(cmd_type_t cmd, BIO *hash, file_type_t type, char *indata,
-			GLOBAL_OPTIONS *options, FILE_HEADER *header, CRYPTO_PARAMS *cparams, PKCS7 *cursig)
+static PKCS7 *get_pkcs7(cmd_type_t cmd, BIO *hash, const EVP_MD *md, file_type_t type,
+			char *indata, GLOBAL_OPTIONS *options, FILE_HEADER *header,
+			CRYPTO_PARAMS *cparams, PKCS7 *cursig)
 {
 	PKCS7 *sig = NULL;
 
@@ -5251,24 +8467,64 @@ static PKCS7 *get_pkcs7(cmd_type_t cmd, BIO *hash, file_type_t type, char *indat
 			return NULL; /* FAILED */
 		}
 	} else if (cmd == CMD_SIGN) {
-		sig = create_new_signature(type, options, cparams);
+		u_char *content, *blob = NULL;
+		int content_len, ret;
+		PHASE phase;
+
+		sig = create_new_signature(type, md, options, cparams);
 		if (!sig) {
 			printf("Creating a new signature failed\n");
 			return NULL; /* FAILED */
 		}
+		if (type == FILE_TYPE_CAT) {
+			ASN1_STRING *seq = cursig->d.sign->contents->d.other->value.sequence;
+			content = seq->data;
+			content_len = seq->length;
+		} else if (!get_indirect_data_content(&blob, &content_len, hash, md, type,
+				indata, options, header)) {
+			PKCS7_free(sig);
+			printf("Signing failed\n");
+			return NULL; /* FAILED */
+		} else {
+			content = blob;
+		}
+		if (options->sigcache) {
+			PKCS7 *cached = sigcache_lookup(sig, type, content, content_len, options);
+			if (cached) {
+				PKCS7_free(sig);
+				OPENSSL_free(blob);
+				return cached; /* OK */
+			}
+		}
+		phase_begin(&phase, PHASE_SIGNING);
+		USDT_PROBE2(pkcs7_sign_entry, type, content_len);
 		if (type == FILE_TYPE_CAT) {
 			if (!set_content_blob(sig, cursig)) {
+				phase_end(&phase, 0);
 				PKCS7_free(sig);
 				printf("Signing failed\n");
 				return NULL; /* FAILED */
 			}
 		} else {
-			if (!set_indirect_data_blob(sig, hash, type, indata, options, header)) {
+			ret = set_signing_blob(sig, content, content_len);
+			OPENSSL_free(blob);
+			if (!ret) {
+				phase_end(&phase, 0);
 				PKCS7_free(sig);
 				printf("Signing failed\n");
 				return NULL; /* FAILED */
 			}
 		}
+#ifdef PROVIDE_SIGNER_CMD
+		if (options->signer_cmd && !signer_sign(sig, cparams)) {
+			phase_end(&phase, 0);
+			PKCS7_free(sig);
+			printf("Signing failed\n");
+			return NULL; /* FAILED */
+		}
+#endif /* PROVIDE_SIGNER_CMD */
+		USDT_PROBE2(pkcs7_sign_return, type, content_len);
+		phase_end(&phase, (uint64_t)content_len);
 	}
 	return sig;
 }
@@ -5312,15 +8568,22 @@ static PKCS7 *msi_presign_file(file_type_t type, cmd_type_t cmd, FILE_HEADER *he
 	PKCS7 *sig = NULL;
 	uint32_t len;
 	char *data;
+	PHASE phase;
 
+	phase_begin(&phase, PHASE_DIGEST);
 	if (options->add_msi_dse && !msi_calc_MsiDigitalSignatureEx(msiparams, options->md, hash)) {
+		phase_end(&phase, 0);
 		printf("Unable to calc MsiDigitalSignatureEx\n");
 		return NULL; /* FAILED */
 	}
+	USDT_PROBE2(msi_hash_dir_entry, FILE_TYPE_MSI, header->fileend);
 	if (!msi_hash_dir(msiparams->msi, msiparams->dirent, hash, 1)) {
+		phase_end(&phase, 0);
 		printf("Unable to msi_handle_dir()\n");
 		return NULL; /* FAILED */
 	}
+	USDT_PROBE2(msi_hash_dir_return, FILE_TYPE_MSI, header->fileend);
+	phase_end(&phase, header->fileend);
 
 	/* Obtain a current signature from previously-signed file */
 	if ((cmd == CMD_SIGN && options->nest) ||
@@ -5347,7 +8610,7 @@ static PKCS7 *msi_presign_file(file_type_t type, cmd_type_t cmd, FILE_HEADER *he
 	}
 	/* Obtain an existing signature or create a new one */
 	if ((cmd == CMD_ATTACH) || (cmd == CMD_SIGN))
-		sig = get_pkcs7(cmd, hash, type, indata, options, header, cparams, NULL);
+		sig = get_pkcs7(cmd, hash, options->md, type, indata, options, header, cparams, NULL);
 	return sig; /* OK */
 }
 
@@ -5356,6 +8619,7 @@ static PKCS7 *pe_presign_file(file_type_t type, cmd_type_t cmd, FILE_HEADER *hea
 			BIO *hash, BIO *outdata, PKCS7 **cursig)
 {
 	PKCS7 *sig = NULL;
+	PHASE phase;
 
 	/* Obtain a current signature from previously-signed file */
 	if ((cmd == CMD_SIGN && options->nest) ||
@@ -5372,10 +8636,12 @@ static PKCS7 *pe_presign_file(file_type_t type, cmd_type_t cmd, FILE_HEADER *hea
 		/* Strip current signature */
 		header->fileend = header->sigpos;
 	}
+	phase_begin(&phase, PHASE_DIGEST);
 	pe_modify_header(indata, header, hash, outdata);
+	phase_end(&phase, header->fileend);
 	/* Obtain an existing signature or create a new one */
 	if ((cmd == CMD_ATTACH) || (cmd == CMD_SIGN))
-		sig = get_pkcs7(cmd, hash, type, indata, options, header, cparams, NULL);
+		sig = get_pkcs7(cmd, hash, options->md, type, indata, options, header, cparams, NULL);
 	return sig; /* OK */
 }
 
@@ -5384,6 +8650,7 @@ static PKCS7 *cab_presign_file(file_type_t type, cmd_type_t cmd, FILE_HEADER *he
 			BIO *hash, BIO *outdata, PKCS7 **cursig)
 {
 	PKCS7 *sig = NULL;
+	PHASE phase;
 
 	/* Obtain a current signature from previously-signed file */
 	if ((cmd == CMD_SIGN && options->nest) ||
@@ -5396,14 +8663,16 @@ static PKCS7 *cab_presign_file(file_type_t type, cmd_type_t cmd, FILE_HEADER *he
 		if (cmd == CMD_ADD)
 			sig = *cursig;
 	}
+	phase_begin(&phase, PHASE_DIGEST);
 	if (header->header_size == 20)
 		/* Strip current signature and modify header */
 		cab_modify_header(indata, header, hash, outdata);
 	else
 		cab_add_header(indata, header, hash, outdata);
+	phase_end(&phase, header->fileend);
 	/* Obtain an existing signature or create a new one */
 	if ((cmd == CMD_ATTACH) || (cmd == CMD_SIGN))
-		sig = get_pkcs7(cmd, hash, type, indata, options, header, cparams, NULL);
+		sig = get_pkcs7(cmd, hash, options->md, type, indata, options, header, cparams, NULL);
 	return sig; /* OK */
 }
 
@@ -5420,10 +8689,42 @@ static PKCS7 *cat_presign_file(file_type_t type, cmd_type_t cmd, FILE_HEADER *he
 	if (cmd == CMD_ADD)
 		sig = *cursig;
 	else
-		sig = get_pkcs7(cmd, NULL, type, indata, options, header, cparams, *cursig);
+		sig = get_pkcs7(cmd, NULL, options->md, type, indata, options, header, cparams, *cursig);
 	return sig; /* OK */
 }
 
+/*
+ * Dual signing (the "-h" option given twice): create the second signature
+ * from the digest calculated by the second message digest BIO,
+ * so the file data is hashed with both algorithms in the same pass.
+ */
+static PKCS7 *get_second_pkcs7(BIO *hash2, file_type_t type, char *indata,
+			GLOBAL_OPTIONS *options, FILE_HEADER *header, CRYPTO_PARAMS *cparams)
+{
+	PKCS7 *sig;
+
+	sig = get_pkcs7(CMD_SIGN, hash2, options->md2, type, indata, options, header, cparams, NULL);
+#ifdef ENABLE_CURL
+	/* add counter-signature/timestamp */
+	if (sig && options->nturl && add_timestamp_authenticode(sig, options)) {
+		printf("Authenticode timestamping failed\n");
+		PKCS7_free(sig);
+		sig = NULL;
+	}
+	if (sig && options->ntsurl && add_timestamp_rfc3161(sig, options->md2, options)) {
+		printf("RFC 3161 timestamping failed\n");
+		PKCS7_free(sig);
+		sig = NULL;
+	}
+#endif /* ENABLE_CURL */
+	if (sig && options->addBlob && add_unauthenticated_blob(sig)) {
+		printf("Adding unauthenticated blob failed\n");
+		PKCS7_free(sig);
+		sig = NULL;
+	}
+	return sig;
+}
+
 static void print_version()
 {
 	printf(PACKAGE_STRING ", using:\n\t%s (Library: %s)\n\t%s\n",
@@ -5456,6 +8757,14 @@ static cmd_type_t get_command(char **argv)
 		return CMD_REMOVE;
 	else if (!strcmp(argv[1], "verify"))
 		return CMD_VERIFY;
+	else if (!strcmp(argv[1], "verify-pages"))
+		return CMD_VERIFY_PAGES;
+	else if (!strcmp(argv[1], "verify-digest"))
+		return CMD_VERIFY_DIGEST;
+	else if (!strcmp(argv[1], "inventory"))
+		return CMD_INVENTORY;
+	else if (!strcmp(argv[1], "status"))
+		return CMD_STATUS;
 	else if (!strcmp(argv[1], "add"))
 		return CMD_ADD;
 	return CMD_SIGN;
@@ -5463,7 +8772,8 @@ static cmd_type_t get_command(char **argv)
 
 static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS *options)
 {
-	int i;
+	int i, nmd = 0;
+	const EVP_MD *md;
 	char *failarg = NULL;
 	const char *argv0;
 
@@ -5475,14 +8785,15 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 	}
 	/* reset options */
 	memset(options, 0, sizeof(GLOBAL_OPTIONS));
-	options->md = EVP_sha1();
+	options->md = digest_by_nid(NID_sha1);
 	options->signing_time = INVALID_TIME;
 	options->jp = -1;
+	options->range_last = UINT32_MAX;
 
 	if (*cmd == CMD_HELP) {
 		return 0; /* FAILED */
 	}
-	if (*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) {
+	if (*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES || *cmd == CMD_VERIFY_DIGEST || *cmd == CMD_ATTACH) {
 		options->cafile = get_cafile();
 		options->tsa_cafile = get_cafile();
 	}
@@ -5551,6 +8862,22 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 			}
 			options->p11module = *(++argv);
 #endif /* OPENSSL_NO_ENGINE */
+#ifdef PROVIDE_SIGNER_CMD
+		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-signer-cmd")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->signer_cmd = *(++argv);
+#endif /* PROVIDE_SIGNER_CMD */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-provider")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->provider = *(++argv);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
 		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-pass")) {
 			if (options->askpass || options->readpass) {
 				usage(argv0, "all");
@@ -5597,25 +8924,49 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 			}
 			++argv;
 			if (!strcmp(*argv, "md5")) {
-				options->md = EVP_md5();
+				md = digest_by_nid(NID_md5);
 			} else if (!strcmp(*argv, "sha1")) {
-				options->md = EVP_sha1();
+				md = digest_by_nid(NID_sha1);
 			} else if (!strcmp(*argv, "sha2") || !strcmp(*argv, "sha256")) {
-				options->md = EVP_sha256();
+				md = digest_by_nid(NID_sha256);
 			} else if (!strcmp(*argv, "sha384")) {
-				options->md = EVP_sha384();
+				md = digest_by_nid(NID_sha384);
 			} else if (!strcmp(*argv, "sha512")) {
-				options->md = EVP_sha512();
+				md = digest_by_nid(NID_sha512);
+			} else {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			/* the second "-h" option requests dual signing */
+			if (nmd == 0) {
+				options->md = md;
+			} else if (nmd == 1) {
+				options->md2 = md;
 			} else {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
+			nmd++;
 		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-i")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->url = *(++argv);
+		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-sigcache")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->sigcache = *(++argv);
+		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-skip-if-signed-by")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->skip_signed_by = *(++argv);
+		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-require-digest-match")) {
+			options->require_digest_match = 1;
 		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-st")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
@@ -5648,50 +8999,124 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 			options->addBlob = 1;
 		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ATTACH) && !strcmp(*argv, "-nest")) {
 			options->nest = 1;
-		} else if ((*cmd == CMD_VERIFY) && !strcmp(*argv, "-timestamp-expiration")) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES || *cmd == CMD_VERIFY_DIGEST)
+				&& !strcmp(*argv, "-timestamp-expiration")) {
 			options->timestamp_expiration = 1;
-		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD || *cmd == CMD_VERIFY) && !strcmp(*argv, "-verbose")) {
+		} else if ((*cmd == CMD_VERIFY) && !strcmp(*argv, "-chain-first")) {
+			options->chain_first = 1;
+		} else if ((*cmd == CMD_VERIFY) && !strcmp(*argv, "-digest-only")) {
+			options->digest_only = 1;
+		} else if (!strcmp(*argv, "-timings")) {
+			/* set before by phase_configure() to also time the option parsing */
+			phase_timings = 1;
+		} else if (!strcmp(*argv, "-memstats")) {
+			/* installed before by phase_configure() */
+			if (!phase_memstats) {
+				printf("Failed to install the OpenSSL memory functions\n");
+				return 0; /* FAILED */
+			}
+		} else if (!strcmp(*argv, "-trace")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			/* opened by main() once the options are valid */
+			options->tracefile = *(++argv);
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD || *cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES
+				|| *cmd == CMD_VERIFY_DIGEST || *cmd == CMD_INVENTORY || *cmd == CMD_STATUS)
+				&& !strcmp(*argv, "-verbose")) {
 			options->verbose = 1;
 		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD || *cmd == CMD_ATTACH) && !strcmp(*argv, "-add-msi-dse")) {
 			options->add_msi_dse = 1;
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES || *cmd == CMD_VERIFY_DIGEST || *cmd == CMD_ATTACH)
+				&& !strcmp(*argv, "-chaincache")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			chain_cache_dir = *(++argv);
 		} else if ((*cmd == CMD_VERIFY) && (!strcmp(*argv, "-c") || !strcmp(*argv, "-catalog"))) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->catalog = *(++argv);
-		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && !strcmp(*argv, "-CAfile")) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES || *cmd == CMD_VERIFY_DIGEST || *cmd == CMD_ATTACH)
+				&& !strcmp(*argv, "-CAfile")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			OPENSSL_free(options->cafile);
 			options->cafile = OPENSSL_strdup(*++argv);
-		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && !strcmp(*argv, "-CRLfile")) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES || *cmd == CMD_VERIFY_DIGEST || *cmd == CMD_ATTACH)
+				&& !strcmp(*argv, "-CRLfile")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->crlfile = OPENSSL_strdup(*++argv);
-		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && (!strcmp(*argv, "-untrusted") || !strcmp(*argv, "-TSA-CAfile"))) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES || *cmd == CMD_VERIFY_DIGEST || *cmd == CMD_ATTACH)
+				&& (!strcmp(*argv, "-untrusted") || !strcmp(*argv, "-TSA-CAfile"))) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
       }
 			OPENSSL_free(options->tsa_cafile);
 			options->tsa_cafile = OPENSSL_strdup(*++argv);
-		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && (!strcmp(*argv, "-CRLuntrusted") || !strcmp(*argv, "-TSA-CRLfile"))) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES || *cmd == CMD_VERIFY_DIGEST || *cmd == CMD_ATTACH)
+				&& (!strcmp(*argv, "-CRLuntrusted") || !strcmp(*argv, "-TSA-CRLfile"))) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->tsa_crlfile = OPENSSL_strdup(*++argv);
-		} else if ((*cmd == CMD_VERIFY) && !strcmp(*argv, "-require-leaf-hash")) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES || *cmd == CMD_VERIFY_DIGEST)
+				&& !strcmp(*argv, "-require-leaf-hash")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->leafhash = (*++argv);
+		} else if ((*cmd == CMD_VERIFY_DIGEST) && !strcmp(*argv, "-digest")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->digest = *(++argv);
+		} else if ((*cmd == CMD_VERIFY_DIGEST) && !strcmp(*argv, "-pagehash")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->pagehashfile = *(++argv);
+		} else if ((*cmd == CMD_INVENTORY) && !strcmp(*argv, "-index")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->indexfile = *(++argv);
+		} else if ((*cmd == CMD_STATUS) && !strcmp(*argv, "-thumbprint")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->thumbprint = *(++argv);
+		} else if ((*cmd == CMD_INVENTORY) && !strcmp(*argv, "-query")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->query = *(++argv);
+		} else if ((*cmd == CMD_VERIFY_PAGES) && !strcmp(*argv, "-range")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			if (!parse_range(*(++argv), &options->range_first, &options->range_last)) {
+				printf("Invalid byte range: %s\n", *argv);
+				return 0; /* FAILED */
+			}
 		} else if ((*cmd == CMD_ADD) && !strcmp(*argv, "--help")) {
 			help_for(argv0, "add");
 			*cmd = CMD_HELP;
@@ -5716,6 +9141,22 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 			help_for(argv0, "verify");
 			*cmd = CMD_HELP;
 			return 0; /* FAILED */
+		} else if ((*cmd == CMD_VERIFY_PAGES) && !strcmp(*argv, "--help")) {
+			help_for(argv0, "verify-pages");
+			*cmd = CMD_HELP;
+			return 0; /* FAILED */
+		} else if ((*cmd == CMD_VERIFY_DIGEST) && !strcmp(*argv, "--help")) {
+			help_for(argv0, "verify-digest");
+			*cmd = CMD_HELP;
+			return 0; /* FAILED */
+		} else if ((*cmd == CMD_INVENTORY) && !strcmp(*argv, "--help")) {
+			help_for(argv0, "inventory");
+			*cmd = CMD_HELP;
+			return 0; /* FAILED */
+		} else if ((*cmd == CMD_STATUS) && !strcmp(*argv, "--help")) {
+			help_for(argv0, "status");
+			*cmd = CMD_HELP;
+			return 0; /* FAILED */
 		} else if (!strcmp(*argv, "-jp")) {
 			char *ap;
 			if (--argc < 1) {
@@ -5740,11 +9181,24 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 			break;
 		}
 	}
-	if (!options->infile && argc > 0) {
+	if (*cmd == CMD_VERIFY_DIGEST) {
+		/* the detached signature is verified without the signed file */
+		if (!options->sigfile && argc > 0) {
+			options->sigfile = *(argv++);
+			argc--;
+		}
+	} else if (!options->infile && argc > 0) {
 		options->infile = *(argv++);
 		argc--;
 	}
-	if (*cmd != CMD_VERIFY && (!options->outfile && argc > 0)) {
+	if (*cmd == CMD_STATUS && argc > 0 && **argv != '-') {
+		/* any other input files */
+		options->infiles = argv;
+		options->ninfiles = argc;
+		argc = 0;
+	}
+	if (*cmd != CMD_VERIFY && *cmd != CMD_VERIFY_PAGES && *cmd != CMD_VERIFY_DIGEST && *cmd != CMD_INVENTORY
+			&& *cmd != CMD_STATUS && (!options->outfile && argc > 0)) {
 		if (!strcmp(*argv, "-out")) {
 			argv++;
 			argc--;
@@ -5758,12 +9212,21 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 #ifdef ENABLE_CURL
 		(options->nturl && options->ntsurl) ||
 #endif
-		!options->infile ||
-		(*cmd != CMD_VERIFY && !options->outfile) ||
+		(*cmd != CMD_VERIFY_DIGEST && *cmd != CMD_INVENTORY && !options->infile) ||
+		(*cmd == CMD_VERIFY_DIGEST && (!options->sigfile || !options->digest)) ||
+		(*cmd == CMD_INVENTORY && (!options->indexfile || !(options->infile || options->query))) ||
+		(*cmd != CMD_VERIFY && *cmd != CMD_VERIFY_PAGES && *cmd != CMD_VERIFY_DIGEST && *cmd != CMD_INVENTORY
+			&& *cmd != CMD_STATUS && !options->outfile) ||
 		(*cmd == CMD_SIGN && !((options->certfile && options->keyfile) ||
 #ifndef OPENSSL_NO_ENGINE
 			options->p11engine || options->p11module ||
 #endif /* OPENSSL_NO_ENGINE */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			(options->keyfile && (options->provider || is_pkcs11_uri(options->keyfile))) ||
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+#ifdef PROVIDE_SIGNER_CMD
+			(options->certfile && options->signer_cmd) ||
+#endif /* PROVIDE_SIGNER_CMD */
 			options->pkcs12file))) {
 		if (failarg)
 			printf("Unknown option: %s\n", failarg);
@@ -5771,7 +9234,36 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 		return 0; /* FAILED */
 	}
 
-	if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && access(options->cafile, R_OK)) {
+	if (chain_cache_dir && !chain_cache_check_dir(chain_cache_dir))
+		return 0; /* FAILED */
+
+	if (options->chain_first && options->digest_only) {
+		printf("The \"-chain-first\" and \"-digest-only\" options cannot be used together\n");
+		return 0; /* FAILED */
+	}
+
+	if (options->require_digest_match && !options->skip_signed_by) {
+		printf("The \"-require-digest-match\" option requires the \"-skip-if-signed-by\" option\n");
+		return 0; /* FAILED */
+	}
+	if (options->skip_signed_by) {
+		char *match = hex_normalize(options->skip_signed_by);
+		int ok = strlen(match) == SHA_DIGEST_LENGTH*2;
+
+		OPENSSL_free(match);
+		if (!ok) {
+			printf("Invalid SHA-1 thumbprint: %s\n", options->skip_signed_by);
+			return 0; /* FAILED */
+		}
+	}
+
+	if (options->md2 && (options->add_msi_dse || options->sigcache)) {
+		printf("Dual signing cannot be used with the \"-add-msi-dse\" or \"-sigcache\" option\n");
+		return 0; /* FAILED */
+	}
+
+	if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_PAGES || *cmd == CMD_VERIFY_DIGEST || *cmd == CMD_ATTACH)
+			&& !options->digest_only && access(options->cafile, R_OK)) {
 		printf("Use the \"-CAfile\" option to add one or more trusted CA certificates to verify the signature.\n");
 		return 0; /* FAILED */
 	}
@@ -5785,13 +9277,23 @@ int main(int argc, char **argv)
 	FILE_HEADER header, catheader;
 	MSI_PARAMS msiparams;
 	CRYPTO_PARAMS cparams;
-	BIO *hash = NULL, *outdata = NULL;
-	PKCS7 *cursig = NULL, *sig = NULL;
+	BIO *hash = NULL, *hash2 = NULL, *outdata = NULL;
+	PKCS7 *cursig = NULL, *sig = NULL, *sig2 = NULL;
 	char *indata = NULL, *catdata = NULL;
 	int ret = -1, len = 0;
 	size_t padlen = 0, filesize = 0;
 	file_type_t type, filetype = FILE_TYPE_CAT;
 	cmd_type_t cmd = CMD_SIGN;
+	PHASE phase;
+
+	phase_configure(argc, argv);
+
+	/* reset options, crypto and MSI parameters before any error exit */
+	memset(&options, 0, sizeof(GLOBAL_OPTIONS));
+	memset(&cparams, 0, sizeof(CRYPTO_PARAMS));
+	memset(&msiparams, 0, sizeof(MSI_PARAMS));
+	msiparams.msi = NULL;
+	msiparams.dirent = NULL;
 
 	/* Set up OpenSSL */
 	if (!OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS
@@ -5807,23 +9309,30 @@ int main(int argc, char **argv)
 			!OBJ_create(SPC_NESTED_SIGNATURE_OBJID, NULL, NULL))
 		DO_EXIT_0("Failed to create objects\n");
 
-	/* reset crypto */
-	memset(&cparams, 0, sizeof(CRYPTO_PARAMS));
-
-	/* reset MSI parameters */
-	memset(&msiparams, 0, sizeof(MSI_PARAMS));
-	msiparams.msi = NULL;
-	msiparams.dirent = NULL;
-
 	/* commands and options initialization */
+	phase_begin(&phase, PHASE_OPTIONS);
 	if (!main_configure(argc, argv, &cmd, &options))
 		goto err_cleanup;
 	if (!read_password(&options))
 		goto err_cleanup;
+	phase_end(&phase, 0);
+	if (options.tracefile && !phase_trace_open(options.tracefile))
+		DO_EXIT_1("Failed to open the trace file: %s\n", options.tracefile);
 
-	/* read key and certificates */
-	if (cmd == CMD_SIGN && !read_crypto_params(&options, &cparams))
+	if (cmd == CMD_VERIFY_DIGEST) {
+		ret = verify_digest_file(&options);
+		goto err_cleanup;
+	}
+
+	if (cmd == CMD_INVENTORY) {
+		ret = inventory(&options);
 		goto err_cleanup;
+	}
+
+	if (cmd == CMD_STATUS) {
+		ret = status(&options);
+		goto err_cleanup;
+	}
 
 	/* check if indata is cab or pe */
 	filesize = get_file_size(options.infile);
@@ -5834,14 +9343,35 @@ int main(int argc, char **argv)
 	memset(&header, 0, sizeof(FILE_HEADER));
 	header.fileend = filesize;
 
+	phase_begin(&phase, PHASE_MAP_FILE);
 	indata = map_file(options.infile, filesize);
 	if (indata == NULL)
 		DO_EXIT_1("Failed to open file: %s\n", options.infile);
+	phase_end(&phase, filesize);
 
+	phase_begin(&phase, PHASE_VALIDATION);
 	if (!get_file_type(indata, options.infile, &type))
 		goto err_cleanup;
 	if (!input_validation(type, &options, &header, &msiparams, indata, filesize))
 		goto err_cleanup;
+	phase_end(&phase, filesize);
+	if (cmd == CMD_VERIFY_PAGES && type != FILE_TYPE_PE)
+		DO_EXIT_0("Page hashes are only supported for PE files\n");
+
+	/* an already signed file needs neither the private key nor the timestamps */
+	if (cmd == CMD_SIGN && options.skip_signed_by
+			&& sign_skip_check(type, indata, &header, &msiparams, &options)) {
+		ret = !sign_skip_file(indata, filesize, &options);
+		goto err_cleanup;
+	}
+
+	/* read key and certificates */
+	if (cmd == CMD_SIGN) {
+		phase_begin(&phase, PHASE_CRYPTO_PARAMS);
+		if (!read_crypto_params(&options, &cparams))
+			goto err_cleanup;
+		phase_end(&phase, 0);
+	}
 
 	/* search catalog file to determine whether the file is signed in a catalog */
 	if (options.catalog) {
@@ -5861,10 +9391,19 @@ int main(int argc, char **argv)
 				goto err_cleanup;
 	}
 
+	if (options.md2 && type == FILE_TYPE_CAT)
+		DO_EXIT_0("Dual signing is not supported for CAT files\n");
+
 	hash = BIO_new(BIO_f_md());
 	BIO_set_md(hash, options.md);
+	if (options.md2) {
+		/* both digests are calculated from the same data written to the chain */
+		hash2 = BIO_new(BIO_f_md());
+		BIO_set_md(hash2, options.md2);
+		BIO_push(hash, hash2);
+	}
 
-	if (cmd != CMD_VERIFY) {
+	if (cmd != CMD_VERIFY && cmd != CMD_VERIFY_PAGES) {
 		/* Create outdata file */
 #ifdef WIN32
 		if (!access(options.outfile, R_OK))
@@ -5924,6 +9463,9 @@ int main(int argc, char **argv)
 		} else if (cmd == CMD_VERIFY) {
 			ret = pe_verify_file(indata, &header, &options);
 			goto skip_signing;
+		} else if (cmd == CMD_VERIFY_PAGES) {
+			ret = pe_verify_pages(indata, &header, &options);
+			goto skip_signing;
 		} else {
 			sig = pe_presign_file(type, cmd, &header, &options, &cparams, indata,
 				hash, outdata, &cursig);
@@ -5946,25 +9488,37 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* a cached signature already has its timestamps and blob */
 #ifdef ENABLE_CURL
 	/* add counter-signature/timestamp */
-	if (options.nturl && add_timestamp_authenticode(sig, &options))
+	if (!options.sigcache_hit && options.nturl && add_timestamp_authenticode(sig, &options))
 		DO_EXIT_0("Authenticode timestamping failed\n");
-	if (options.ntsurl && add_timestamp_rfc3161(sig, &options))
+	if (!options.sigcache_hit && options.ntsurl && add_timestamp_rfc3161(sig, options.md, &options))
 		DO_EXIT_0("RFC 3161 timestamping failed\n");
 #endif /* ENABLE_CURL */
 
-	if (options.addBlob && add_unauthenticated_blob(sig))
+	if (!options.sigcache_hit && options.addBlob && add_unauthenticated_blob(sig))
 		DO_EXIT_0("Adding unauthenticated blob failed\n");
 
+	if (options.sigcache_file && !options.sigcache_hit)
+		sigcache_store(sig, &options);
+
+	if (options.md2) {
+		sig2 = get_second_pkcs7(hash2, type, indata, &options, &header, &cparams);
+		if (!sig2)
+			DO_EXIT_0("Creating the second signature failed\n");
+	}
+
 #if 0
 	if (!PEM_write_PKCS7(stdout, sig))
 		DO_EXIT_0("PKCS7 output failed\n");
 #endif
 
-	ret = append_signature(sig, cursig, type, &options, &msiparams, &padlen, &len, outdata);
+	phase_begin(&phase, PHASE_APPEND);
+	ret = append_signature(sig, sig2, cursig, type, &options, &msiparams, &padlen, &len, outdata);
 	if (ret)
 		DO_EXIT_0("Append signature to outfile failed\n");
+	phase_end(&phase, (uint64_t)len);
 		
 skip_signing:
 
@@ -5996,6 +9550,7 @@ err_cleanup:
 	if (cmd != CMD_ADD)
 		PKCS7_free(cursig);
 	PKCS7_free(sig);
+	PKCS7_free(sig2);
 	if (hash)
 		BIO_free_all(hash);
 	if (outdata) {
@@ -6013,8 +9568,14 @@ err_cleanup:
 	free_msi_params(&msiparams);
 	free_crypto_params(&cparams);
 	free_options(&options);
+	digest_table_free();
 	if (ret)
 		ERR_print_errors_fp(stdout);
+	if (options.verbose)
+		chain_cache_print();
+	phase_print();
+	phase_print_memstats();
+	phase_trace_close(argc > 1 && argv[1][0] != '-' ? argv[1] : "sign", options.infile, ret);
 	if (cmd == CMD_HELP)
 		ret = 0; /* OK */
 	else
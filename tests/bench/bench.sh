@@ -0,0 +1,209 @@
+#!/bin/sh
+# Performance benchmarks of osslsigncode on synthetic PE, CAB, MSI and CAT files
+# usage: bench.sh [-micro] [-json] [-save FILE] [-compare FILE [-threshold PERCENT]]
+#                 [iterations]
+#
+# -micro runs the microbenchmarks of the individual kernels (tests/bench/micro)
+# on the signed files instead, the iterations are the number of samples.
+# -json prints the microbenchmark results in the JSON format.
+# -save stores the microbenchmark results in FILE as the baseline.
+# -compare compares the microbenchmark results with the baseline in FILE
+# (tests/bench/compare.py) and fails on regressions above the threshold (5%),
+# a missing baseline is created instead.
+#
+# The input sizes can be changed with the environment variables:
+#   BENCH_PE_SIZE (64m), BENCH_PE_SECTIONS (8),
+#   BENCH_CAB_SIZE (64m), BENCH_CAB_FOLDERS (64),
+#   BENCH_MSI_STREAMS (2000), BENCH_MSI_STREAM_SIZE (1k),
+#   BENCH_MSI_BIG_STREAMS (16), BENCH_MSI_BIG_STREAM_SIZE (1m),
+#   BENCH_CAT_MEMBERS (10000)
+# OSSLSIGNCODE, MKBENCH and MICRO specify the tested binaries, PYTHON the python3
+# interpreter,
+# BENCH_DIR the working directory (removed unless BENCH_KEEP is set).
+
+mode=bench
+json=
+save=
+compare=
+threshold=5
+iterations=
+while test $# -gt 0
+  do
+    case "$1" in
+      -micro) mode=micro ;;
+      -json) json=-json ;;
+      -save) save=$2; shift ;;
+      -compare) compare=$2; shift ;;
+      -threshold) threshold=$2; shift ;;
+      *) iterations=$1 ;;
+    esac
+    shift
+  done
+
+result_path=$(pwd)
+script_path=$(cd "$(dirname "$0")" && pwd)
+case "$save$compare" in
+  "") ;;
+  *) mode=micro; json=-json ;;
+esac
+case "$save" in
+  ""|/*) ;;
+  *) save="${result_path}/$save" ;;
+esac
+case "$compare" in
+  ""|/*) ;;
+  *) compare="${result_path}/$compare" ;;
+esac
+OSSLSIGNCODE=${OSSLSIGNCODE:-${result_path}/osslsigncode}
+MKBENCH=${MKBENCH:-${result_path}/tests/bench/mkbench}
+MICRO=${MICRO:-${result_path}/tests/bench/micro}
+BENCH_DIR=${BENCH_DIR:-${result_path}/bench}
+
+if test ! -x "$OSSLSIGNCODE" -o ! -x "$MKBENCH"
+  then
+    printf "%s\n" "osslsigncode or mkbench not found, run \"make bench\""
+    exit 1
+  fi
+if test "$mode" = "micro" -a ! -x "$MICRO"
+  then
+    printf "%s\n" "micro not found, run \"make bench-micro\""
+    exit 1
+  fi
+
+now() {
+  t=$(date +%s%N)
+  case "$t" in
+    *N) printf "%s\n" "$(date +%s)000000000" ;;
+    *) printf "%s\n" "$t" ;;
+  esac
+}
+
+make_certs() {
+# a throwaway CA and a code signing certificate, no faketime needed
+  openssl req -x509 -newkey rsa:2048 -nodes -days 30 -subj "/CN=bench CA" \
+      -keyout CAkey.pem -out CACert.pem 2>/dev/null 1>&2 &&
+  printf "%s\n" "basicConstraints=CA:FALSE" "keyUsage=digitalSignature" \
+      "extendedKeyUsage=codeSigning" > cert.ext &&
+  openssl req -newkey rsa:2048 -nodes -subj "/CN=bench signer" \
+      -keyout key.pem -out cert.csr 2>/dev/null 1>&2 &&
+  openssl x509 -req -in cert.csr -CA CACert.pem -CAkey CAkey.pem -CAcreateserial \
+      -days 30 -extfile cert.ext -out cert.pem 2>/dev/null 1>&2
+}
+
+bench() {
+# $1 benchmark name
+# $2 input file (its size is used for MB/s)
+# $3 output file removed before each iteration, or "-"
+# the remaining arguments are the osslsigncode arguments
+
+  name="$1"
+  size=$(wc -c < "$2")
+  out="$3"
+  shift 3
+  i=0
+  start=$(now)
+  while test $i -lt "$iterations"
+    do
+      test "$out" = "-" || rm -f "$out"
+      if ! "$OSSLSIGNCODE" "$@" > "bench.log" 2>&1
+        then
+          printf "%-32s %s\n" "$name" "failed, see bench.log"
+          cat "bench.log"
+          failed=1
+          return 1
+        fi
+      i=$((i + 1))
+    done
+  end=$(now)
+  awk -v n="$name" -v s="$size" -v i="$iterations" -v ns=$((end - start)) 'BEGIN {
+    t = ns / 1e9; if (t <= 0) t = 1e-9
+    printf "%-32s %10.1f %10.3f %10.2f %10.1f\n", n, s / 1048576, t / i * 1e3, i / t, s * i / t / 1048576
+  }'
+}
+
+bench_type() {
+# $1 file type label
+# $2 unsigned input file
+# $3 file name extension
+
+  bench "$1 sign" "$2" "signed.$3" \
+      sign -certs cert.pem -key key.pem -in "$2" -out "signed.$3"
+  bench "$1 verify" "signed.$3" - \
+      verify -CAfile CACert.pem -in "signed.$3"
+  bench "$1 extract-signature" "signed.$3" "sig.p7" \
+      extract-signature -in "signed.$3" -out "sig.p7"
+  bench "$1 remove-signature" "signed.$3" "removed.$3" \
+      remove-signature -in "signed.$3" -out "removed.$3"
+}
+
+rm -rf "${BENCH_DIR}"
+mkdir -p "${BENCH_DIR}"
+cd "${BENCH_DIR}"
+failed=0
+
+if ! make_certs
+  then
+    printf "%s\n" "Failed to create the benchmark certificates"
+    exit 1
+  fi
+
+printf "%s\n" "Generating benchmark files" >&2
+"$MKBENCH" pe "test.exe" "${BENCH_PE_SIZE:-64m}" "${BENCH_PE_SECTIONS:-8}" &&
+"$MKBENCH" cab "test.ex_" "${BENCH_CAB_SIZE:-64m}" "${BENCH_CAB_FOLDERS:-64}" &&
+"$MKBENCH" msi "test.msi" "${BENCH_MSI_STREAMS:-2000}" "${BENCH_MSI_STREAM_SIZE:-1k}" &&
+"$MKBENCH" msi "big.msi" "${BENCH_MSI_BIG_STREAMS:-16}" "${BENCH_MSI_BIG_STREAM_SIZE:-1m}" &&
+"$MKBENCH" cat "test.cat" "${BENCH_CAT_MEMBERS:-10000}" "test.exe" || exit 1
+
+if test "$mode" = "micro"
+  then
+    for f in test.exe test.ex_ test.msi big.msi
+      do
+        "$OSSLSIGNCODE" sign -certs cert.pem -key key.pem -in "$f" -out "signed_$f" \
+            > "bench.log" 2>&1 || { cat "bench.log"; exit 1; }
+      done
+    "$MICRO" $json -n "${iterations:-25}" -CAfile CACert.pem -pe signed_test.exe \
+        -cab signed_test.ex_ -msi signed_test.msi -msi4k signed_big.msi > micro.json
+    failed=$?
+    if test $failed -ne 0
+      then
+        cat micro.json
+      elif test -n "$compare" -a -f "$compare"
+      then
+        ${PYTHON:-python3} "$script_path/compare.py" -threshold "$threshold" \
+            "$compare" micro.json
+        failed=$?
+      elif test -n "$compare"
+      then
+        printf "%s\n" "No baseline found, saving the results to $compare" >&2
+        cp micro.json "$compare"
+      fi
+    test $failed -ne 0 -o -z "$save" || cp micro.json "$save" || failed=1
+    test -n "$save$compare" || cat micro.json
+    cd "${result_path}"
+    test -n "$BENCH_KEEP" || rm -rf "${BENCH_DIR}"
+    exit $failed
+  fi
+iterations=${iterations:-3}
+
+"$OSSLSIGNCODE" -v 2>/dev/null | head -n 2
+printf "%s iteration(s)\n\n" "$iterations"
+printf "%-32s %10s %10s %10s %10s\n" "Benchmark" "Size [MB]" "Time [ms]" "ops/s" "MB/s"
+
+bench_type "PE" "test.exe" "exe"
+bench "PE sign page hashes" "test.exe" "signed_ph.exe" \
+    sign -ph -certs cert.pem -key key.pem -in "test.exe" -out "signed_ph.exe"
+bench "PE verify page hashes" "signed_ph.exe" - \
+    verify -CAfile CACert.pem -in "signed_ph.exe"
+bench_type "CAB" "test.ex_" "ex_"
+bench_type "MSI" "test.msi" "msi"
+bench_type "MSI 4K sectors" "big.msi" "msi"
+bench "CAT sign" "test.cat" "signed.cat" \
+    sign -certs cert.pem -key key.pem -in "test.cat" -out "signed.cat"
+bench "CAT verify" "signed.cat" - \
+    verify -CAfile CACert.pem -in "signed.cat"
+bench "CAT verify member (last)" "test.exe" - \
+    verify -CAfile CACert.pem -catalog "signed.cat" -in "test.exe"
+
+cd "${result_path}"
+test -n "$BENCH_KEEP" || rm -rf "${BENCH_DIR}"
+exit $failed
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Compare microbenchmark results (tests/bench/micro -json) against a baseline.
+
+usage: compare.py [-threshold PERCENT] [-confidence LEVEL] BASELINE CURRENT
+
+The kernels are compared by their median time per byte or item, so the results
+stay comparable when the benchmark input sizes change.  The standard error of
+each median is estimated from its MAD (sigma = 1.4826 * MAD, SE = 1.2533 * sigma
+/ sqrt(samples)), which gives a confidence interval of the relative change.
+A kernel is reported as a regression when the whole interval lies above zero,
+and the exit status is 1 when a regression is bigger than the threshold.
+"""
+
+import json
+import math
+import sys
+
+Z = {0.90: 1.645, 0.95: 1.960, 0.99: 2.576}
+
+
+def usage():
+    sys.stderr.write(__doc__.split("\n\n")[1] + "\n")
+    sys.exit(2)
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return data, {r["name"]: r for r in data.get("results", [])}
+
+
+def per_unit_se(result):
+    """Median per unit and its standard error."""
+    scale = result["per_unit"] / result["median"] if result["median"] else 0.0
+    sigma = 1.4826 * result["mad"] * scale
+    return result["per_unit"], 1.2533 * sigma / math.sqrt(max(result["samples"], 1))
+
+
+def main(argv):
+    threshold, confidence, files = 5.0, 0.95, []
+    i = 0
+    while i < len(argv):
+        if argv[i] == "-threshold" and i + 1 < len(argv):
+            threshold = float(argv[i + 1])
+            i += 1
+        elif argv[i] == "-confidence" and i + 1 < len(argv):
+            confidence = float(argv[i + 1])
+            i += 1
+        else:
+            files.append(argv[i])
+        i += 1
+    if len(files) != 2 or confidence not in Z:
+        usage()
+    z = Z[confidence]
+
+    base, base_results = load(files[0])
+    cur, cur_results = load(files[1])
+    for key in ("version", "openssl", "compiler", "cpu"):
+        if base.get(key) != cur.get(key):
+            print("warning: %s differs: %s (baseline) / %s" % (key, base.get(key), cur.get(key)))
+
+    print("%-26s %14s %14s %9s %21s  %s" % ("Kernel", "baseline", "current", "change",
+                                             "%d%% CI" % round(confidence * 100), "verdict"))
+    failed = 0
+    for name, result in cur_results.items():
+        if name not in base_results:
+            print("%-26s %14s %14.4f %9s %21s  new" % (name, "-", result["per_unit"], "-", "-"))
+            continue
+        b, b_se = per_unit_se(base_results[name])
+        c, c_se = per_unit_se(result)
+        unit = result["unit"]
+        if b <= 0:
+            continue
+        change = (c - b) / b * 100
+        margin = z * math.sqrt(b_se ** 2 + c_se ** 2) / b * 100
+        low, high = change - margin, change + margin
+        if low > 0:
+            verdict = "REGRESSION" if change > threshold else "slower"
+            if change > threshold:
+                failed = 1
+        elif high < 0:
+            verdict = "faster"
+        else:
+            verdict = "~"
+        print("%-26s %14.4f %14.4f %+8.1f%% [%+8.1f%%, %+8.1f%%]  %s %s" % (
+            name, b, c, change, low, high, verdict, unit))
+    for name in base_results:
+        if name not in cur_results:
+            print("%-26s %14.4f %14s %9s %21s  missing" % (name, base_results[name]["per_unit"], "-", "-", "-"))
+    if failed:
+        print("Regressions above %.1f%% found" % threshold)
+    return failed
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
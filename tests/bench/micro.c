@@ -0,0 +1,437 @@
+/*
+ * Microbenchmarks of the osslsigncode hot kernels ("make bench-micro")
+ *
+ * micro [-json] [-n <samples>] [-CAfile <file>] [-pe <signed PE>] [-cab <signed CAB>]
+ *       [-msi <MSI with mini streams>] [-msi4k <MSI with big streams>]
+ *
+ * Each kernel is warmed up and timed in batches of calls lasting at least 1 ms.
+ * The median, the median absolute deviation (MAD) and the 99th percentile
+ * of the time per call are reported, and the median time per processed byte or item.
+ * The JSON output also records the version, the compiler and the CPU model
+ * for the comparison against a stored baseline (tests/bench/compare.py).
+ */
+
+#define main osslsigncode_main
+#include "osslsigncode.c"
+#undef main
+
+size_t micro_msi_chain_length(MSI_FILE *msi, size_t sector);
+void micro_msi_sort_hash(STACK_OF(MSI_DIRENT) *children);
+
+typedef struct {
+	char *indata;
+	size_t filesize;
+	FILE_HEADER header;
+	PKCS7 *p7;
+	X509_STORE *store;
+	MSI_FILE *msi;
+	MSI_DIRENT *dirent;
+	MSI_ENTRY *entry;
+	char *buf;
+	GLOBAL_OPTIONS options;
+} MICRO;
+
+typedef void (*micro_fn)(MICRO *m);
+
+static int samples = 25;
+static int json = 0;
+static int nresults = 0;
+
+#if defined(__clang__)
+#define MICRO_COMPILER "clang " __clang_version__
+#elif defined(__GNUC__)
+#define MICRO_COMPILER "gcc " __VERSION__
+#elif defined(_MSC_VER)
+#define MICRO_COMPILER "msvc"
+#else
+#define MICRO_COMPILER "unknown"
+#endif
+
+static void json_string(const char *key, const char *value)
+{
+	printf("\"%s\":\"", key);
+	for (; *value; value++) {
+		if (*value == '"' || *value == '\\')
+			printf("\\%c", *value);
+		else if ((unsigned char)*value >= 0x20)
+			putchar(*value);
+	}
+	printf("\",\n");
+}
+
+/* CPU model name from /proc/cpuinfo where available */
+static void micro_cpu(char *cpu, size_t len)
+{
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	char line[256];
+
+	snprintf(cpu, len, "unknown");
+	if (!f)
+		return;
+	while (fgets(line, sizeof line, f)) {
+		char *p = strchr(line, ':');
+		if (p && !strncmp(line, "model name", 10)) {
+			for (p++; *p == ' '; p++);
+			p[strcspn(p, "\n")] = '\0';
+			snprintf(cpu, len, "%s", p);
+			break;
+		}
+	}
+	fclose(f);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void micro_run(const char *name, micro_fn fn, MICRO *m, double units, const char *unit)
+{
+	double *t, *dev, median, mad, p99;
+	uint64_t start, elapsed, batch = 1, j;
+	int i;
+
+	/* warm up and calibrate the batch size */
+	for (;;) {
+		start = phase_clock();
+		for (j=0; j<batch; j++)
+			fn(m);
+		elapsed = phase_clock() - start;
+		if (elapsed >= 1000000 || batch >= 1<<20)
+			break;
+		batch *= 2;
+	}
+	t = OPENSSL_malloc(sizeof(double) * samples);
+	dev = OPENSSL_malloc(sizeof(double) * samples);
+	for (i=0; i<samples; i++) {
+		start = phase_clock();
+		for (j=0; j<batch; j++)
+			fn(m);
+		t[i] = (double)(phase_clock() - start) / (double)batch;
+	}
+	qsort(t, samples, sizeof(double), cmp_double);
+	median = t[samples / 2];
+	p99 = t[(samples - 1) * 99 / 100];
+	for (i=0; i<samples; i++)
+		dev[i] = t[i] > median ? t[i] - median : median - t[i];
+	qsort(dev, samples, sizeof(double), cmp_double);
+	mad = dev[samples / 2];
+
+	if (json) {
+		printf("%s{\"name\":\"%s\",\"samples\":%d,\"batch\":%llu,\"median\":%.1f,\"mad\":%.1f,"
+			"\"p99\":%.1f,\"unit\":\"ns/%s\",\"per_unit\":%.4f}",
+			nresults ? ",\n" : "\"results\":[\n", name, samples, (unsigned long long)batch,
+			median, mad, p99, unit, median / units);
+	} else {
+		printf("%-26s %12.1f %10.1f %12.1f %12.4f ns/%s\n",
+			name, median, mad, p99, median / units, unit);
+	}
+	nresults++;
+	OPENSSL_free(t);
+	OPENSSL_free(dev);
+}
+
+static void k_pe_calc_checksum(MICRO *m)
+{
+	BIO *bio = BIO_new_mem_buf(m->indata, (int)m->filesize);
+	pe_calc_checksum(bio, &m->header);
+	BIO_free(bio);
+}
+
+static void k_pe_calc_digest(MICRO *m)
+{
+	unsigned char mdbuf[EVP_MAX_MD_SIZE];
+	pe_calc_digest(m->indata, digest_by_nid(NID_sha256), mdbuf, &m->header);
+}
+
+static void k_pe_calc_page_hash(MICRO *m)
+{
+	size_t phlen;
+	OPENSSL_free(pe_calc_page_hash(m->indata, m->header.header_size, m->header.pe32plus,
+		m->header.sigpos, NID_sha256, &phlen));
+}
+
+static void k_get_indirect_data_blob(MICRO *m)
+{
+	u_char *p = NULL;
+	int len;
+	get_indirect_data_blob(&p, &len, m->options.md, &m->options, &m->header, FILE_TYPE_PE, m->indata);
+	OPENSSL_free(p);
+}
+
+static void k_i2d_PKCS7(MICRO *m)
+{
+	u_char *p = NULL;
+	i2d_PKCS7(m->p7, &p);
+	OPENSSL_free(p);
+}
+
+/* the PKCS7_verify() call of verify_authenticode() */
+static void k_PKCS7_verify(MICRO *m)
+{
+	ASN1_STRING *seq = m->p7->d.sign->contents->d.other->value.sequence;
+	size_t seqhdrlen = asn1_simple_hdr_len(seq->data, seq->length);
+	BIO *bio = BIO_new_mem_buf(seq->data + seqhdrlen, seq->length - (int)seqhdrlen);
+
+	if (!PKCS7_verify(m->p7, NULL, m->store, bio, NULL, m->store ? 0 : PKCS7_NOVERIFY))
+		ERR_clear_error();
+	BIO_free(bio);
+}
+
+static void k_cab_calc_digest(MICRO *m)
+{
+	unsigned char mdbuf[EVP_MAX_MD_SIZE];
+	cab_calc_digest(m->indata, digest_by_nid(NID_sha256), mdbuf, &m->header);
+}
+
+static void k_get_next_sector(MICRO *m)
+{
+	micro_msi_chain_length(m->msi, m->entry->startSectorLocation);
+}
+
+static void k_read_stream(MICRO *m)
+{
+	msi_file_read(m->msi, m->entry, 0, m->buf, GET_UINT32_LE(m->entry->size));
+}
+
+static void k_read_mini_stream(MICRO *m)
+{
+	int i;
+
+	for (i=0; i<sk_MSI_DIRENT_num(m->dirent->children); i++) {
+		MSI_ENTRY *entry = sk_MSI_DIRENT_value(m->dirent->children, i)->entry;
+		uint32_t size = GET_UINT32_LE(entry->size);
+		if (entry->type == DIR_STREAM && size < MINI_STREAM_CUTOFF_SIZE)
+			msi_file_read(m->msi, entry, 0, m->buf, size);
+	}
+}
+
+static void k_msi_dirent_new(MICRO *m)
+{
+	MSI_ENTRY *root = msi_root_entry_get(m->msi);
+	msi_dirent_free(msi_dirent_new(m->msi, root, NULL));
+}
+
+static void k_dirent_cmp_hash(MICRO *m)
+{
+	micro_msi_sort_hash(m->dirent->children);
+}
+
+static int micro_load(MICRO *m, char *infile)
+{
+	memset(m, 0, sizeof(MICRO));
+	m->filesize = get_file_size(infile);
+	if (!m->filesize)
+		return 0; /* FAILED */
+	m->indata = map_file(infile, m->filesize);
+	if (!m->indata) {
+		printf("Failed to open file: %s\n", infile);
+		return 0; /* FAILED */
+	}
+	m->header.fileend = m->filesize;
+	m->options.md = digest_by_nid(NID_sha256);
+	m->options.jp = -1;
+	return 1; /* OK */
+}
+
+static void micro_unload(MICRO *m)
+{
+	PKCS7_free(m->p7);
+	X509_STORE_free(m->store);
+	msi_dirent_free(m->dirent);
+	msi_file_free(m->msi);
+	OPENSSL_free(m->buf);
+#ifdef WIN32
+	UnmapViewOfFile(m->indata);
+#else
+	munmap(m->indata, m->filesize);
+#endif
+}
+
+static int micro_pe(char *infile, char *cafile)
+{
+	MICRO m;
+	size_t phlen;
+	u_char *ph;
+
+	if (!micro_load(&m, infile))
+		return 0; /* FAILED */
+	if (!pe_verify_header(m.indata, infile, m.filesize, &m.header) || !m.header.sigpos) {
+		printf("Signed PE file required: %s\n", infile);
+		micro_unload(&m);
+		return 0; /* FAILED */
+	}
+	m.p7 = pe_extract_existing_pkcs7(m.indata, &m.header);
+	if (!m.p7) {
+		printf("Failed to extract PKCS#7 data: %s\n", infile);
+		micro_unload(&m);
+		return 0; /* FAILED */
+	}
+	if (cafile) {
+		m.store = X509_STORE_new();
+		if (!load_file_lookup(m.store, cafile)) {
+			micro_unload(&m);
+			return 0; /* FAILED */
+		}
+	}
+	ph = pe_calc_page_hash(m.indata, m.header.header_size, m.header.pe32plus,
+		m.header.sigpos, NID_sha256, &phlen);
+	OPENSSL_free(ph);
+
+	micro_run("pe_calc_checksum", k_pe_calc_checksum, &m, (double)m.filesize, "byte");
+	micro_run("pe_calc_digest", k_pe_calc_digest, &m, (double)m.header.sigpos, "byte");
+	micro_run("pe_calc_page_hash", k_pe_calc_page_hash, &m, (double)(phlen / (4 + 32) - 1), "page");
+	micro_run("get_indirect_data_blob", k_get_indirect_data_blob, &m, 1, "op");
+	micro_run("i2d_PKCS7", k_i2d_PKCS7, &m, 1, "op");
+	micro_run("PKCS7_verify", k_PKCS7_verify, &m, 1, "op");
+	micro_unload(&m);
+	return 1; /* OK */
+}
+
+static int micro_cab(char *infile)
+{
+	MICRO m;
+
+	if (!micro_load(&m, infile))
+		return 0; /* FAILED */
+	if (!cab_verify_header(m.indata, infile, m.filesize, &m.header)) {
+		micro_unload(&m);
+		return 0; /* FAILED */
+	}
+	micro_run("cab_calc_digest", k_cab_calc_digest, &m,
+		(double)(m.header.sigpos ? m.header.sigpos : m.header.fileend), "byte");
+	micro_unload(&m);
+	return 1; /* OK */
+}
+
+static int micro_msi(char *infile, int big)
+{
+	MICRO m;
+	MSI_ENTRY *root;
+	uint32_t size = 0, total = 0;
+	int i;
+
+	if (!micro_load(&m, infile))
+		return 0; /* FAILED */
+	m.msi = msi_file_new(m.indata, (uint32_t)m.filesize);
+	if (!m.msi) {
+		micro_unload(&m);
+		return 0; /* FAILED */
+	}
+	root = msi_root_entry_get(m.msi);
+	m.dirent = msi_dirent_new(m.msi, root, NULL);
+	/* the biggest stream and the total size of the mini streams */
+	for (i=0; i<sk_MSI_DIRENT_num(m.dirent->children); i++) {
+		MSI_ENTRY *entry = sk_MSI_DIRENT_value(m.dirent->children, i)->entry;
+		uint32_t len = GET_UINT32_LE(entry->size);
+		if (entry->type != DIR_STREAM)
+			continue;
+		if (len > size) {
+			size = len;
+			m.entry = entry;
+		}
+		if (len < MINI_STREAM_CUTOFF_SIZE)
+			total += len;
+	}
+	m.buf = OPENSSL_malloc(size ? size : 1);
+	if (big) {
+		if (size < MINI_STREAM_CUTOFF_SIZE) {
+			printf("MSI file with streams of at least 4096 bytes required: %s\n", infile);
+			micro_unload(&m);
+			return 0; /* FAILED */
+		}
+		micro_run("get_next_sector", k_get_next_sector, &m,
+			(double)micro_msi_chain_length(m.msi, m.entry->startSectorLocation), "sector");
+		micro_run("read_stream", k_read_stream, &m, (double)size, "byte");
+	} else {
+		int entries = sk_MSI_DIRENT_num(m.dirent->children) + 1;
+		if (!total) {
+			printf("MSI file with mini streams required: %s\n", infile);
+			micro_unload(&m);
+			return 0; /* FAILED */
+		}
+		micro_run("read_mini_stream", k_read_mini_stream, &m, (double)total, "byte");
+		micro_run("msi_dirent_new", k_msi_dirent_new, &m, (double)entries, "entry");
+		micro_run("dirent_cmp_hash sort", k_dirent_cmp_hash, &m, (double)(entries - 1), "entry");
+	}
+	micro_unload(&m);
+	return 1; /* OK */
+}
+
+int main(int argc, char **argv)
+{
+	char *cafile = NULL, *pe = NULL, *cab = NULL, *msi = NULL, *msi4k = NULL;
+	int i, ret = 0;
+
+	for (i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "-json")) {
+			json = 1;
+		} else if (!strcmp(argv[i], "-n") && i+1 < argc) {
+			samples = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-CAfile") && i+1 < argc) {
+			cafile = argv[++i];
+		} else if (!strcmp(argv[i], "-pe") && i+1 < argc) {
+			pe = argv[++i];
+		} else if (!strcmp(argv[i], "-cab") && i+1 < argc) {
+			cab = argv[++i];
+		} else if (!strcmp(argv[i], "-msi") && i+1 < argc) {
+			msi = argv[++i];
+		} else if (!strcmp(argv[i], "-msi4k") && i+1 < argc) {
+			msi4k = argv[++i];
+		} else {
+			printf("Usage: %s [-json] [-n <samples>] [-CAfile <file>] [-pe <signed PE>] [-cab <signed CAB>]\n"
+				"%8s[-msi <MSI with mini streams>] [-msi4k <MSI with big streams>]\n", argv[0], "");
+			return 1;
+		}
+	}
+	if (samples < 1)
+		samples = 1;
+
+	/* the same initialization as osslsigncode */
+	if (!OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS
+			| OPENSSL_INIT_ADD_ALL_CIPHERS
+			| OPENSSL_INIT_ADD_ALL_DIGESTS
+			| OPENSSL_INIT_LOAD_CONFIG, NULL))
+		return 1;
+	if (!OBJ_create(SPC_STATEMENT_TYPE_OBJID, NULL, NULL) ||
+			!OBJ_create(MS_JAVA_SOMETHING, NULL, NULL) ||
+			!OBJ_create(SPC_SP_OPUS_INFO_OBJID, NULL, NULL) ||
+			!OBJ_create(SPC_NESTED_SIGNATURE_OBJID, NULL, NULL))
+		return 1;
+
+	if (json) {
+		char cpu[256];
+
+		micro_cpu(cpu, sizeof cpu);
+		printf("{\n");
+		json_string("version", PACKAGE_VERSION);
+		json_string("openssl", OpenSSL_version(OPENSSL_VERSION));
+		json_string("compiler", MICRO_COMPILER);
+		json_string("cpu", cpu);
+	} else {
+		printf("%-26s %12s %10s %12s %12s\n", "Kernel [ns/call]", "median", "MAD", "p99", "median/unit");
+	}
+	if (pe && !micro_pe(pe, cafile))
+		ret = 1;
+	if (cab && !micro_cab(cab))
+		ret = 1;
+	if (msi && !micro_msi(msi, 0))
+		ret = 1;
+	if (msi4k && !micro_msi(msi4k, 1))
+		ret = 1;
+	if (json)
+		printf("%s]\n}\n", nresults ? "\n" : "\"results\":[\n");
+	digest_table_free();
+	return ret;
+}
+
+/*
+Local Variables:
+   c-basic-offset: 4
+   tab-width: 4
+   indent-tabs-mode: t
+End:
+
+  vim: set ts=4 noexpandtab:
+*/
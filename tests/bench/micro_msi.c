@@ -0,0 +1,40 @@
+/*
+ * Access to the static kernels of msi.c for the microbenchmarks (micro.c)
+ */
+
+#include "msi.c"
+
+size_t micro_msi_chain_length(MSI_FILE *msi, size_t sector);
+void micro_msi_sort_hash(STACK_OF(MSI_DIRENT) *children);
+
+/* Follow a FAT sector chain with get_next_sector() */
+size_t micro_msi_chain_length(MSI_FILE *msi, size_t sector)
+{
+	size_t n = 0;
+
+	while (sector < MAXREGSECT) {
+		sector = get_next_sector(msi, sector);
+		n++;
+	}
+	return n;
+}
+
+/* Sort a copy of the children in the msi_hash_dir() order */
+void micro_msi_sort_hash(STACK_OF(MSI_DIRENT) *children)
+{
+	STACK_OF(MSI_DIRENT) *copy = sk_MSI_DIRENT_dup(children);
+
+	sk_MSI_DIRENT_set_cmp_func(copy, &dirent_cmp_hash);
+	sk_MSI_DIRENT_sort(copy);
+	sk_MSI_DIRENT_free(copy);
+}
+
+/*
+Local Variables:
+   c-basic-offset: 4
+   tab-width: 4
+   indent-tabs-mode: t
+End:
+
+  vim: set ts=4 noexpandtab:
+*/
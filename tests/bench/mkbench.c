@@ -0,0 +1,596 @@
+/*
+ * Synthetic input generator for the osslsigncode benchmarks
+ *
+ * mkbench pe <outfile> <size> <sections>
+ * mkbench cab <outfile> <size> <folders>
+ * mkbench msi <outfile> <streams> <stream size>
+ * mkbench cat <outfile> <members> [<PE file>]
+ *
+ * Sizes are in bytes and accept the "k" and "m" suffixes.
+ * The content is pseudo-random, so it does not compress or hash trivially.
+ * The generated files are unsigned and only as valid as osslsigncode requires.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+#define PUT_UINT16_LE(i,p) \
+	((unsigned char*)(p))[0] = (i) & 0xff; \
+	((unsigned char*)(p))[1] = ((i)>>8) & 0xff
+
+#define PUT_UINT32_LE(i,p) \
+	((unsigned char*)(p))[0] = (i) & 0xff; \
+	((unsigned char*)(p))[1] = ((i)>>8) & 0xff; \
+	((unsigned char*)(p))[2] = ((i)>>16) & 0xff; \
+	((unsigned char*)(p))[3] = ((i)>>24) & 0xff
+
+#define GET_UINT32_LE(p) (((unsigned char*)(p))[0] | (((unsigned char*)(p))[1]<<8) | \
+	(((unsigned char*)(p))[2]<<16) | (((unsigned char*)(p))[3]<<24))
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+} BUF;
+
+static uint64_t rnd_state = 0x9e3779b97f4a7c15ULL;
+
+static void fill_random(unsigned char *p, size_t len)
+{
+	while (len--) {
+		rnd_state ^= rnd_state << 13;
+		rnd_state ^= rnd_state >> 7;
+		rnd_state ^= rnd_state << 17;
+		*p++ = (unsigned char)rnd_state;
+	}
+}
+
+static void *xzalloc(size_t len)
+{
+	void *p = calloc(1, len ? len : 1);
+	if (!p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static size_t parse_size(const char *str)
+{
+	char *end;
+	size_t n = strtoul(str, &end, 10);
+
+	if (*end == 'k' || *end == 'K')
+		n *= 1024;
+	else if (*end == 'm' || *end == 'M')
+		n *= 1024 * 1024;
+	return n;
+}
+
+static int write_file(const char *outfile, const unsigned char *data, size_t len)
+{
+	FILE *f = fopen(outfile, "wb");
+
+	if (!f || fwrite(data, 1, len, f) != len) {
+		fprintf(stderr, "Failed to write %s\n", outfile);
+		if (f)
+			fclose(f);
+		return 0; /* FAILED */
+	}
+	fclose(f);
+	return 1; /* OK */
+}
+
+/*
+ * PE32+ image with the given number of sections,
+ * the section data fills the requested file size
+ */
+static int make_pe(const char *outfile, size_t size, int nsections)
+{
+	const uint32_t peoff = 0x40, filealign = 0x200, pagesize = 0x1000;
+	uint32_t hdrsize, rawsize, vaddr, ptr;
+	unsigned char *buf, *pe, *sec;
+	int i, ret;
+
+	if (nsections < 1 || nsections > 90) {
+		fprintf(stderr, "The number of sections must be between 1 and 90\n");
+		return 0; /* FAILED */
+	}
+	hdrsize = (peoff + 24 + 240 + 40 * nsections + filealign - 1) / filealign * filealign;
+	if (size < hdrsize + (size_t)nsections * filealign)
+		size = hdrsize + (size_t)nsections * filealign;
+	rawsize = (uint32_t)((size - hdrsize) / nsections / filealign * filealign);
+	size = hdrsize + (size_t)rawsize * nsections;
+	buf = xzalloc(size);
+
+	/* DOS header */
+	memcpy(buf, "MZ", 2);
+	PUT_UINT32_LE(peoff, buf + 60);
+	/* COFF file header */
+	pe = buf + peoff;
+	memcpy(pe, "PE\0\0", 4);
+	PUT_UINT16_LE(0x8664, pe + 4);          /* Machine: AMD64 */
+	PUT_UINT16_LE(nsections, pe + 6);       /* NumberOfSections */
+	PUT_UINT16_LE(240, pe + 20);            /* SizeOfOptionalHeader */
+	PUT_UINT16_LE(0x0022, pe + 22);         /* Characteristics */
+	/* PE32+ optional header */
+	PUT_UINT16_LE(0x20b, pe + 24);          /* Magic */
+	PUT_UINT32_LE(pagesize, pe + 56);       /* SectionAlignment */
+	PUT_UINT32_LE(filealign, pe + 60);      /* FileAlignment */
+	PUT_UINT16_LE(6, pe + 72);              /* MajorSubsystemVersion */
+	PUT_UINT32_LE(hdrsize, pe + 84);        /* SizeOfHeaders */
+	PUT_UINT16_LE(3, pe + 92);              /* Subsystem: console */
+	PUT_UINT32_LE(16, pe + 132);            /* NumberOfRvaAndSizes */
+
+	/* section table */
+	sec = pe + 24 + 240;
+	vaddr = pagesize;
+	ptr = hdrsize;
+	for (i=0; i<nsections; i++, sec += 40) {
+		snprintf((char *)sec, 8, ".s%d", i);
+		PUT_UINT32_LE(rawsize, sec + 8);    /* VirtualSize */
+		PUT_UINT32_LE(vaddr, sec + 12);     /* VirtualAddress */
+		PUT_UINT32_LE(rawsize, sec + 16);   /* SizeOfRawData */
+		PUT_UINT32_LE(ptr, sec + 20);       /* PointerToRawData */
+		PUT_UINT32_LE(0x40000040, sec + 36); /* Characteristics: initialized data, readable */
+		fill_random(buf + ptr, rawsize);
+		vaddr += (rawsize + pagesize - 1) / pagesize * pagesize;
+		ptr += rawsize;
+	}
+	PUT_UINT32_LE(vaddr, pe + 80);          /* SizeOfImage */
+
+	ret = write_file(outfile, buf, size);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Uncompressed cabinet with one file per folder,
+ * each folder is split into CFDATA blocks of 32 KB
+ */
+static int make_cab(const char *outfile, size_t size, int nfolders)
+{
+	const uint32_t blocksize = 32768;
+	uint32_t filesize, coffFiles, off, i, j;
+	size_t len, names = 0;
+	unsigned char *buf, *p;
+
+	if (nfolders < 1 || nfolders > 65535) {
+		fprintf(stderr, "The number of folders must be between 1 and 65535\n");
+		return 0; /* FAILED */
+	}
+	filesize = (uint32_t)(size / nfolders);
+	if (filesize == 0)
+		filesize = 1;
+	for (i=0; i<(uint32_t)nfolders; i++) {
+		char name[32];
+		names += (size_t)snprintf(name, sizeof name, "file%05u.bin", i) + 1;
+	}
+	coffFiles = 36 + 8 * nfolders;
+	len = coffFiles + 16 * (size_t)nfolders + names
+		+ (size_t)nfolders * ((filesize + blocksize - 1) / blocksize * 8 + filesize);
+	if (len > 0x7fffffff) {
+		fprintf(stderr, "The cabinet file is too big\n");
+		return 0; /* FAILED */
+	}
+	buf = xzalloc(len);
+
+	/* CFHEADER */
+	memcpy(buf, "MSCF", 4);
+	PUT_UINT32_LE(len, buf + 8);            /* cbCabinet */
+	PUT_UINT32_LE(coffFiles, buf + 16);     /* coffFiles */
+	buf[24] = 3;                            /* versionMinor */
+	buf[25] = 1;                            /* versionMajor */
+	PUT_UINT16_LE(nfolders, buf + 26);      /* cFolders */
+	PUT_UINT16_LE(nfolders, buf + 28);      /* cFiles */
+	PUT_UINT16_LE(0x1234, buf + 32);        /* setID */
+
+	/* CFFILE entries */
+	p = buf + coffFiles;
+	for (i=0; i<(uint32_t)nfolders; i++) {
+		PUT_UINT32_LE(filesize, p);         /* cbFile */
+		PUT_UINT16_LE(i, p + 8);            /* iFolder */
+		PUT_UINT16_LE(0x5021, p + 10);      /* date */
+		PUT_UINT16_LE(0x20, p + 14);        /* attribs: archive */
+		p += 16;
+		p += snprintf((char *)p, 32, "file%05u.bin", i) + 1;
+	}
+	/* CFFOLDER entries and CFDATA blocks */
+	for (i=0; i<(uint32_t)nfolders; i++) {
+		unsigned char *folder = buf + 36 + 8 * i;
+		uint32_t nblocks = (filesize + blocksize - 1) / blocksize;
+
+		PUT_UINT32_LE((uint32_t)(p - buf), folder); /* coffCabStart */
+		PUT_UINT16_LE(nblocks, folder + 4);         /* cCFData */
+		for (j=0, off=0; j<nblocks; j++, off += blocksize) {
+			uint32_t n = filesize - off < blocksize ? filesize - off : blocksize;
+			PUT_UINT16_LE(n, p + 4);                /* cbData */
+			PUT_UINT16_LE(n, p + 6);                /* cbUncomp */
+			fill_random(p + 8, n);
+			p += 8 + n;
+		}
+	}
+	j = write_file(outfile, buf, len);
+	free(buf);
+	return (int)j;
+}
+
+/*
+ * Compound file with the given number of streams in the root storage.
+ * Streams smaller than 4096 bytes are stored in the mini stream.
+ * Files bigger than 7 MB are written with 4096-byte sectors (version 4).
+ */
+static void msi_tree(unsigned char *dir, uint32_t first, uint32_t last, uint32_t *root)
+{
+	uint32_t mid, left = 0xffffffff, right = 0xffffffff;
+
+	if (first > last) {
+		*root = 0xffffffff;
+		return;
+	}
+	mid = first + (last - first) / 2;
+	if (mid > first)
+		msi_tree(dir, first, mid - 1, &left);
+	if (mid < last)
+		msi_tree(dir, mid + 1, last, &right);
+	PUT_UINT32_LE(left, dir + mid * 128 + 0x44);
+	PUT_UINT32_LE(right, dir + mid * 128 + 0x48);
+	*root = mid;
+}
+
+static int make_msi(const char *outfile, uint32_t nstreams, size_t streamsize)
+{
+	static const unsigned char magic[] = {0xd0, 0xcf, 0x11, 0xe0, 0xa1, 0xb1, 0x1a, 0xe1};
+	size_t sectorsize = 512, datasectors, ministream, minisectors, minifatsectors;
+	size_t containersectors, dirsectors, fatsectors, total, len, i, j;
+	uint32_t sect, child, *fat;
+	unsigned char *buf, *dir;
+	int ret, mini = streamsize < 4096;
+
+	if (nstreams < 1 || nstreams > 100000) {
+		fprintf(stderr, "The number of streams must be between 1 and 100000\n");
+		return 0; /* FAILED */
+	}
+	if ((size_t)nstreams * streamsize > 7 * 1024 * 1024)
+		sectorsize = 4096;
+retry:
+	datasectors = mini ? 0 : nstreams * ((streamsize + sectorsize - 1) / sectorsize);
+	minisectors = mini ? nstreams * ((streamsize + 63) / 64) : 0;
+	ministream = minisectors * 64;
+	containersectors = (ministream + sectorsize - 1) / sectorsize;
+	minifatsectors = (minisectors * 4 + sectorsize - 1) / sectorsize;
+	dirsectors = ((size_t)(nstreams + 1) * 128 + sectorsize - 1) / sectorsize;
+	total = datasectors + containersectors + minifatsectors + dirsectors;
+	fatsectors = 0;
+	while (fatsectors * sectorsize / 4 < total + fatsectors)
+		fatsectors++;
+	total += fatsectors;
+	if (fatsectors > 109) {
+		if (sectorsize == 512) {
+			sectorsize = 4096;
+			goto retry;
+		}
+		fprintf(stderr, "DIFAT sectors are not supported\n");
+		return 0; /* FAILED */
+	}
+	len = (total + 1) * sectorsize;
+	buf = xzalloc(len);
+	fat = xzalloc(fatsectors * sectorsize);
+	for (i=0; i<fatsectors * sectorsize / 4; i++)
+		fat[i] = 0xffffffff; /* FREESECT */
+
+	/* header */
+	memcpy(buf, magic, sizeof magic);
+	PUT_UINT16_LE(0x3e, buf + 0x18);
+	PUT_UINT16_LE(sectorsize == 512 ? 3 : 4, buf + 0x1a);
+	PUT_UINT16_LE(0xfffe, buf + 0x1c);
+	PUT_UINT16_LE(sectorsize == 512 ? 9 : 12, buf + 0x1e);
+	PUT_UINT16_LE(6, buf + 0x20);
+	if (sectorsize == 4096) {
+		PUT_UINT32_LE(dirsectors, buf + 0x28);
+	}
+	PUT_UINT32_LE(fatsectors, buf + 0x2c);
+	PUT_UINT32_LE(0x1000, buf + 0x38);
+	PUT_UINT32_LE(0xfffffffe, buf + 0x44); /* no DIFAT sectors */
+	for (i=0; i<109; i++) {
+		PUT_UINT32_LE(i < fatsectors ? (uint32_t)(total - fatsectors + i) : 0xffffffff,
+			buf + 0x4c + 4*i);
+	}
+
+	/* directory entries, the entry 0 is the root storage */
+	sect = (uint32_t)(datasectors + containersectors + minifatsectors);
+	dir = buf + (sect + 1) * sectorsize;
+	PUT_UINT32_LE(sect, buf + 0x30);
+	for (i=0; i<=nstreams; i++) {
+		unsigned char *e = dir + i * 128;
+		char name[32];
+		int n = i ? snprintf(name, sizeof name, "Stream%06u", (unsigned)i)
+			: snprintf(name, sizeof name, "Root Entry");
+		for (j=0; j<(size_t)n; j++)
+			e[2*j] = (unsigned char)name[j];
+		PUT_UINT16_LE(2*n + 2, e + 0x40);
+		e[0x42] = i ? 2 : 5;               /* stream or root storage */
+		e[0x43] = 1;                       /* black */
+		PUT_UINT32_LE(0xffffffff, e + 0x44);
+		PUT_UINT32_LE(0xffffffff, e + 0x48);
+		PUT_UINT32_LE(0xffffffff, e + 0x4c);
+	}
+	msi_tree(dir, 1, nstreams, &child);
+	PUT_UINT32_LE(child, dir + 0x4c);
+	/* unused entries in the last directory sector */
+	for (i=nstreams+1; i<dirsectors * sectorsize / 128; i++) {
+		PUT_UINT32_LE(0xffffffff, dir + i * 128 + 0x44);
+		PUT_UINT32_LE(0xffffffff, dir + i * 128 + 0x48);
+		PUT_UINT32_LE(0xffffffff, dir + i * 128 + 0x4c);
+	}
+
+	/* stream data */
+	sect = 0;
+	if (mini) {
+		uint32_t container = (uint32_t)datasectors, minifat = container + (uint32_t)containersectors;
+		uint32_t *mfat = (uint32_t *)(buf + (minifat + 1) * sectorsize);
+		uint32_t msect = 0, per = (uint32_t)((streamsize + 63) / 64);
+
+		for (i=0; i<minifatsectors * sectorsize / 4; i++)
+			mfat[i] = 0xffffffff;
+		for (i=1; i<=nstreams; i++) {
+			PUT_UINT32_LE(per ? msect : 0xfffffffe, dir + i * 128 + 0x74);
+			PUT_UINT32_LE(streamsize, dir + i * 128 + 0x78);
+			for (j=0; j<per; j++, msect++) {
+				uint32_t next = j + 1 < per ? msect + 1 : 0xfffffffe;
+				PUT_UINT32_LE(next, (unsigned char *)&mfat[msect]);
+			}
+		}
+		fill_random(buf + (container + 1) * sectorsize, ministream);
+		for (i=0; i<containersectors; i++)
+			fat[container + i] = i + 1 < containersectors ? (uint32_t)(container + i + 1) : 0xfffffffe;
+		for (i=0; i<minifatsectors; i++)
+			fat[minifat + i] = i + 1 < minifatsectors ? (uint32_t)(minifat + i + 1) : 0xfffffffe;
+		PUT_UINT32_LE(containersectors ? container : 0xfffffffe, dir + 0x74);
+		PUT_UINT32_LE(ministream, dir + 0x78);
+		PUT_UINT32_LE(minifatsectors ? minifat : 0xfffffffe, buf + 0x3c);
+		PUT_UINT32_LE(minifatsectors, buf + 0x40);
+	} else {
+		size_t per = (streamsize + sectorsize - 1) / sectorsize;
+
+		PUT_UINT32_LE(0xfffffffe, dir + 0x74);
+		PUT_UINT32_LE(0xfffffffe, buf + 0x3c);
+		for (i=1; i<=nstreams; i++) {
+			PUT_UINT32_LE(sect, dir + i * 128 + 0x74);
+			PUT_UINT32_LE(streamsize, dir + i * 128 + 0x78);
+			fill_random(buf + (sect + 1) * sectorsize, streamsize);
+			for (j=0; j<per; j++, sect++)
+				fat[sect] = j + 1 < per ? sect + 1 : 0xfffffffe;
+		}
+	}
+	sect = (uint32_t)(datasectors + containersectors + minifatsectors);
+	for (i=0; i<dirsectors; i++)
+		fat[sect + i] = i + 1 < dirsectors ? (uint32_t)(sect + i + 1) : 0xfffffffe;
+	for (i=0; i<fatsectors; i++)
+		fat[total - fatsectors + i] = 0xfffffffd; /* FATSECT */
+	for (i=0; i<fatsectors * sectorsize / 4; i++) {
+		PUT_UINT32_LE(fat[i], buf + (total - fatsectors + 1) * sectorsize + 4*i);
+	}
+	ret = write_file(outfile, buf, len);
+	free(fat);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Minimal DER encoder for the catalog generator
+ */
+static void der_add(BUF *out, const unsigned char *data, size_t len)
+{
+	out->data = realloc(out->data, out->len + len);
+	if (!out->data) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+}
+
+static void der_put(BUF *out, int tag, const unsigned char *data, size_t len)
+{
+	unsigned char hdr[6];
+	size_t n = 0;
+
+	hdr[n++] = (unsigned char)tag;
+	if (len < 0x80) {
+		hdr[n++] = (unsigned char)len;
+	} else if (len < 0x100) {
+		hdr[n++] = 0x81;
+		hdr[n++] = (unsigned char)len;
+	} else if (len < 0x10000) {
+		hdr[n++] = 0x82;
+		hdr[n++] = (unsigned char)(len >> 8);
+		hdr[n++] = (unsigned char)len;
+	} else {
+		hdr[n++] = 0x83;
+		hdr[n++] = (unsigned char)(len >> 16);
+		hdr[n++] = (unsigned char)(len >> 8);
+		hdr[n++] = (unsigned char)len;
+	}
+	der_add(out, hdr, n);
+	der_add(out, data, len);
+}
+
+/* Wrap the content of "in" with the given tag and free it */
+static void der_wrap(BUF *out, int tag, BUF *in)
+{
+	der_put(out, tag, in->data, in->len);
+	free(in->data);
+	in->data = NULL;
+	in->len = 0;
+}
+
+/* Authenticode digest of an unsigned PE file (without the checksum and the certificate table entry) */
+static int pe_digest(const char *infile, unsigned char *mdbuf)
+{
+	FILE *f = fopen(infile, "rb");
+	unsigned char *buf;
+	size_t len;
+	uint32_t pe, dd;
+	EVP_MD_CTX *mdctx;
+
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", infile);
+		return 0; /* FAILED */
+	}
+	fseek(f, 0, SEEK_END);
+	len = (size_t)ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = xzalloc(len);
+	if (fread(buf, 1, len, f) != len) {
+		fclose(f);
+		free(buf);
+		return 0; /* FAILED */
+	}
+	fclose(f);
+	pe = GET_UINT32_LE(buf + 60);
+	dd = buf[pe + 24] == 0x0b && buf[pe + 25] == 0x02 ? 16 : 0;
+	mdctx = EVP_MD_CTX_new();
+	EVP_DigestInit(mdctx, EVP_sha256());
+	EVP_DigestUpdate(mdctx, buf, pe + 88);
+	EVP_DigestUpdate(mdctx, buf + pe + 92, 60 + dd);
+	EVP_DigestUpdate(mdctx, buf + pe + 160 + dd, len - (pe + 160 + dd));
+	EVP_DigestFinal(mdctx, mdbuf, NULL);
+	EVP_MD_CTX_free(mdctx);
+	free(buf);
+	return 1; /* OK */
+}
+
+/*
+ * Unsigned catalog file (PKCS#7 signed data with a CTL content) with the given
+ * number of PE members. The last member holds the digest of the optional PE file,
+ * so "verify -catalog" has to scan the whole list.
+ */
+static int make_cat(const char *outfile, int nmembers, const char *pefile)
+{
+	static const unsigned char spc_indirect_data[] = {
+		0x06, 0x0a, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x01, 0x04};
+	static const unsigned char pe_image_data[] = {
+		0x30, 0x18, 0x06, 0x0a, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x01, 0x0f,
+		0x30, 0x0a, 0x03, 0x02, 0x00, 0x00, 0xa0, 0x04, 0xa2, 0x02, 0x80, 0x00};
+	static const unsigned char sha256_alg[] = {
+		0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00};
+	static const unsigned char ctl_usage[] = {
+		0x30, 0x0c, 0x06, 0x0a, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x0c, 0x01, 0x01};
+	static const unsigned char ctl_time[] = {
+		0x17, 0x0d, '2', '1', '0', '1', '0', '1', '0', '0', '0', '0', '0', '0', 'Z'};
+	static const unsigned char ctl_alg[] = {
+		0x30, 0x0e, 0x06, 0x0a, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x0c, 0x01, 0x02, 0x05, 0x00};
+	static const unsigned char ms_ctl[] = {
+		0x06, 0x09, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x0a, 0x01};
+	static const unsigned char signed_data[] = {
+		0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x02};
+	static const unsigned char version[] = {0x02, 0x01, 0x01};
+	BUF members = {NULL, 0}, ctl = {NULL, 0}, tmp = {NULL, 0}, tmp2 = {NULL, 0}, out = {NULL, 0};
+	unsigned char digest[32], id[16];
+	int i, ret;
+
+	if (nmembers < 1) {
+		fprintf(stderr, "The number of members must be positive\n");
+		return 0; /* FAILED */
+	}
+	for (i=0; i<nmembers; i++) {
+		BUF idc = {NULL, 0}, attr = {NULL, 0}, member = {NULL, 0};
+		unsigned char tag[2 * 8 * 2];
+		char name[9];
+		int j;
+
+		if (i == nmembers - 1 && pefile) {
+			if (!pe_digest(pefile, digest))
+				return 0; /* FAILED */
+		} else {
+			fill_random(digest, sizeof digest);
+		}
+		/* SpcIndirectDataContent */
+		der_add(&idc, pe_image_data, sizeof pe_image_data);
+		der_add(&tmp, sha256_alg, sizeof sha256_alg);
+		der_put(&tmp, 0x04, digest, sizeof digest);
+		der_wrap(&idc, 0x30, &tmp);
+		der_wrap(&tmp2, 0x30, &idc);
+		/* SEQUENCE { SPC_INDIRECT_DATA_OBJID, SET { SpcIndirectDataContent } } */
+		der_add(&attr, spc_indirect_data, sizeof spc_indirect_data);
+		der_wrap(&attr, 0x31, &tmp2);
+		der_wrap(&tmp, 0x30, &attr);
+		/* member tag: UTF-16LE hex name */
+		snprintf(name, sizeof name, "%08X", (unsigned)i);
+		memset(tag, 0, sizeof tag);
+		for (j=0; j<8; j++)
+			tag[2*j] = (unsigned char)name[j];
+		der_put(&member, 0x04, tag, 16 + 2);
+		der_wrap(&member, 0x31, &tmp);
+		der_wrap(&members, 0x30, &member);
+	}
+	/* MsCtlContent */
+	fill_random(id, sizeof id);
+	der_add(&ctl, ctl_usage, sizeof ctl_usage);
+	der_put(&ctl, 0x04, id, sizeof id);
+	der_add(&ctl, ctl_time, sizeof ctl_time);
+	der_add(&ctl, ctl_alg, sizeof ctl_alg);
+	der_wrap(&ctl, 0x30, &members);
+	der_wrap(&tmp, 0x30, &ctl);
+	/* ContentInfo { MS_CTL_OBJID, [0] { MsCtlContent } } */
+	der_add(&tmp2, ms_ctl, sizeof ms_ctl);
+	der_wrap(&tmp2, 0xa0, &tmp);
+	/* SignedData without signers */
+	der_add(&tmp, version, sizeof version);
+	der_put(&tmp, 0x31, NULL, 0);
+	der_wrap(&tmp, 0x30, &tmp2);
+	der_put(&tmp, 0x31, NULL, 0);
+	der_wrap(&tmp2, 0x30, &tmp);
+	der_add(&tmp, signed_data, sizeof signed_data);
+	der_wrap(&tmp, 0xa0, &tmp2);
+	der_wrap(&out, 0x30, &tmp);
+	if (out.len < 256) {
+		fprintf(stderr, "The catalog file is too small, add more members\n");
+		free(out.data);
+		return 0; /* FAILED */
+	}
+	ret = write_file(outfile, out.data, out.len);
+	free(out.data);
+	return ret;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s pe <outfile> <size> <sections>\n"
+		"       %s cab <outfile> <size> <folders>\n"
+		"       %s msi <outfile> <streams> <stream size>\n"
+		"       %s cat <outfile> <members> [<PE file>]\n",
+		argv0, argv0, argv0, argv0);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+
+	if (argc >= 5 && !strcmp(argv[1], "pe"))
+		ret = make_pe(argv[2], parse_size(argv[3]), atoi(argv[4]));
+	else if (argc >= 5 && !strcmp(argv[1], "cab"))
+		ret = make_cab(argv[2], parse_size(argv[3]), atoi(argv[4]));
+	else if (argc >= 5 && !strcmp(argv[1], "msi"))
+		ret = make_msi(argv[2], (uint32_t)parse_size(argv[3]), parse_size(argv[4]));
+	else if (argc >= 4 && !strcmp(argv[1], "cat"))
+		ret = make_cat(argv[2], atoi(argv[3]), argc >= 5 ? argv[4] : NULL);
+	else
+		usage(argv[0]);
+	return ret ? 0 : 1;
+}
+
+/*
+Local Variables:
+   c-basic-offset: 4
+   tab-width: 4
+   indent-tabs-mode: t
+End:
+
+  vim: set ts=4 noexpandtab:
+*/
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Reference external signer for the "-signer-cmd" option.
+# Usage: osslsigncode sign -certs cert.pem -signer-cmd "external_signer.sh key.pem" ...
+# Reads "<digest name> <hex digest>" lines from the standard input
+# and writes one "<hex signature>" line per request to the standard output.
+
+key="$1"
+
+while read -r md digest
+  do
+    printf "%s" "$digest" | xxd -r -p | \
+      openssl pkeyutl -sign -inkey "$key" -pkeyopt "digest:$md" | \
+      xxd -p -c 4096
+  done
+
+exit 0